@@ -29,11 +29,18 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ipc.h>
 #include <netdb.h>
 #include <sys/shm.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include <mqueue.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
 #include <sys/stat.h>
 #include <signal.h>
 #include <dirent.h>
@@ -47,6 +54,32 @@
 #include <openssl/ssl.h>
 #endif
 
+#ifdef GZIP
+#include <zlib.h>
+#endif
+
+#ifdef BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef IOURING  /* Linux only */
+#undef EPOLL                                        /* io_uring does the waiting itself */
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef EPOLL    /* Linux only */
+#include <sys/epoll.h>
+#endif
+
+#ifdef THREADS  /* Linux only */
+#include <pthread.h>
+#define THREAD_LOCAL                __thread        /* every thread has its own copy */
+#else
+#define THREAD_LOCAL
+#endif
+
 #ifdef __cplusplus
 #include <cctype>
 #else
@@ -118,14 +151,11 @@ typedef char                        bool;
 /* generate output as fast as possible */
 #ifdef NOSTPCPY /* alas! */
 
-    #define HOUT(s)                     (strcpy(conn[ci].p_curr_h, s), conn[ci].p_curr_h += strlen(s))
     #define OUTS(s)                     (strcpy(conn[ci].p_curr_c, s), conn[ci].p_curr_c += strlen(s))
     #define OUT_BIN(data, len)          (len=(len>OUT_BUFSIZE?OUT_BUFSIZE:len), memcpy(conn[ci].p_curr_c, data, len), conn[ci].p_curr_c += len)
 
 #else   /* faster */
 
-    #define HOUT(s)                     (conn[ci].p_curr_h = stpcpy(conn[ci].p_curr_h, s))
-
     #ifdef OUTFAST
         #define OUTS(s)                     (conn[ci].p_curr_c = stpcpy(conn[ci].p_curr_c, s))
         #define OUT_BIN(data, len)          (len=(len>OUT_BUFSIZE?OUT_BUFSIZE:len), memcpy(conn[ci].p_curr_c, data, len), conn[ci].p_curr_c += len)
@@ -142,25 +172,29 @@ typedef char                        bool;
 #endif  /* NOSTPCPY */
 
 
-#define OUTM(s, ...)                (sprintf(G_tmp, s, __VA_ARGS__), OUTS(G_tmp))   /* OUT with multiple args */
+#define OUTM(s, ...)                eng_out_fmt(ci, s, __VA_ARGS__)     /* OUT with multiple args */
 
 #define CHOOSE_OUT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, NAME, ...) NAME          /* single or multiple? */
 #define OUT(...)                    CHOOSE_OUT(__VA_ARGS__, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTS)(__VA_ARGS__)
 
 
-/* HTTP header -- resets respbuf! */
-#define PRINT_HTTP_STATUS(st)       (sprintf(G_tmp, "HTTP/1.1 %d %s\r\n", st, get_http_descr(st)), HOUT(G_tmp))
+/* HTTP header -- written straight into conn[ci].header, bounds-checked */
+#define HOUT(s)                     hdr_add(ci, s, strlen(s))
+
+#define PRINT_HTTP_STATUS(st)       hdr_status(ci, st)
 
 /* date */
-#define PRINT_HTTP_DATE             (sprintf(G_tmp, "Date: %s\r\n", M_resp_date), HOUT(G_tmp))
+#define PRINT_HTTP_DATE             hdr_add(ci, M_resp_date, M_resp_date_len)
 
 /* cache control */
 #define PRINT_HTTP_NO_CACHE         HOUT("Cache-Control: private, must-revalidate, no-store, no-cache, max-age=0\r\n")
-#define PRINT_HTTP_EXPIRES          (sprintf(G_tmp, "Expires: %s\r\n", M_expires), HOUT(G_tmp))
-#define PRINT_HTTP_LAST_MODIFIED(s) (sprintf(G_tmp, "Last-Modified: %s\r\n", s), HOUT(G_tmp))
+#define PRINT_HTTP_CACHE_IMMUTABLE  HOUT("Cache-Control: public, max-age=31536000, immutable\r\n")
+#define PRINT_HTTP_EXPIRES          hdr_line(ci, 3, "Expires: ", M_expires, "\r\n")
+#define PRINT_HTTP_LAST_MODIFIED(s) hdr_line(ci, 3, "Last-Modified: ", s, "\r\n")
+#define PRINT_HTTP_ETAG(s, enc)     hdr_line(ci, 4, "ETag: \"", s, enc==CONTENT_ENC_GZIP?"-gz":enc==CONTENT_ENC_BR?"-br":"", "\"\r\n")
 
 /* connection */
-#define PRINT_HTTP_CONNECTION(ci)   (sprintf(G_tmp, "Connection: %s\r\n", conn[ci].keep_alive?"Keep-Alive":"close"), HOUT(G_tmp))
+#define PRINT_HTTP_CONNECTION(ci)   HOUT(conn[ci].keep_alive?"Connection: Keep-Alive\r\n":"Connection: close\r\n")
 
 /* vary */
 #define PRINT_HTTP_VARY_DYN         HOUT("Vary: Accept-Encoding, User-Agent\r\n")
@@ -174,24 +208,30 @@ typedef char                        bool;
 #define PRINT_HTTP_FRAME_OPTIONS    HOUT("X-Frame-Options: SAMEORIGIN\r\n")
 
 /* cookie */
-#define PRINT_HTTP_COOKIE_A(ci)     (sprintf(G_tmp, "Set-Cookie: as=%s; HttpOnly\r\n", conn[ci].cookie_out_a), HOUT(G_tmp))
-#define PRINT_HTTP_COOKIE_L(ci)     (sprintf(G_tmp, "Set-Cookie: ls=%s; HttpOnly\r\n", conn[ci].cookie_out_l), HOUT(G_tmp))
-#define PRINT_HTTP_COOKIE_A_EXP(ci) (sprintf(G_tmp, "Set-Cookie: as=%s; Expires=%s; HttpOnly\r\n", conn[ci].cookie_out_a, conn[ci].cookie_out_a_exp), HOUT(G_tmp))
-#define PRINT_HTTP_COOKIE_L_EXP(ci) (sprintf(G_tmp, "Set-Cookie: ls=%s; Expires=%s; HttpOnly\r\n", conn[ci].cookie_out_l, conn[ci].cookie_out_l_exp), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_A(ci)     hdr_line(ci, 3, "Set-Cookie: as=", conn[ci].cookie_out_a, "; HttpOnly\r\n")
+#define PRINT_HTTP_COOKIE_L(ci)     hdr_line(ci, 3, "Set-Cookie: ls=", conn[ci].cookie_out_l, "; HttpOnly\r\n")
+#define PRINT_HTTP_COOKIE_A_EXP(ci) hdr_line(ci, 5, "Set-Cookie: as=", conn[ci].cookie_out_a, "; Expires=", conn[ci].cookie_out_a_exp, "; HttpOnly\r\n")
+#define PRINT_HTTP_COOKIE_L_EXP(ci) hdr_line(ci, 5, "Set-Cookie: ls=", conn[ci].cookie_out_l, "; Expires=", conn[ci].cookie_out_l_exp, "; HttpOnly\r\n")
 
 /* content length */
-#define PRINT_HTTP_CONTENT_LEN(len) (sprintf(G_tmp, "Content-Length: %d\r\n", len), HOUT(G_tmp))
+#define PRINT_HTTP_CONTENT_LEN(len) hdr_num(ci, "Content-Length: ", len)
+
+/* byte ranges */
+#define PRINT_HTTP_ACCEPT_RANGES    HOUT("Accept-Ranges: bytes\r\n")
 
 /* identity */
 #define PRINT_HTTP_SERVER           HOUT("Server: Silgy\r\n")
 
-/* must be last! */
-#define PRINT_HTTP_END_OF_HEADER    HOUT("\r\n")
+/* must be last! -- hdr_add() always leaves room for it */
+#define PRINT_HTTP_END_OF_HEADER    (memcpy(conn[ci].p_curr_h, "\r\n", 3), conn[ci].p_curr_h += 2)
 
 
-#define IN_BUFSIZE                  8192            /* incoming request buffer length (8 kB) */
+#define IN_BUFSIZE                  8192            /* incoming request buffer length (8 kB) -- also max header length */
+#define OUT_HEADER_BUFSIZE          4096            /* outgoing HTTP header buffer length (4 kB) */
 #define OUT_BUFSIZE                 262144          /* initial HTTP response buffer length (256 kB) */
+#define OUT_STREAM_CHUNK            65536           /* streamed response goes out in chunks of about that size (64 kB) */
 #define TMP_BUFSIZE                 1048576         /* temporary string buffer size (1 MB) */
+#define SSL_REC_BUFSIZE             16384           /* max TLS record payload -- response header coalesced with body (16 kB) */
 #define MAX_POST_DATA_BUFSIZE       16777216+1048576    /* max incoming POST data length (16+1 MB) */
 #define MAX_LOG_STR_LEN             4095            /* max log string length */
 #define MAX_METHOD_LEN              7               /* method length */
@@ -219,6 +259,8 @@ typedef char                        bool;
 #define MAX_SESSIONS                10              /* max user sessions */
 #endif
 
+#define USES_HASH_SIZE              (MAX_SESSIONS*2)    /* sesid index size */
+
 #define CONN_TIMEOUT                180             /* idle connection timeout in seconds */
 
 #define USES_TIMEOUT                300             /* anonymous user session timeout in seconds */
@@ -235,6 +277,38 @@ typedef char                        bool;
 #define CONN_STATE_READY_TO_SEND_BODY   'B'
 #define CONN_STATE_SENDING_BODY         'S'
 
+#ifdef EPOLL
+/* epoll_event.data ids other than connection index */
+#define EPOLL_LISTENING_ID              MAX_CONNECTIONS
+#define EPOLL_LISTENING_SEC_ID          (MAX_CONNECTIONS+1)
+#define EPOLL_ASYNC_RES_ID              (MAX_CONNECTIONS+2)
+#define EPOLL_MAX_EVENTS                (MAX_CONNECTIONS+3)
+#endif
+
+#ifdef IOURING
+/* io_uring operations -- user_data = generation << 32 | operation << 24 | ci */
+#define URING_ACCEPT                    1
+#define URING_ACCEPT_SEC                2
+#define URING_ASYNC_RES                 3
+#define URING_RECV                      4
+#define URING_SEND_HEADER               5
+#define URING_SEND_BODY                 6
+#define URING_POLL                      7               /* HTTPS -- OpenSSL does the I/O */
+#define URING_CANCEL                    8
+#define URING_SQ_ENTRIES                1024
+#define URING_CQ_ENTRIES                (MAX_CONNECTIONS*2+1024)
+#endif
+
+/* timer wheel -- level 0: one-second slots, level 1: TIMER_L0_SIZE-second slots */
+#define TIMER_L0_BITS                   8
+#define TIMER_L0_SIZE                   (1 << TIMER_L0_BITS)
+#define TIMER_L1_SIZE                   64              /* 256 * 64 s = a bit over 4.5 h, further ones are parked at the end */
+/* timer nodes: connections, user sessions, async calls */
+#define TIMER_CONN                      0
+#define TIMER_USES                      MAX_CONNECTIONS
+#define TIMER_ASYNC                     (MAX_CONNECTIONS+MAX_SESSIONS+1)
+#define TIMER_NODES                     (MAX_CONNECTIONS+MAX_SESSIONS+1+MAX_ASYNC)
+
 #ifdef __linux__
 #define MONOTONIC_CLOCK_NAME            CLOCK_MONOTONIC_RAW
 #else
@@ -299,6 +373,15 @@ typedef char                        bool;
 
 #define NOT_STATIC                  -1
 #define MAX_STATICS                 1000            /* max static resources */
+#define STAT_HASH_SIZE              (MAX_STATICS*2)     /* static resource name index size */
+#define STAT_COMPRESS_MIN           256             /* smaller statics aren't worth compressing */
+#define STAT_RELOAD_GZIP_LEVEL      6               /* for files changed while running -- max levels would hold up the loop */
+#define STAT_RELOAD_BROTLI_QUALITY  5
+#define STAT_BUNDLE_FILE            "silgy_res.pack"    /* in bin */
+#define STAT_MAX_DIRS               256             /* max watched res & resmin directories incl. subdirectories */
+#define STAT_BUNDLE_MAGIC           "SILGYPK2"
+#define MAX_RANGES                  16              /* max byte ranges in one response -- above that the whole resource goes */
+#define RANGE_BOUNDARY_LEN          24              /* multipart/byteranges boundary length */
 
 #define MAX_ASYNC                   20              /* max async responses */
 #define ASYNC_STATE_FREE            '0'
@@ -344,6 +427,12 @@ typedef char                        bool;
 #define RES_EXE                     'X'
 #define RES_ZIP                     'Z'
 
+/* content encodings -- also bits of accepted ones */
+
+#define CONTENT_ENC_IDENTITY        0
+#define CONTENT_ENC_GZIP            1
+#define CONTENT_ENC_BR              2
+
 
 #define URI(uri)                    (0==strcmp(conn[ci].uri, uri))
 #define REQ(res)                    (0==strcmp(conn[ci].resource, res))
@@ -358,6 +447,8 @@ typedef char                        bool;
 #define RES_CONTENT_TYPE(s)         eng_set_res_content_type(ci, s)
 #define RES_LOCATION(s, ...)        eng_set_res_location(ci, s, ##__VA_ARGS__)
 #define RES_DONT_CACHE              conn[ci].dont_cache=TRUE
+#define RES_ETAG                    conn[ci].use_etag=TRUE
+#define RES_STREAM(fn)              conn[ci].stream=fn
 #define RES_CONTENT_DISPOSITION(s, ...) eng_set_res_content_disposition(ci, s, ##__VA_ARGS__)
 
 #define REDIRECT_TO_LANDING         sprintf(conn[ci].location, "%s://%s", PROTOCOL, conn[ci].host)
@@ -371,6 +462,14 @@ typedef struct {
 } http_status_t;
 
 
+/* prebuilt response header line */
+
+typedef struct {
+    char    *str;
+    int     len;
+} hdr_line_t;
+
+
 /* date */
 
 typedef struct {
@@ -380,6 +479,14 @@ typedef struct {
 } date_t;
 
 
+/* byte range */
+
+typedef struct {
+    long    from;
+    long    to;                             /* inclusive */
+} range_t;
+
+
 /* connection */
 
 typedef struct {
@@ -393,11 +500,15 @@ typedef struct {
     char    ip[INET_ADDRSTRLEN];            /* client IP */
     char    pip[INET_ADDRSTRLEN];           /* proxy IP */
     char    in[IN_BUFSIZE];                 /* the whole incoming request */
+    long    in_len;                         /* bytes in in */
+    long    req_len;                        /* current request's length in in -- anything after it is pipelined */
+    long    hdr_scanned;                    /* in scanned for the end of header so far */
     char    method[MAX_METHOD_LEN+1];       /* HTTP method */
     long    was_read;                       /* request bytes read so far */
     bool    upgrade2https;                  /* Upgrade-Insecure-Requests = 1 */
     /* parsed HTTP request starts here */
     bool    head_only;                      /* request method = HEAD */
+    bool    http10;                         /* HTTP/1.0 -- no chunked encoding */
     bool    post;                           /* request method = POST */
     char    uri[MAX_URI_LEN+1];             /* requested URI string */
     char    resource[MAX_RESOURCE_LEN+1];   /* from URI */
@@ -408,16 +519,22 @@ typedef struct {
     char    referer[MAX_VALUE_LEN+1];
     long    clen;                           /* incoming & outgoing content length */
     char    *data;                          /* POST data */
+    long    data_mapped;                    /* large POST data mapped onto temporary file -- mapping length or 0 */
+    int     data_fd;                        /* -''- file descriptor */
     char    cookie_in_a[SESID_LEN+1];       /* anonymous */
     char    cookie_in_l[SESID_LEN+1];       /* logged in */
     char    host[64];
     char    website[64];
     char    lang[8];
     time_t  if_mod_since;
+    char    range[MAX_VALUE_LEN+1];         /* Range */
+    char    if_range[64];                   /* If-Range */
+    char    if_none_match[MAX_VALUE_LEN+1]; /* If-None-Match */
+    char    accept_enc;                     /* Accept-Encoding -- CONTENT_ENC_ bits */
     char    in_ctype;                       /* content type */
     char    boundary[256];                  /* for POST multipart/form-data type */
     /* what goes out */
-    char    header[1024];                   /* outgoing HTTP header */
+    char    header[OUT_HEADER_BUFSIZE];     /* outgoing HTTP header */
 #ifdef OUTCHECKREALLOC
     char    *out_data;                      /* body */
 #else
@@ -426,6 +543,13 @@ typedef struct {
     long    out_data_allocated;
     int     status;                         /* HTTP status */
     long    data_sent;                      /* how many body bytes has been sent */
+    bool    (*stream)(int ci);              /* app's generator of streamed response, returns FALSE when finished */
+    bool    chunked;                        /* Transfer-Encoding: chunked */
+    char    content_enc;                    /* Content-Encoding of the body */
+    bool    use_etag;                       /* dynamic response -- ETag from out_data */
+    char    etag[17];                       /* -''- content hash, hex */
+    range_t ranges[MAX_RANGES];             /* byte ranges of static resource to send (206) */
+    int     ranges_cnt;                     /* -''- count, more than 1 goes as multipart from out_data */
     char    ctype;                          /* content type */
     char    ctypestr[256];                  /* user (custom) content type */
     char    cdisp[256];                     /* content disposition */
@@ -445,6 +569,12 @@ typedef struct {
     SSL     *ssl;
 #endif
     int     ssl_err;
+#ifdef IOURING
+    unsigned uring_gen;                     /* bumped on close so that late completions can be told apart */
+    char    uring_pending;                  /* operations in flight */
+    struct iovec uring_iov[2];              /* header and body for sendmsg */
+    struct msghdr uring_msg;
+#endif
     char    auth_level;                     /* required authorization level */
     int     usi;                            /* user session index */
     int     static_res;                     /* static resource index in M_stat */
@@ -455,6 +585,36 @@ typedef struct {
 } conn_t;
 
 
+#ifdef IOURING
+/* io_uring instance -- rings are shared with the kernel */
+
+typedef struct {
+    int     fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned tail;                          /* local tail, published on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+#endif
+
+
+/* timer wheel node */
+
+typedef struct {
+    int     next;
+    int     prev;
+    int     slot;                           /* -1 = not set */
+    time_t  expires;
+} timer_node_t;
+
+
 /* user session */
 
 typedef struct {
@@ -477,6 +637,8 @@ typedef struct {
     char    additional[64];         /* password reset key */
 //    json_t  rest_fld[JSON_MAX_ELEMS*JSON_MAX_LEVELS];
     int     rest_cnt;
+    int     busy;                   /* connections using it right now */
+    bool    closing;                /* closed while busy -- the last one frees it */
 } usession_t;
 
 
@@ -488,10 +650,54 @@ typedef struct {
     char    *data;
     long    len;
     time_t  modified;
+    bool    on_disk;    /* large file mapped rather than read, sent with sendfile() */
+    int     fd;         /* -''- kept open */
+    char    *fd_base;   /* -''- address of fd's offset 0 */
+    bool    in_bundle;  /* data points to the mapped bundle */
+    bool    minified;   /* read from resmin */
+    bool    immutable;  /* in versioned directory, i.e. v123/ */
+    long    hits;       /* requests for it since start */
+    char    etag[17];   /* content hash, hex */
+    char    last_modified[32];  /* modified as HTTP date */
+#ifdef GZIP
+    char    *data_gz;   /* gzip variant or NULL */
+    long    len_gz;
+#endif
+#ifdef BROTLI
+    char    *data_br;   /* brotli variant or NULL */
+    long    len_br;
+#endif
+    char    *hdr[3];    /* prebuilt 200 header per CONTENT_ENC_, without Date and Connection */
+    int     hdr_len[3];
 } stat_res_t;
 
 
-/* counters */
+/* static resources bundle made by silgy_pack */
+/* header, entries sorted by minified & name, then data */
+
+typedef struct {
+    char    magic[8];
+    long    cnt;
+    char    gzip;       /* packed with gzip variants */
+    char    brotli;     /* packed with brotli variants */
+} stat_bundle_hdr_t;
+
+typedef struct {
+    char    name[256];
+    char    minified;   /* from resmin */
+    time_t  modified;   /* source file's */
+    long    src_len;    /* source file's size */
+    char    etag[17];
+    long    off;        /* data offset in bundle */
+    long    len;
+    long    off_gz;     /* gzip variant or 0 */
+    long    len_gz;
+    long    off_br;     /* brotli variant or 0 */
+    long    len_br;
+} stat_bundle_entry_t;
+
+
+/* counters -- longs only, workers add them up as an array */
 
 typedef struct {
     long    req;        /* all parsed requests */
@@ -502,6 +708,12 @@ typedef struct {
     long    visits_dsk; /* like visits -- desktop only */
     long    visits_mob; /* like visits -- mobile only */
     long    blocked;    /* attempts from blocked IP */
+    long    accepts;    /* accepted connections */
+    long    accept_wakeups; /* loop wakeups that accepted any */
+    long    gz_resp;    /* dynamic responses gzipped on the fly */
+    long    gz_in;      /* -''- bytes before */
+    long    gz_out;     /* -''- bytes after */
+    long    gz_usec;    /* -''- CPU time spent in microseconds */
 } counters_t;
 
 
@@ -540,6 +752,14 @@ extern char     G_dbName[128];
 extern char     G_dbUser[128];
 extern char     G_dbPassword[128];
 extern char     G_blockedIPList[256];
+extern int      G_workers;
+extern int      G_threads;
+extern int      G_acceptBatch;
+extern long     G_largeStatic;
+extern long     G_largePost;
+extern char     G_largePostDir[256];
+extern long     G_compressMin;
+extern int      G_statVersioned;
 extern char     G_test;
 /* end of config params */
 extern int      G_pid;                      /* pid */
@@ -549,17 +769,17 @@ extern long     G_days_up;                  /* web server's days up */
 #ifndef ASYNC_SERVICE
 extern conn_t   conn[MAX_CONNECTIONS];      /* HTTP connections & requests -- by far the most important structure around */
 #endif
-extern int      G_open_conn;                /* number of open connections */
-extern char     G_tmp[TMP_BUFSIZE];         /* temporary string buffer */
+extern THREAD_LOCAL int G_open_conn;       /* number of open connections */
+extern THREAD_LOCAL char G_tmp[TMP_BUFSIZE];    /* temporary string buffer */
 #ifndef ASYNC_SERVICE
 extern usession_t uses[MAX_SESSIONS+1];     /* user sessions -- they start from 1 */
 #endif
 extern int      G_sessions;                 /* number of active user sessions */
-extern time_t   G_now;                      /* current time */
-extern struct tm *G_ptm;                    /* human readable current time */
+extern THREAD_LOCAL time_t G_now;          /* current time */
+extern THREAD_LOCAL struct tm *G_ptm;       /* human readable current time */
 extern char     G_last_modified[32];        /* response header field with server's start time */
 #ifdef DBMYSQL
-extern MYSQL    *G_dbconn;                  /* database connection */
+extern THREAD_LOCAL MYSQL *G_dbconn;       /* database connection */
 #endif
 #ifndef _WIN32
 /* asynchorous processing */
@@ -570,10 +790,10 @@ extern async_res_t ares[MAX_ASYNC];         /* async response array */
 extern long     G_last_call_id;             /* counter */
 #endif
 #endif
-extern char     G_dt[20];                   /* datetime for database or log (YYYY-MM-DD hh:mm:ss) */
+extern THREAD_LOCAL char G_dt[20];         /* datetime for database or log (YYYY-MM-DD hh:mm:ss) */
 extern char     G_blacklist[MAX_BLACKLIST+1][INET_ADDRSTRLEN];
 extern int      G_blacklist_cnt;            /* M_blacklist length */
-extern counters_t G_cnts_today;             /* today's counters */
+extern THREAD_LOCAL counters_t G_cnts_today;   /* today's counters */
 extern counters_t G_cnts_yesterday;         /* yesterday's counters */
 extern counters_t G_cnts_day_before;        /* day before's counters */
 /* SHM */
@@ -602,6 +822,10 @@ extern "C" {
     bool eng_uses_start(int ci);
     void eng_uses_close(int usi);
     void eng_uses_reset(int usi);
+    int eng_uses_find(const char *sesid);
+    int eng_uses_hold(const char *sesid);
+    void eng_uses_release(int usi);
+    void eng_uses_set_sesid(int usi, const char *sesid);
     void eng_async_req(int ci, const char *service, const char *data, char response, int timeout);
     bool eng_rest_req(int ci, JSON *json_req, JSON *json_res, const char *method, const char *url);
     void silgy_add_to_static_res(const char *name, char *src);
@@ -616,6 +840,7 @@ extern "C" {
     void eng_out_check(int ci, const char *str);
     void eng_out_check_realloc(int ci, const char *str);
     void eng_out_check_realloc_bin(int ci, const char *data, long len);
+    void eng_out_fmt(int ci, const char *fmt, ...);
 #ifdef ASYNC_SERVICE
     bool services_start(void);
     void services(const char *service, const char *req, char *res);
@@ -27,6 +27,7 @@ http_status_t   M_http_status[]={
         {413, "Request Entity Too Large"},
         {414, "Request-URI Too Long"},
         {416, "Range Not Satisfiable"},
+        {431, "Request Header Fields Too Large"},
         {500, "Internal Server Error"},
         {501, "Not Implemented"},
         {503, "Service Unavailable"},
@@ -56,19 +57,27 @@ char        G_dbName[128];
 char        G_dbUser[128];
 char        G_dbPassword[128];
 char        G_blockedIPList[256];
+int         G_workers;
+int         G_threads;
+int         G_acceptBatch;
+long        G_largeStatic;
+long        G_largePost;
+char        G_largePostDir[256];
+long        G_compressMin;
+int         G_statVersioned;
 /* end of config params */
 long        G_days_up;                  /* web server's days up */
 #ifndef ASYNC_SERVICE
 conn_t      conn[MAX_CONNECTIONS];      /* HTTP connections & requests -- by far the most important structure around */
 #endif
-int         G_open_conn;                /* number of open connections */
+THREAD_LOCAL int G_open_conn;           /* number of open connections */
 #ifndef ASYNC_SERVICE
 usession_t  uses[MAX_SESSIONS+1];       /* user sessions -- they start from 1 */
 #endif
 int         G_sessions;                 /* number of active user sessions */
 char        G_last_modified[32];        /* response header field with server's start time */
 #ifdef DBMYSQL
-MYSQL       *G_dbconn;                  /* database connection */
+THREAD_LOCAL MYSQL *G_dbconn;           /* database connection */
 #endif
 #ifndef _WIN32
 /* asynchorous processing */
@@ -81,7 +90,7 @@ long        G_last_call_id;             /* counter */
 #endif
 char        G_blacklist[MAX_BLACKLIST+1][INET_ADDRSTRLEN];
 int         G_blacklist_cnt;            /* M_blacklist length */
-counters_t  G_cnts_today;               /* today's counters */
+THREAD_LOCAL counters_t G_cnts_today;   /* today's counters */
 counters_t  G_cnts_yesterday;           /* yesterday's counters */
 counters_t  G_cnts_day_before;          /* day before's counters */
 
@@ -92,57 +101,250 @@ static char         *M_pidfile;                 /* pid file name */
 static SOCKET       M_listening_fd=0;           /* The socket file descriptor for "listening" socket */
 static SOCKET       M_listening_sec_fd=0;       /* The socket file descriptor for secure "listening" socket */
 #else
-static int          M_listening_fd=0;           /* The socket file descriptor for "listening" socket */
-static int          M_listening_sec_fd=0;       /* The socket file descriptor for secure "listening" socket */
+static THREAD_LOCAL int M_listening_fd=0;       /* The socket file descriptor for "listening" socket */
+static THREAD_LOCAL int M_listening_sec_fd=0;   /* The socket file descriptor for secure "listening" socket */
 #endif  /* _WIN32 */
 #ifdef HTTPS
 static SSL_CTX      *M_ssl_ctx;
 #endif
-static fd_set       M_readfds={0};              /* Socket file descriptors we want to wake up for, using select() */
-static fd_set       M_writefds={0};             /* Socket file descriptors we want to wake up for, using select() */
-static int          M_highsock=0;               /* Highest #'d file descriptor, needed for select() */
+#ifdef IOURING
+static THREAD_LOCAL uring_t M_ring;             /* io_uring submission & completion queues */
+static THREAD_LOCAL bool M_uring_single_accept=FALSE;  /* kernel older than 5.19 -- no multishot accept */
+#elif defined(EPOLL)
+static THREAD_LOCAL int M_epollfd=-1;           /* epoll instance */
+static THREAD_LOCAL struct epoll_event M_events[EPOLL_MAX_EVENTS];  /* ready events returned by epoll_wait() */
+#else
+static THREAD_LOCAL fd_set M_readfds={0};       /* Socket file descriptors we want to wake up for, using select() */
+static THREAD_LOCAL fd_set M_writefds={0};      /* Socket file descriptors we want to wake up for, using select() */
+#endif
+static THREAD_LOCAL int M_highsock=0;           /* Highest #'d file descriptor, needed for select() */
+static THREAD_LOCAL int M_first_ci=0;           /* this thread's shard of conn */
+static THREAD_LOCAL int M_last_ci=MAX_CONNECTIONS;  /* -''- (excluding) */
+static THREAD_LOCAL int M_free_ci[MAX_CONNECTIONS]; /* free conn slots (stack) */
+static THREAD_LOCAL int M_free_cnt=0;           /* M_free_ci length */
+static THREAD_LOCAL int M_active_ci[MAX_CONNECTIONS];   /* open connections, G_open_conn long */
+static int          M_active_pos[MAX_CONNECTIONS];  /* ci's position in M_active_ci or -1 */
+static THREAD_LOCAL timer_node_t M_timers[TIMER_NODES];    /* timer wheel nodes */
+static THREAD_LOCAL int M_timer_slots[TIMER_L0_SIZE+TIMER_L1_SIZE];    /* timer wheel slots -- first node or -1 */
+static THREAD_LOCAL time_t M_timer_now;         /* second the timer wheel has been processed up to */
 static stat_res_t   M_stat[MAX_STATICS];        /* static resources */
-static char         M_resp_date[32];            /* response header field Date */
-static char         M_expires[32];              /* response header field one month ahead for static resources */
+static int          M_stat_cnt=0;               /* M_stat entries in use -- "-" goes right after them */
+static int          M_stat_hash[STAT_HASH_SIZE];    /* name index -- first M_stat index with that hash or -1 */
+static int          M_stat_next[MAX_STATICS];   /* next M_stat index with the same hash or -1 */
+static bool         M_stat_reloading=FALSE;     /* read_stat called from the serving loop -- compress cheaply */
+#ifndef _WIN32
+static char         *M_bundle=NULL;             /* mapped static resources bundle */
+static long         M_bundle_len=0;
+static int          M_bundle_fd=-1;
+static bool         M_bundle_uncompressed=FALSE;    /* packed without compression we do */
+#endif
+#ifdef __linux__
+static int          M_stat_watch_fd=-1;         /* inotify on res & resmin */
+static struct {                                 /* watched directories */
+    int     wd;
+    bool    minify;
+    char    path[256];                          /* relative to res or resmin, "" or ending with '/' */
+} M_stat_watch[STAT_MAX_DIRS];
+static int          M_stat_watch_cnt=0;
+static int          M_stat_retired[MAX_STATICS];    /* replaced M_stat entries waiting to be freed */
+static int          M_stat_retired_cnt=0;
+#ifdef THREADS
+static unsigned     M_stat_retired_epoch[MAX_STATICS];  /* M_stat_epoch they were retired at */
+static unsigned     M_stat_epoch=0;             /* bumped on every retirement */
+static unsigned     *M_thread_epoch=NULL;       /* M_stat_epoch every thread has seen at the top of its loop */
+#endif
+static int          M_stat_free[MAX_STATICS];   /* freed M_stat entries ready for reuse */
+static int          M_stat_free_cnt=0;
+#endif
+static THREAD_LOCAL char M_resp_date[48]="Date: ";    /* response header line Date, updated once a second */
+static THREAD_LOCAL int M_resp_date_len=0;
+static hdr_line_t   M_status_line[600];         /* prebuilt status lines, by status code */
+static hdr_line_t   M_ctype_line[128];          /* prebuilt Content-Type lines, by RES_ type */
+static THREAD_LOCAL char M_expires[32];         /* response header field one month ahead for static resources */
+static char         M_range_boundary[RANGE_BOUNDARY_LEN+1];   /* multipart/byteranges boundary */
+#ifdef HTTPS
+static THREAD_LOCAL char M_ssl_rec[SSL_REC_BUFSIZE];  /* response header + beginning of body for one SSL_write */
+#endif
+#ifdef GZIP
+static THREAD_LOCAL z_stream M_deflate;         /* every thread keeps its deflate context and reuses it */
+static THREAD_LOCAL bool M_deflate_ready=FALSE; /* -''- initialized */
+static THREAD_LOCAL char *M_deflate_buf=NULL;   /* compressed output before it goes back to out_data */
+static THREAD_LOCAL long M_deflate_buf_size=0;  /* -''- allocated */
+#endif
 static bool         M_favicon_exists=FALSE;     /* special case statics */
 static bool         M_robots_exists=FALSE;      /* -''- */
 static bool         M_appleicon_exists=FALSE;   /* -''- */
 #ifdef _WIN32   /* Windows */
 WSADATA             wsa;
 #endif 
+static THREAD_LOCAL int M_worker=0;            /* worker process or thread number (1...) or 0 for master / single process */
+static char         M_log_prefix[16]="";        /* log file name prefix */
+#ifndef _WIN32
+static pid_t        *M_workers_pid=NULL;        /* master only */
+static counters_t   *M_shared_cnts=NULL;        /* in shared memory or M_threads_cnts: [0] today, [1] yesterday, [2] day before */
+static THREAD_LOCAL counters_t M_cnts_published;    /* worker's G_cnts_today already added to the shared ones */
+#endif
+#ifdef THREADS
+static counters_t   M_threads_cnts[3];          /* counters shared between threads */
+static int          M_thread_failed=0;          /* first thread that has stopped on error */
+static pthread_mutex_t M_uses_lock=PTHREAD_MUTEX_INITIALIZER;  /* uses and its index */
+#define USES_LOCK   pthread_mutex_lock(&M_uses_lock)
+#define USES_UNLOCK pthread_mutex_unlock(&M_uses_lock)
+#else
+#define USES_LOCK
+#define USES_UNLOCK
+#endif
+static int          M_uses_hash[USES_HASH_SIZE];    /* sesid index -- first usi with that hash or 0 */
+static int          M_uses_next[MAX_SESSIONS+1];    /* next usi with the same hash or 0 */
 
 /* prototypes */
 
 static void set_state(int ci, long bytes);
 static void set_state_sec(int ci, long bytes);
+static void set_state_hdr(int ci, long bytes);
+static void set_state_header_read(int ci);
+static void resp_sent(int ci);
+static void stream_chunk(int ci);
+static bool header_complete(int ci);
 static void read_conf(void);
 static void respond_to_expect(int ci);
 static void log_proc_time(int ci);
 static void close_conn(int ci);
 static bool init(int argc, char **argv);
 static void setnonblocking(int sock);
+#ifdef IOURING
+static bool uring_init(void);
+static struct io_uring_sqe *uring_get_sqe(void);
+static int uring_enter(unsigned min_complete, int timeout_ms);
+static void uring_listen(int op);
+#if defined(HTTPS) || defined(ASYNC)
+static void uring_poll(int ci, unsigned events);
+#endif
+static void uring_io(int ci, int op, void *buf, unsigned len, int flags);
+static void uring_arm(int ci);
+static void uring_complete(void);
+static void uring_cancel(int ci);
+#elif defined(EPOLL)
+static bool epoll_add_fd(int fd, unsigned id);
+static unsigned epoll_events(int ci);
+static void set_epoll_events(int ci, int op);
+#else
 static void build_select_list(void);
+#endif
+static void handle_conn(int ci, bool readable, bool writable);
+static long conn_io(int ci, bool readable, bool writable);
+static void process_conn(int ci);
+static char *resp_body(int ci);
+#ifndef IOURING
 static void accept_http();
 static void accept_https();
+#endif
+static void new_conn_http(int connection, struct sockaddr_in *cli_addr);
+#ifdef HTTPS
+static void new_conn_https(int connection, struct sockaddr_in *cli_addr);
+#endif
+static void init_conn_slots(void);
+static int get_free_conn(void);
+static void release_conn(int ci);
 static bool read_blocked_ips(void);
 static bool ip_blocked(const char *addr);
 static int first_free_stat(void);
+static unsigned stat_hash(const char *name);
+static int stat_find(const char *name);
+static void stat_check_special(void);
+static void stat_index_add(int i);
+#ifdef __linux__
+static void stat_index_replace(int old, int i);
+static void stat_watch_init(void);
+static void stat_watch_add(const char *path, bool minify, bool load);
+static void stat_watch_check(void);
+static void stat_reload(const char *name, bool minify);
+static void stat_unload(const char *name, bool minify);
+static void stat_retire(int i);
+static void stat_free_retired(void);
+#ifdef THREADS
+static bool stat_grace_over(unsigned epoch);
+#endif
+#endif
+static void stat_set_validators(int i);
+static void stat_set_headers(int i);
+static bool stat_header(int ci);
+static bool etag_match(const char *if_none_match, const char *etag);
+static void dyn_etag(int ci);
+#if defined(GZIP) || defined(BROTLI)
+static bool stat_compressible(int i);
+static void compress_stat(int i);
+#endif
+static void select_stat_enc(int ci);
+static char parse_accept_enc(const char *value);
 static bool read_files(bool minify);
+static void read_dir(DIR *dir, const char *path, bool minify);
+static bool stat_versioned(const char *name);
+static bool read_stat(int i, const char *namewpath, bool minify);
+#ifndef _WIN32
+static void stat_bundle_open(void);
+static int stat_bundle_cmp(const void *a, const void *b);
+static bool stat_from_bundle(int i, const char *namewpath, bool minify);
+#endif
+static void free_stat(int i);
+static bool stat_copy(int i, char *dest, const char *src, long len);
 static int is_static_res(int ci, const char *name);
 static bool open_db(void);
 static void process_req(int ci);
 static void gen_response_header(int ci);
+#ifdef GZIP
+static bool compressible(int ci);
+static void compress_out(int ci);
+#endif
+static void print_content_range(int ci);
 static void print_content_type(int ci, char type);
+static const char *get_content_type(char type);
+#ifdef OUTCHECKREALLOC
+static bool out_grow(int ci, long len);
+#endif
+static void hdr_init(void);
+static void hdr_add(int ci, const char *s, int len);
+static void hdr_line(int ci, int cnt, ...);
+static void hdr_num(int ci, const char *name, long n);
+static void hdr_status(int ci, int status);
+static char *hdr_ltoa(char *dest, long n);
 static bool a_usession_ok(int ci);
-static void close_old_conn(void);
-static void close_uses_timeout(void);
+static void init_timers(void);
+static void timer_set(int n, time_t expires);
+static void timer_del(int n);
+static void process_timers(void);
+static void timer_fire(int n);
 static void close_a_uses(int usi);
 static void reset_conn(int ci, char conn_state);
 static int parse_req(int ci, long len);
+static int parse_range(int ci);
+#ifndef _WIN32
+static bool spill_post_data(int ci);
+#endif
 static int set_http_req_val(int ci, const char *label, const char *value);
 static bool check_block_ip(int ci, const char *rule, const char *value);
 static char *get_http_descr(int status_code);
 static void dump_counters(void);
+static int stat_hits_cmp(const void *a, const void *b);
+static void dump_stat_hits(void);
+#ifndef _WIN32
+static bool start_workers(void);
+static bool start_worker(int n);
+static bool master_loop(void);
+static bool reserve_ports(void);
+static void stop_workers(void);
+static void publish_counters(void);
+#endif
+#ifdef THREADS
+static void start_threads(void);
+static void *thread_main(void *arg);
+#endif
+static int serve(void);
+static unsigned uses_hash(const char *sesid);
+static void uses_index_add(int usi);
+static void uses_index_remove(int usi);
+static int uses_index_find(const char *sesid);
+static void uses_free(int usi);
 static void clean_up(void);
 static void sigdisp(int sig);
 static void gen_page_msg(int ci, int msg);
@@ -155,38 +357,92 @@ static int json_get_i(int ci, JSON *json, const char *name);
 -------------------------------------------------------------------------- */
 int main(int argc, char **argv)
 {
+    if ( !init(argc, argv) )
+    {
+        if ( G_log )
+            ERR("init() failed, exiting");
+        else
+            printf("init() failed, exiting.\n");
+
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+#ifndef _WIN32
+    /* master process stays in start_workers() until shut down */
+
+    if ( G_workers > 1 && !start_workers() )
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+#endif
+#ifdef THREADS
+    /* main thread stays in start_threads() until shut down */
+
+    if ( G_threads > 1 )
+    {
+        start_threads();
+        clean_up();
+        return EXIT_FAILURE;
+    }
+#endif
+
+    return serve();
+}
 
-static struct   sockaddr_in serv_addr;      /* static = initialised to zeros */
-static struct   sockaddr_in cli_addr;       /* static = initialised to zeros */
-unsigned int    addr_len=0;
+
+/* --------------------------------------------------------------------------
+   Open listening sockets and run the main loop
+   In THREADS mode every thread does it for its own shard of conn
+-------------------------------------------------------------------------- */
+static int serve()
+{
+static THREAD_LOCAL struct sockaddr_in serv_addr;   /* static = initialised to zeros */
     int         prev_day=0;
-unsigned long   hit=0;
-    char        remote_addr[INET_ADDRSTRLEN]=""; /* remote address */
     int         reuse_addr=1;               /* Used so we can re-bind to our port while a previous connection is still in TIME_WAIT state */
+#if !defined(EPOLL) && !defined(IOURING)
 struct timeval  timeout;                    /* Timeout for select */
+#endif
     int         readsocks=0;                /* Number of sockets ready for reading */
     int         i=0;                        /* Current item in conn_sockets for for loops */
     int         time_elapsed=0;             /* time unit, currently 250 ms */
     time_t      sometimeahead;
-    long        bytes=0;
     int         failed_select_cnt=0;
+#if (!defined(EPOLL) && !defined(IOURING)) || defined(ASYNC)
     int         j=0;
+#endif
+    bool        housekeeper=TRUE;           /* whether to look after sessions and blacklist */
+    long        accepts;                    /* accepted before this wakeup */
+#ifdef __linux__
+    time_t      last_watch_check=0;         /* static resources changes */
+#endif
+    time_t      resp_date_time=0;           /* second M_resp_date has been made for */
 
-    if ( !init(argc, argv) )
+#ifdef THREADS
+    if ( M_worker )     /* set thread's own copies */
     {
-        if ( G_log )
-            ERR("init() failed, exiting");
-        else
-            printf("init() failed, exiting.\n");
-
-        clean_up();
-        return EXIT_FAILURE;
+        housekeeper = (M_worker == 1);  /* these are shared, one thread looks after them */
+        G_now = time(NULL);
+        G_ptm = lib_gmtime(&G_now);
+        strftime(G_dt, 20, "%Y-%m-%d %H:%M:%S", G_ptm);
+        sometimeahead = G_now + 3600*24*EXPIRES_IN_DAYS;
+        strftime(M_expires, 32, "%a, %d %b %Y %T GMT", lib_gmtime(&sometimeahead));
     }
+#endif
 
     /* create new log file every day */
 
     prev_day = G_ptm->tm_mday;
 
+    /* free & active connection lists for our part of conn */
+
+    init_conn_slots();
+
+    /* connection, session and async timeouts */
+
+    init_timers();
+
     /* setup the network socket */
 
     DBG("Trying socket...");
@@ -218,6 +474,11 @@ struct timeval  timeout;                    /* Timeout for select */
     setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
 #else
     setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+#ifdef SO_REUSEPORT
+    /* every worker listens on its own socket, kernel spreads connections between them */
+    if ( M_worker )
+        setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr));
+#endif
 #endif 
 
     /* Set socket to non-blocking with our setnonblocking routine */
@@ -266,6 +527,10 @@ struct timeval  timeout;                    /* Timeout for select */
 
     /* So that we can re-bind to it without TIME_WAIT problems */
     setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+#ifdef SO_REUSEPORT
+    if ( M_worker )
+        setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr));
+#endif
 
     /* Set socket to non-blocking with our setnonblocking routine */
     setnonblocking(M_listening_sec_fd);
@@ -304,7 +569,55 @@ struct timeval  timeout;                    /* Timeout for select */
 
 #endif
 
-    addr_len = sizeof(cli_addr);
+#ifdef EPOLL
+    if ( (M_epollfd=epoll_create1(0)) < 0 )
+    {
+        ERR("epoll_create1 failed, errno = %d (%s)", errno, strerror(errno));
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+    /* listening sockets and async response queue stay level-triggered */
+
+    if ( !epoll_add_fd(M_listening_fd, EPOLL_LISTENING_ID) )
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+#ifdef HTTPS
+    if ( !epoll_add_fd(M_listening_sec_fd, EPOLL_LISTENING_SEC_ID) )
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+#endif
+#ifdef ASYNC
+    if ( G_queue_res >= 0 && !epoll_add_fd(G_queue_res, EPOLL_ASYNC_RES_ID) )
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+#endif
+#endif  /* EPOLL */
+
+#ifdef IOURING
+    if ( !uring_init() )
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+    /* multishot -- one submission keeps accepting */
+
+    uring_listen(URING_ACCEPT);
+#ifdef HTTPS
+    uring_listen(URING_ACCEPT_SEC);
+#endif
+#ifdef ASYNC
+    if ( G_queue_res >= 0 )
+        uring_listen(URING_ASYNC_RES);
+#endif
+#endif  /* IOURING */
 
     if ( G_dbName[0] )
     {
@@ -326,7 +639,7 @@ struct timeval  timeout;                    /* Timeout for select */
 
     ALWAYS("Waiting for requests...\n");
 
-    fflush(G_log);
+    log_flush();
 
 
     /* main server loop ------------------------------------------------------------------------- */
@@ -334,36 +647,66 @@ struct timeval  timeout;                    /* Timeout for select */
 //  for ( ; hit<1000; ++hit )   /* test only */
     for ( ;; )
     {
-        build_select_list();
-
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
+#ifdef THREADS
+        if ( M_thread_epoch )   /* this thread isn't holding any M_stat index outside conn[].static_res here */
+        {
+            __sync_synchronize();
+            M_thread_epoch[M_worker] = M_stat_epoch;
+        }
+#endif
         G_now = time(NULL);
-        G_ptm = gmtime(&G_now);
+        G_ptm = lib_gmtime(&G_now);
+        if ( G_now != resp_date_time )  /* whole Date line only changes once a second */
+        {
 #ifdef _WIN32   /* Windows */
-        strftime(M_resp_date, 32, "%a, %d %b %Y %H:%M:%S GMT", G_ptm);
+            M_resp_date_len = 6 + strftime(M_resp_date+6, 32, "%a, %d %b %Y %H:%M:%S GMT", G_ptm);
 #else
-        strftime(M_resp_date, 32, "%a, %d %b %Y %T GMT", G_ptm);
+            M_resp_date_len = 6 + strftime(M_resp_date+6, 32, "%a, %d %b %Y %T GMT", G_ptm);
 #endif  /* _WIN32 */
+            memcpy(M_resp_date+M_resp_date_len, "\r\n", 3);
+            M_resp_date_len += 2;
+            resp_date_time = G_now;
+        }
         sprintf(G_dt, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
-#ifdef ASYNC
-        /* mark timeout-ed */
+#ifndef _WIN32
+        if ( M_worker ) publish_counters();
+#endif
+        /* timeouts -- connections, user sessions & async calls */
 
-        for ( j=0; j<MAX_ASYNC; ++j )
+        process_timers();
+
+#ifdef __linux__
+        if ( housekeeper && G_now != last_watch_check )    /* static resources changes */
         {
-            if ( ares[j].state==ASYNC_STATE_SENT && ares[j].sent < G_now-ares[j].timeout )
-            {
-                DBG("Async request %d timeout-ed", j);
-                ares[j].state = ASYNC_STATE_TIMEOUTED;
-            }
+            if ( !last_watch_check ) stat_watch_init();
+            stat_watch_check();
+            last_watch_check = G_now;
         }
 #endif
+#ifdef IOURING
+        readsocks = uring_enter(1, 1000);   /* submit what's been queued and wait for completions */
+#elif defined(EPOLL)
+        readsocks = epoll_wait(M_epollfd, M_events, EPOLL_MAX_EVENTS, 1000);
+#else
+        build_select_list();    /* after timers -- they may have closed some connections */
+
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+
         readsocks = select(M_highsock+1, &M_readfds, &M_writefds, NULL, &timeout);
+#endif
+        if ( readsocks >= 0 )
+            failed_select_cnt = 0;
 
         if (readsocks < 0)
         {
+#ifdef IOURING
+            ERR("io_uring_enter failed, errno = %d (%s)", errno, strerror(errno));
+#elif defined(EPOLL)
+            ERR("epoll_wait failed, errno = %d (%s)", errno, strerror(errno));
+#else
             ERR("select failed, errno = %d (%s)", errno, strerror(errno));
+#endif
             /* protect from infinite loop */
             if ( failed_select_cnt >= 100 )
             {
@@ -380,49 +723,58 @@ struct timeval  timeout;                    /* Timeout for select */
         {
             /* we have some time now, let's do some housekeeping */
 
-            if ( G_open_conn ) close_old_conn();
-            if ( G_sessions ) close_uses_timeout();
-
             if ( time_elapsed >= 60 )   /* say something sometimes ... */
             {
                 ALWAYS("[%s] %d open connection(s) | %d user session(s)", G_dt+11, G_open_conn, G_sessions);
                 time_elapsed = 0;
-#ifdef USERS
-                if ( G_sessions ) libusr_close_luses_timeout();     /* tidy up cache */
+#ifndef _WIN32
+                if ( M_worker )     /* master may have done the rollover */
+                {
+                    memcpy(&G_cnts_yesterday, &M_shared_cnts[1], sizeof(counters_t));
+                    memcpy(&G_cnts_day_before, &M_shared_cnts[2], sizeof(counters_t));
+                }
 #endif
-                fflush(G_log);
+                log_flush();
 
                 /* start new log file every day */
 
                 if ( G_ptm->tm_mday != prev_day )
                 {
-                    dump_counters();
-                    log_finish();
-                    if ( !log_start("", G_test) )
-                        return EXIT_FAILURE;
+                    if ( !M_worker ) dump_counters();
+                    if ( G_threads < 2 )    /* otherwise main thread does it */
+                    {
+                        log_finish();
+                        if ( !log_start(M_log_prefix, G_test) )
+                            return EXIT_FAILURE;
+                    }
                     prev_day = G_ptm->tm_mday;
 
                     /* set new Expires date */
                     sometimeahead = G_now + 3600*24*EXPIRES_IN_DAYS;
-                    G_ptm = gmtime(&sometimeahead);
+                    G_ptm = lib_gmtime(&sometimeahead);
 #ifdef _WIN32   /* Windows */
                     strftime(M_expires, 32, "%a, %d %b %Y %H:%M:%S GMT", G_ptm);
 #else
                     strftime(M_expires, 32, "%a, %d %b %Y %T GMT", G_ptm);
 #endif  /* _WIN32 */
                     ALWAYS("New M_expires: %s", M_expires);
-                    G_ptm = gmtime(&G_now); /* make sure G_ptm is up to date */
+                    G_ptm = lib_gmtime(&G_now); /* make sure G_ptm is up to date */
 
-                    if ( G_blockedIPList[0] )
+                    if ( G_blockedIPList[0] && housekeeper )
                     {
                         /* update blacklist */
                         read_blocked_ips();
                     }
 
                     /* copy & reset counters */
-                    memcpy(&G_cnts_day_before, &G_cnts_yesterday, sizeof(counters_t));
-                    memcpy(&G_cnts_yesterday, &G_cnts_today, sizeof(counters_t));
-                    memset(&G_cnts_today, 0, sizeof(counters_t));
+#ifndef _WIN32
+                    if ( !M_worker )    /* workers only publish, master rolls over the combined numbers */
+#endif
+                    {
+                        memcpy(&G_cnts_day_before, &G_cnts_yesterday, sizeof(counters_t));
+                        memcpy(&G_cnts_yesterday, &G_cnts_today, sizeof(counters_t));
+                        memset(&G_cnts_today, 0, sizeof(counters_t));
+                    }
 
                     /* log currently used memory */
                     lib_log_memory();
@@ -432,234 +784,58 @@ struct timeval  timeout;                    /* Timeout for select */
         }
         else    /* readsocks > 0 */
         {
+            accepts = G_cnts_today.accepts;
+#ifdef IOURING
+            for ( i=0; i<readsocks; ++i )
+                uring_complete();
+#elif defined(EPOLL)
+            for ( i=0; i<readsocks; ++i )
+            {
+                if ( M_events[i].data.u32 == EPOLL_LISTENING_ID )
+                {
+                    accept_http();
+                }
+#ifdef HTTPS
+                else if ( M_events[i].data.u32 == EPOLL_LISTENING_SEC_ID )
+                {
+                    accept_https();
+                }
+#endif
+#ifdef ASYNC
+                else if ( M_events[i].data.u32 == EPOLL_ASYNC_RES_ID )
+                {
+                    /* nothing to do here -- the queue is read below */
+                }
+#endif
+                else    /* existing connection has something going on on it */
+                {
+                    handle_conn(M_events[i].data.u32,
+                                M_events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR),
+                                M_events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+                }
+            }
+#else   /* select */
             if (FD_ISSET(M_listening_fd, &M_readfds))
             {
                 accept_http();
             }
 #ifdef HTTPS
-            else if (FD_ISSET(M_listening_sec_fd, &M_readfds))
+            if (FD_ISSET(M_listening_sec_fd, &M_readfds))
             {
                 accept_https();
             }
 #endif
-            else    /* existing connections have something going on on them ---------------------------------- */
-            {
-                for (i=0; i<MAX_CONNECTIONS; ++i)
-                {
-                    /* --------------------------------------------------------------------------------------- */
-                    if ( FD_ISSET(conn[i].fd, &M_readfds) )     /* incoming data ready */
-                    {
-//                      DBG("\nfd=%d has incoming data ready to read", conn[i].fd);
-#ifdef HTTPS
-                        if ( conn[i].secure )   /* HTTPS */
-                        {
-//                          DBG("secure, state=%c, pending=%d", conn[i].conn_state, SSL_pending(conn[i].ssl));
-
-                            if ( conn[i].conn_state != CONN_STATE_READING_DATA )
-                            {
-//                              DBG("Trying SSL_read from fd=%d", conn[i].fd);
-                                bytes = SSL_read(conn[i].ssl, conn[i].in, IN_BUFSIZE-1);
-                                if ( bytes > 1 )
-                                    conn[i].in[bytes] = EOS;
-                                else if ( bytes == 1 )  /* when browser splits the request to prevent BEAST attack */
-                                {
-                                    bytes = SSL_read(conn[i].ssl, conn[i].in+1, IN_BUFSIZE-2) + 1;
-                                    if ( bytes > 1 )
-                                        conn[i].in[bytes] = EOS;
-                                }
-                                set_state_sec(i, bytes);
-                            }
-                            else    /* POST */
-                            {
-//                              DBG("state == CONN_STATE_READING_DATA");
-//                              DBG("Trying to read %ld bytes of POST data from fd=%d", conn[i].clen-conn[i].was_read, conn[i].fd);
-                                bytes = SSL_read(conn[i].ssl, conn[i].data+conn[i].was_read, conn[i].clen-conn[i].was_read);
-                                if ( bytes > 0 )
-                                    conn[i].was_read += bytes;
-                                set_state_sec(i, bytes);
-                            }
-                        }
-                        else        /* HTTP */
-#endif
-                        {
-//                          DBG("not secure, state=%c", conn[i].conn_state);
-
-                            if ( conn[i].conn_state == CONN_STATE_CONNECTED )
-                            {
-//                              DBG("state == CONN_STATE_CONNECTED");
-//                              DBG("Trying read from fd=%d", conn[i].fd);
-#ifdef _WIN32   /* Windows */
-                                bytes = recv(conn[i].fd, conn[i].in, IN_BUFSIZE-1, 0);
-#else
-                                bytes = read(conn[i].fd, conn[i].in, IN_BUFSIZE-1);
-#endif  /* _WIN32 */
-                                if ( bytes > 0 )
-                                    conn[i].in[bytes] = EOS;
-                                set_state(i, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
-                                                        /*              CONN_STATE_READY_FOR_PARSE */
-                            }
-                            else if ( conn[i].conn_state == CONN_STATE_READING_DATA )   /* POST */
-                            {
-//                              DBG("state == CONN_STATE_READING_DATA");
-//                              DBG("Trying to read %ld bytes of POST data from fd=%d", conn[i].clen-conn[i].was_read, conn[i].fd);
-#ifdef _WIN32   /* Windows */
-                                bytes = recv(conn[i].fd, conn[i].data+conn[i].was_read, conn[i].clen-conn[i].was_read, 0);
-#else
-                                bytes = read(conn[i].fd, conn[i].data+conn[i].was_read, conn[i].clen-conn[i].was_read);
-#endif  /* _WIN32 */
-                                conn[i].was_read += bytes;
-                                set_state(i, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
-                                                        /*              CONN_STATE_READY_FOR_PROCESS */
-                            }
-                        }
-                    }
-
-                    /* --------------------------------------------------------------------------------------- */
-                    if ( FD_ISSET(conn[i].fd, &M_writefds) )        /* ready for outgoing data */
-                    {
-//                      DBG("fd=%d is ready for outgoing data", conn[i].fd);
-
-                        /* async processing */
-#ifdef ASYNC
-                        if ( conn[i].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
-                        {
-                            for ( j=0; j<MAX_ASYNC; ++j )
-                            {
-                                if ( (ares[j].state==ASYNC_STATE_RECEIVED || ares[j].state==ASYNC_STATE_TIMEOUTED) && ares[j].ci == i )
-                                {
-                                    if ( ares[j].state == ASYNC_STATE_RECEIVED )
-                                    {
-                                        DBG("Async response in an array for ci=%d, processing", i);
-                                        app_async_done(i, ares[j].service, ares[j].data, FALSE);
-                                    }
-                                    else if ( ares[j].state == ASYNC_STATE_TIMEOUTED )
-                                    {
-                                        DBG("Async response done as timeout-ed for ci=%d", i);
-                                        app_async_done(i, ares[j].service, "", TRUE);
-                                    }
-                                    gen_response_header(i);
-                                    ares[j].state = ASYNC_STATE_FREE;
-                                    break;
-                                }
-                            }
-                        }
-#endif
-#ifdef HTTPS
-                        if ( conn[i].secure )   /* HTTPS */
-                        {
-//                          DBG("secure, state=%c", conn[i].conn_state);
-
-                            if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
-                            {
-//                              DBG("state == CONN_STATE_READY_TO_SEND_HEADER");
-//                              DBG("Trying to write %ld bytes to fd=%d", strlen(conn[i].header), conn[i].fd);
-                                bytes = SSL_write(conn[i].ssl, conn[i].header, strlen(conn[i].header));
-                                set_state_sec(i, bytes);
-                            }
-                            else if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[i].conn_state == CONN_STATE_SENDING_BODY)
-                            {
-//                              DBG("state == %s", conn[i].conn_state==CONN_STATE_READY_TO_SEND_BODY?"CONN_STATE_READY_TO_SEND_BODY":"CONN_STATE_SENDING_BODY");
-//                              DBG("Trying to write %ld bytes to fd=%d", conn[i].clen, conn[i].fd);
-                                if ( conn[i].static_res == NOT_STATIC )
-                                    bytes = SSL_write(conn[i].ssl, conn[i].out_data, conn[i].clen);
-                                else
-                                    bytes = SSL_write(conn[i].ssl, M_stat[conn[i].static_res].data, conn[i].clen);
-//                              conn[i].data_sent += bytes;
-                                set_state_sec(i, bytes);
-                            }
-                        }
-                        else    /* HTTP */
-#endif
-                        {
-//                          DBG("not secure, state=%c", conn[i].conn_state);
-
-                            if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
-                            {
-//                              DBG("state == CONN_STATE_READY_TO_SEND_HEADER");
-//                              DBG("Trying to write %ld bytes to fd=%d", strlen(conn[i].header), conn[i].fd);
-#ifdef _WIN32   /* Windows */
-                                bytes = send(conn[i].fd, conn[i].header, strlen(conn[i].header), 0);
-#else
-                                bytes = write(conn[i].fd, conn[i].header, strlen(conn[i].header));
-#endif  /* _WIN32 */
-                                set_state(i, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
-                                                        /*              CONN_STATE_READY_TO_SEND_BODY */
-                            }
-                            else if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[i].conn_state == CONN_STATE_SENDING_BODY)
-                            {
-//                              DBG("state == %s", conn[i].conn_state==CONN_STATE_READY_TO_SEND_BODY?"CONN_STATE_READY_TO_SEND_BODY":"CONN_STATE_SENDING_BODY");
-//                              DBG("Trying to write %ld bytes to fd=%d", conn[i].clen-conn[i].data_sent, conn[i].fd);
-                                if ( conn[i].static_res == NOT_STATIC )
-                                {
-#ifdef _WIN32   /* Windows */
-                                    bytes = send(conn[i].fd, conn[i].out_data+conn[i].data_sent, conn[i].clen-conn[i].data_sent, 0);
-#else
-                                    bytes = write(conn[i].fd, conn[i].out_data+conn[i].data_sent, conn[i].clen-conn[i].data_sent);
-#endif  /* _WIN32 */
-                                }
-                                else
-                                {
-#ifdef _WIN32   /* Windows */
-                                    bytes = send(conn[i].fd, M_stat[conn[i].static_res].data+conn[i].data_sent, conn[i].clen-conn[i].data_sent, 0);
-#else
-                                    bytes = write(conn[i].fd, M_stat[conn[i].static_res].data+conn[i].data_sent, conn[i].clen-conn[i].data_sent);
-#endif  /* _WIN32 */
-                                }
-                                conn[i].data_sent += bytes;
-                                set_state(i, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer or !keep_alive) */
-                                                        /*              CONN_STATE_SENDING_BODY (if data_sent < clen) */
-                                                        /*              CONN_STATE_CONNECTED */
-                            }
-                        }
-                    }
-
-                    /* --------------------------------------------------------------------------------------- */
-                    /* after reading / writing it may be ready for parsing and processing ... */
-
-                    if ( conn[i].conn_state == CONN_STATE_READY_FOR_PARSE )
-                    {
-                        clock_gettime(MONOTONIC_CLOCK_NAME, &conn[i].proc_start);
-
-                        conn[i].status = parse_req(i, bytes);
-#ifdef HTTPS
-#ifdef DOMAINONLY       /* redirect to final domain first */
-                        if ( !conn[i].secure && conn[i].upgrade2https && 0!=strcmp(conn[i].host, APP_DOMAIN) )
-                            conn[i].upgrade2https = FALSE;
-#endif
-#endif
-                        if ( conn[i].conn_state != CONN_STATE_READING_DATA )
-                            conn[i].conn_state = CONN_STATE_READY_FOR_PROCESS;
-                    }
-
-                    /* received Expect: 100-continue before content */
+            /* existing connections have something going on on them -- new ones don't stop them ---------- */
+            /* backwards -- closing one moves the last one into its place */
 
-                    if ( conn[i].expect100 )
-                        respond_to_expect(i);
-
-                    /* ready for processing */
-
-                    if ( conn[i].conn_state == CONN_STATE_READY_FOR_PROCESS )
-                    {
-#ifdef HTTPS
-                        if ( conn[i].upgrade2https && conn[i].status==200 )
-                            conn[i].status = 301;
-#endif
-                        /* update visits counter */
-                        if ( !conn[i].resource[0] && conn[i].status==200 && !conn[i].bot && !conn[i].head_only && 0==strcmp(conn[i].host, APP_DOMAIN) )
-                        {
-                            ++G_cnts_today.visits;
-                            if ( conn[i].mobile )
-                                ++G_cnts_today.visits_mob;
-                            else
-                                ++G_cnts_today.visits_dsk;
-                        }
-
-                        /* process request */
-                        process_req(i);
-                        gen_response_header(i);
-                    }
-                }
+            for (j=G_open_conn-1; j>=0; --j)
+            {
+                i = M_active_ci[j];
+                handle_conn(i, FD_ISSET(conn[i].fd, &M_readfds), FD_ISSET(conn[i].fd, &M_writefds));
             }
+#endif  /* EPOLL */
+            if ( G_cnts_today.accepts != accepts )
+                ++G_cnts_today.accept_wakeups;
         }
 
         /* async processing -- check on response queue */
@@ -680,6 +856,13 @@ struct timeval  timeout;                    /* Timeout for select */
                     DBG("ares record found");
                     memcpy(&ares[j], (char*)&res, ASYNC_RES_MSG_SIZE);
                     ares[j].state = ASYNC_STATE_RECEIVED;
+#ifdef IOURING
+                    if ( conn[ares[j].ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+                        uring_poll(ares[j].ci, POLLOUT);    /* wake it up */
+#elif defined(EPOLL)
+                    if ( conn[ares[j].ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+                        set_epoll_events(ares[j].ci, EPOLL_CTL_MOD);    /* wake it up */
+#endif
                     break;
                 }
             }
@@ -705,152 +888,524 @@ struct timeval  timeout;                    /* Timeout for select */
 
 
 /* --------------------------------------------------------------------------
-   Set new connection state after read or write
+   Read from / write to a single connection and process its request
+   readable / writable tell which of the two it's ready for
 -------------------------------------------------------------------------- */
-static void set_state(int ci, long bytes)
+static void handle_conn(int ci, bool readable, bool writable)
 {
-    if ( bytes <= 0 )   /* read failure stop now */
+#ifdef EPOLL
+    long        bytes;
+    unsigned    events=epoll_events(ci);
+
+    /* edge-triggered -- there won't be another event until the socket would block */
+    /* so do whatever the state calls for until then, regardless of which event it was */
+    /* that also covers the next pipelined request, the next streamed chunk */
+    /* and the next request already decrypted in OpenSSL's buffer */
+
+    do
     {
-        DBG("bytes = %ld, errno = %d (%s), disconnecting slot %d\n", bytes, errno, strerror(errno), ci);
-        close_conn(ci);
-        return;
+        if ( conn[ci].conn_state == CONN_STATE_CONNECTED
+                || conn[ci].conn_state == CONN_STATE_READING_HEADER
+                || conn[ci].conn_state == CONN_STATE_READING_DATA
+#ifdef HTTPS
+                || conn[ci].conn_state == CONN_STATE_ACCEPTING
+#endif
+           )
+            bytes = conn_io(ci, TRUE, FALSE);
+        else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER
+                || conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY
+                || conn[ci].conn_state == CONN_STATE_SENDING_BODY
+                || conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+            bytes = conn_io(ci, FALSE, TRUE);
+        else    /* disconnected */
+            break;
+
+        /* after reading / writing it may be ready for parsing and processing ... */
+
+        process_conn(ci);
     }
+    while ( bytes > 0 );
 
-    /* bytes > 0 */
+    /* re-arm only if the events it waits for have changed */
 
-    DBG("bytes = %ld", bytes);
+    if ( conn[ci].conn_state != CONN_STATE_DISCONNECTED && epoll_events(ci) != events )
+        set_epoll_events(ci, EPOLL_CTL_MOD);
+
+#else   /* select or io_uring */
+
+    conn_io(ci, readable, writable);
+
+    /* after reading / writing it may be ready for parsing and processing ... */
+
+    process_conn(ci);
+
+#ifdef HTTPS
+    /* the next pipelined request may already be decrypted in OpenSSL's buffer */
+    /* the socket won't report it so read it now */
 
-    if ( conn[ci].conn_state == CONN_STATE_CONNECTED )  /* assume the whole header has been read */
+    if ( conn[ci].secure
+            && (conn[ci].conn_state == CONN_STATE_CONNECTED || conn[ci].conn_state == CONN_STATE_READING_HEADER)
+            && SSL_pending(conn[ci].ssl) > 0 )
     {
-//      DBG("Changing state to CONN_STATE_READY_FOR_PARSE");
-        conn[ci].conn_state = CONN_STATE_READY_FOR_PARSE;
+        handle_conn(ci, TRUE, FALSE);
+        return;
     }
-    else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )  /* it could have been received only partially */
-    {
-        if ( conn[ci].was_read < conn[ci].clen )
-        {
-            DBG("Continue receiving");
-        }
-        else    /* data received */
-        {
-            conn[ci].data[conn[ci].was_read] = EOS;
-#ifdef DUMP     /* low-level tests */
-//          log_long(conn[ci].data, conn[ci].was_read, "POST data received");
-#else
-            DBG("POST data received");
 #endif
-//          DBG("Changing state to CONN_STATE_READY_FOR_PROCESS");
-            conn[ci].conn_state = CONN_STATE_READY_FOR_PROCESS;
-        }
-    }
-    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )  /* assume the whole header has been sent successfuly */
-    {
-        if ( conn[ci].clen > 0 )
-        {
-//          DBG("Changing state to CONN_STATE_READY_TO_SEND_BODY");
-            conn[ci].conn_state = CONN_STATE_READY_TO_SEND_BODY;
+
+#ifdef IOURING
+    uring_arm(ci);
+#endif
+#endif  /* EPOLL */
+}
+
+
+/* --------------------------------------------------------------------------
+   Read from / write to a single connection once
+   readable / writable tell which of the two it's ready for
+   return the last read / write result
+-------------------------------------------------------------------------- */
+static long conn_io(int ci, bool readable, bool writable)
+{
+    long    bytes=0;
+    char    *body;
+#ifdef HTTPS
+    long    hlen, part;
+#endif
+#ifndef _WIN32
+    struct iovec iov[2];
+#endif
+#ifdef __linux__
+    off_t   offset;
+#endif
+#ifdef ASYNC
+    int     j;
+#endif
+
+    /* --------------------------------------------------------------------------------------- */
+    if ( readable )     /* incoming data ready */
+    {
+//      DBG("\nfd=%d has incoming data ready to read", conn[ci].fd);
+#ifdef HTTPS
+        if ( conn[ci].secure )   /* HTTPS */
+        {
+//          DBG("secure, state=%c, pending=%d", conn[ci].conn_state, SSL_pending(conn[ci].ssl));
+
+            if ( conn[ci].conn_state == CONN_STATE_ACCEPTING
+                    || conn[ci].conn_state == CONN_STATE_CONNECTED
+                    || conn[ci].conn_state == CONN_STATE_READING_HEADER )
+            {
+//              DBG("Trying SSL_read from fd=%d", conn[ci].fd);
+                /* append to what's been read so far -- the header may come in pieces */
+                /* (i.e. when browser splits the request to prevent BEAST attack) */
+                bytes = SSL_read(conn[ci].ssl, conn[ci].in+conn[ci].in_len, IN_BUFSIZE-1-conn[ci].in_len);
+                if ( bytes > 0 )
+                {
+                    conn[ci].in_len += bytes;
+                    conn[ci].in[conn[ci].in_len] = EOS;
+                }
+                set_state_sec(ci, bytes);
+            }
+            else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )  /* POST */
+            {
+//              DBG("state == CONN_STATE_READING_DATA");
+//              DBG("Trying to read %ld bytes of POST data from fd=%d", conn[ci].clen-conn[ci].was_read, conn[ci].fd);
+                bytes = SSL_read(conn[ci].ssl, conn[ci].data+conn[ci].was_read, conn[ci].clen-conn[ci].was_read);
+                if ( bytes > 0 )
+                    conn[ci].was_read += bytes;
+                set_state_sec(ci, bytes);
+            }
         }
-        else /* no body to send */
+        else        /* HTTP */
+#endif
         {
-            DBG("clen = 0");
-            log_proc_time(ci);
-            if ( conn[ci].keep_alive )
+//          DBG("not secure, state=%c", conn[ci].conn_state);
+
+            if ( conn[ci].conn_state == CONN_STATE_CONNECTED || conn[ci].conn_state == CONN_STATE_READING_HEADER )
             {
-                DBG("End of processing, reset_conn\n");
-                reset_conn(ci, CONN_STATE_CONNECTED);
+//              DBG("state == CONN_STATE_CONNECTED");
+//              DBG("Trying read from fd=%d", conn[ci].fd);
+                /* append to what's been read so far -- the header may come in pieces */
+#ifdef _WIN32   /* Windows */
+                bytes = recv(conn[ci].fd, conn[ci].in+conn[ci].in_len, IN_BUFSIZE-1-conn[ci].in_len, 0);
+#else
+                bytes = read(conn[ci].fd, conn[ci].in+conn[ci].in_len, IN_BUFSIZE-1-conn[ci].in_len);
+#endif  /* _WIN32 */
+                if ( bytes > 0 )
+                {
+                    conn[ci].in_len += bytes;
+                    conn[ci].in[conn[ci].in_len] = EOS;
+                }
+                set_state(ci, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
+                                         /*              CONN_STATE_READING_HEADER (if header not complete) */
+                                         /*              CONN_STATE_READY_FOR_PARSE */
             }
-            else
+            else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )   /* POST */
             {
-                DBG("End of processing, close_conn\n");
-                close_conn(ci);
+//              DBG("state == CONN_STATE_READING_DATA");
+//              DBG("Trying to read %ld bytes of POST data from fd=%d", conn[ci].clen-conn[ci].was_read, conn[ci].fd);
+#ifdef _WIN32   /* Windows */
+                bytes = recv(conn[ci].fd, conn[ci].data+conn[ci].was_read, conn[ci].clen-conn[ci].was_read, 0);
+#else
+                bytes = read(conn[ci].fd, conn[ci].data+conn[ci].was_read, conn[ci].clen-conn[ci].was_read);
+#endif  /* _WIN32 */
+                if ( bytes > 0 )
+                    conn[ci].was_read += bytes;
+                set_state(ci, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
+                                         /*              CONN_STATE_READY_FOR_PROCESS */
             }
         }
     }
-    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY )    /* it could have been sent only partially */
+
+    /* --------------------------------------------------------------------------------------- */
+    if ( writable )     /* ready for outgoing data */
     {
-        if ( bytes < conn[ci].clen )
+//      DBG("fd=%d is ready for outgoing data", conn[ci].fd);
+
+        /* async processing */
+#ifdef ASYNC
+        if ( conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
         {
-//          DBG("Changing state to CONN_STATE_SENDING_BODY");
-            conn[ci].conn_state = CONN_STATE_SENDING_BODY;
+            for ( j=0; j<MAX_ASYNC; ++j )
+            {
+                if ( (ares[j].state==ASYNC_STATE_RECEIVED || ares[j].state==ASYNC_STATE_TIMEOUTED) && ares[j].ci == ci )
+                {
+                    if ( ares[j].state == ASYNC_STATE_RECEIVED )
+                    {
+                        DBG("Async response in an array for ci=%d, processing", ci);
+                        app_async_done(ci, ares[j].service, ares[j].data, FALSE);
+                    }
+                    else if ( ares[j].state == ASYNC_STATE_TIMEOUTED )
+                    {
+                        DBG("Async response done as timeout-ed for ci=%d", ci);
+                        app_async_done(ci, ares[j].service, "", TRUE);
+                    }
+                    gen_response_header(ci);
+                    ares[j].state = ASYNC_STATE_FREE;
+                    break;
+                }
+            }
         }
-        else /* assuming the whole body has been sent at once */
+#endif
+        body = resp_body(ci);
+#ifdef HTTPS
+        if ( conn[ci].secure )   /* HTTPS */
         {
-            log_proc_time(ci);
-            if ( conn[ci].keep_alive )
+//          DBG("secure, state=%c", conn[ci].conn_state);
+
+            if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
             {
-                DBG("End of processing, reset_conn\n");
-                reset_conn(ci, CONN_STATE_CONNECTED);
+//              DBG("state == CONN_STATE_READY_TO_SEND_HEADER");
+                /* header and the beginning of body in one TLS record */
+                /* retry after WANT_WRITE rebuilds the same buffer with the same length, as OpenSSL requires */
+                hlen = strlen(conn[ci].header);
+                part = conn[ci].clen;
+                if ( part > SSL_REC_BUFSIZE - hlen )
+                    part = SSL_REC_BUFSIZE - hlen;
+                memcpy(M_ssl_rec, conn[ci].header, hlen);
+                if ( part > 0 && !stat_copy(conn[ci].ranges_cnt < 2 ? conn[ci].static_res : NOT_STATIC, M_ssl_rec+hlen, body, part) )
+                {
+                    close_conn(ci);
+                    return 0;
+                }
+//              DBG("Trying to write %ld bytes to fd=%d", hlen+part, conn[ci].fd);
+                bytes = SSL_write(conn[ci].ssl, M_ssl_rec, hlen+part);
+                if ( bytes > 0 )
+                    conn[ci].data_sent = part;
+                set_state_sec(ci, bytes);
             }
-            else
+            else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[ci].conn_state == CONN_STATE_SENDING_BODY)
             {
-                DBG("End of processing, close_conn\n");
-                close_conn(ci);
+//              DBG("state == %s", conn[ci].conn_state==CONN_STATE_READY_TO_SEND_BODY?"CONN_STATE_READY_TO_SEND_BODY":"CONN_STATE_SENDING_BODY");
+//              DBG("Trying to write %ld bytes to fd=%d", conn[ci].clen-conn[ci].data_sent, conn[ci].fd);
+                if ( conn[ci].static_res != NOT_STATIC && M_stat[conn[ci].static_res].on_disk && conn[ci].ranges_cnt < 2 )
+                {
+                    /* not from the mapping -- file may have been overwritten */
+                    part = conn[ci].clen - conn[ci].data_sent;
+                    if ( part > SSL_REC_BUFSIZE )
+                        part = SSL_REC_BUFSIZE;
+                    if ( !stat_copy(conn[ci].static_res, M_ssl_rec, body+conn[ci].data_sent, part) )
+                    {
+                        close_conn(ci);
+                        return 0;
+                    }
+                    bytes = SSL_write(conn[ci].ssl, M_ssl_rec, part);
+                }
+                else
+                    bytes = SSL_write(conn[ci].ssl, body+conn[ci].data_sent, conn[ci].clen-conn[ci].data_sent);
+                if ( bytes > 0 )
+                    conn[ci].data_sent += bytes;
+                set_state_sec(ci, bytes);
             }
         }
-    }
-    else if ( conn[ci].conn_state == CONN_STATE_SENDING_BODY )
-    {
-        if ( conn[ci].data_sent < conn[ci].clen )
-        {
-            DBG("Continue sending");
-        }
-        else    /* body sent */
+        else    /* HTTP */
+#endif
         {
-            log_proc_time(ci);
-            if ( conn[ci].keep_alive )
+//          DBG("not secure, state=%c", conn[ci].conn_state);
+
+            if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
             {
-                DBG("End of processing, reset_conn\n");
-                reset_conn(ci, CONN_STATE_CONNECTED);
+//              DBG("state == CONN_STATE_READY_TO_SEND_HEADER");
+//              DBG("Trying to write %ld bytes to fd=%d", strlen(conn[ci].header)+conn[ci].clen, conn[ci].fd);
+#ifdef _WIN32   /* Windows */
+                bytes = send(conn[ci].fd, conn[ci].header, strlen(conn[ci].header), 0);
+                set_state(ci, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer) */
+                                         /*              CONN_STATE_READY_TO_SEND_BODY */
+#else
+                /* header and body with one syscall */
+                iov[0].iov_base = conn[ci].header;
+                iov[0].iov_len = strlen(conn[ci].header);
+                iov[1].iov_base = body;
+                iov[1].iov_len = conn[ci].clen;
+#ifdef __linux__
+                if ( conn[ci].static_res != NOT_STATIC && M_stat[conn[ci].static_res].on_disk && conn[ci].ranges_cnt < 2 )
+                    iov[1].iov_len = 0;     /* body goes with sendfile() */
+#endif
+                bytes = writev(conn[ci].fd, iov, conn[ci].clen > 0 ? 2 : 1);
+                set_state_hdr(ci, bytes);    /* possibly:    CONN_STATE_READY_TO_SEND_HEADER (if header sent partially) */
+                                             /*              CONN_STATE_SENDING_BODY (if data_sent < clen) */
+                                             /*              CONN_STATE_CONNECTED */
+#endif  /* _WIN32 */
             }
-            else
+            else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[ci].conn_state == CONN_STATE_SENDING_BODY)
             {
-                DBG("End of processing, close_conn\n");
-                close_conn(ci);
+//              DBG("state == %s", conn[ci].conn_state==CONN_STATE_READY_TO_SEND_BODY?"CONN_STATE_READY_TO_SEND_BODY":"CONN_STATE_SENDING_BODY");
+//              DBG("Trying to write %ld bytes to fd=%d", conn[ci].clen-conn[ci].data_sent, conn[ci].fd);
+#ifdef _WIN32   /* Windows */
+                bytes = send(conn[ci].fd, body+conn[ci].data_sent, conn[ci].clen-conn[ci].data_sent, 0);
+#else
+#ifdef __linux__
+                if ( conn[ci].static_res != NOT_STATIC && M_stat[conn[ci].static_res].on_disk && conn[ci].ranges_cnt < 2 )
+                {
+                    offset = body - M_stat[conn[ci].static_res].fd_base + conn[ci].data_sent;
+                    bytes = sendfile(conn[ci].fd, M_stat[conn[ci].static_res].fd, &offset, conn[ci].clen-conn[ci].data_sent);
+                }
+                else
+#endif
+                bytes = write(conn[ci].fd, body+conn[ci].data_sent, conn[ci].clen-conn[ci].data_sent);
+#endif  /* _WIN32 */
+                if ( bytes > 0 )
+                    conn[ci].data_sent += bytes;
+                set_state(ci, bytes);    /* possibly:    CONN_STATE_DISCONNECTED (if error or closed by peer or !keep_alive) */
+                                         /*              CONN_STATE_SENDING_BODY (if data_sent < clen) */
+                                         /*              CONN_STATE_CONNECTED */
             }
         }
     }
+
+    return bytes;
 }
 
 
 /* --------------------------------------------------------------------------
-   Set new connection state after read or write for secure connections
+   Parse and process request once it's been read
 -------------------------------------------------------------------------- */
-static void set_state_sec(int ci, long bytes)
+static void process_conn(int ci)
 {
-    int     e;
-    char    ec[64]="";
+    if ( conn[ci].conn_state == CONN_STATE_READY_FOR_PARSE )
+    {
+        clock_gettime(MONOTONIC_CLOCK_NAME, &conn[ci].proc_start);
+
+        conn[ci].status = parse_req(ci, conn[ci].in_len);
 #ifdef HTTPS
-    e = errno;
+#ifdef DOMAINONLY       /* redirect to final domain first */
+        if ( !conn[ci].secure && conn[ci].upgrade2https && 0!=strcmp(conn[ci].host, APP_DOMAIN) )
+            conn[ci].upgrade2https = FALSE;
+#endif
+#endif
+        if ( conn[ci].conn_state != CONN_STATE_READING_DATA )
+            conn[ci].conn_state = CONN_STATE_READY_FOR_PROCESS;
+    }
 
-    conn[ci].ssl_err = SSL_get_error(conn[ci].ssl, bytes);
+    /* received Expect: 100-continue before content */
 
-    if ( bytes <= 0 )
+    if ( conn[ci].expect100 )
+        respond_to_expect(ci);
+
+    /* ready for processing */
+
+    if ( conn[ci].conn_state == CONN_STATE_READY_FOR_PROCESS )
     {
-        if ( conn[ci].ssl_err == SSL_ERROR_SYSCALL )
-            sprintf(ec, ", errno = %d (%s)", e, strerror(e));
+#ifdef HTTPS
+        if ( conn[ci].upgrade2https && conn[ci].status==200 )
+            conn[ci].status = 301;
+#endif
+        /* update visits counter */
+        if ( !conn[ci].resource[0] && conn[ci].status==200 && !conn[ci].bot && !conn[ci].head_only && 0==strcmp(conn[ci].host, APP_DOMAIN) )
+        {
+            ++G_cnts_today.visits;
+            if ( conn[ci].mobile )
+                ++G_cnts_today.visits_mob;
+            else
+                ++G_cnts_today.visits_dsk;
+        }
 
-        DBG("bytes = %ld, ssl_err = %d%s", bytes, conn[ci].ssl_err, ec);
+        /* process request */
+        process_req(ci);
+        gen_response_header(ci);
+    }
+}
 
-        if ( conn[ci].ssl_err != SSL_ERROR_WANT_READ && conn[ci].ssl_err != SSL_ERROR_WANT_WRITE )
+
+/* --------------------------------------------------------------------------
+   Return response body to send
+   It's out_data or static resource, possibly its part or compressed variant
+-------------------------------------------------------------------------- */
+static char *resp_body(int ci)
+{
+    stat_res_t  *res;
+
+    if ( conn[ci].static_res == NOT_STATIC || conn[ci].ranges_cnt > 1 )
+        return conn[ci].out_data;
+
+    res = &M_stat[conn[ci].static_res];
+
+    if ( conn[ci].ranges_cnt == 1 )     /* single byte range */
+        return res->data + conn[ci].ranges[0].from;
+#ifdef GZIP
+    if ( conn[ci].content_enc == CONTENT_ENC_GZIP )
+        return res->data_gz;
+#endif
+#ifdef BROTLI
+    if ( conn[ci].content_enc == CONTENT_ENC_BR )
+        return res->data_br;
+#endif
+    return res->data;
+}
+
+
+/* --------------------------------------------------------------------------
+   Set new connection state after header and body have been written together
+   If the header has gone only partially, the rest waits for the next write
+-------------------------------------------------------------------------- */
+static void set_state_hdr(int ci, long bytes)
+{
+    long    hlen;
+
+    if ( bytes > 0 )
+    {
+        hlen = strlen(conn[ci].header);
+
+        if ( bytes < hlen )
         {
-            DBG("Closing connection\n");
-            close_conn(ci);
+            DBG("Header sent partially (%ld of %ld bytes)", bytes, hlen);
+            memmove(conn[ci].header, conn[ci].header+bytes, hlen-bytes+1);
+            return;
         }
 
+        conn[ci].data_sent = bytes - hlen;
+    }
+
+    set_state(ci, bytes);
+}
+
+
+/* --------------------------------------------------------------------------
+   Response (or its streamed chunk) has been sent
+-------------------------------------------------------------------------- */
+static void resp_sent(int ci)
+{
+    if ( conn[ci].stream )  /* app has more to say */
+    {
+        conn[ci].p_curr_c = conn[ci].out_data;
+        stream_chunk(ci);
+        conn[ci].conn_state = CONN_STATE_READY_TO_SEND_BODY;
         return;
     }
 
-    /* bytes > 0 */
+    log_proc_time(ci);
 
-    DBG("bytes = %ld", bytes);
+    if ( conn[ci].keep_alive )
+    {
+        DBG("End of processing, reset_conn\n");
+        reset_conn(ci, CONN_STATE_CONNECTED);
+    }
+    else
+    {
+        DBG("End of processing, close_conn\n");
+        close_conn(ci);
+    }
+}
 
-    // we have no way of knowing if accept finished before reading actual request
-    if ( conn[ci].conn_state == CONN_STATE_ACCEPTING || conn[ci].conn_state == CONN_STATE_CONNECTED )   /* assume the whole header has been read */
+
+/* --------------------------------------------------------------------------
+   Set new connection state after reading (part of) request header
+-------------------------------------------------------------------------- */
+static void set_state_header_read(int ci)
+{
+    if ( header_complete(ci) )
     {
 //      DBG("Changing state to CONN_STATE_READY_FOR_PARSE");
         conn[ci].conn_state = CONN_STATE_READY_FOR_PARSE;
     }
-    else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )
+    else if ( conn[ci].in_len >= IN_BUFSIZE-1 )
+    {
+        WAR("Request header longer than %d bytes", IN_BUFSIZE-1);
+        conn[ci].conn_state = CONN_STATE_READY_FOR_PARSE;   /* parse_req will respond with 431 */
+    }
+    else
+    {
+        DBG("Header not complete yet, %ld bytes so far", conn[ci].in_len);
+        conn[ci].conn_state = CONN_STATE_READING_HEADER;
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Look for the end of request header in what's been read so far
+   Scanning resumes where the previous read ended
+-------------------------------------------------------------------------- */
+static bool header_complete(int ci)
+{
+    long    i;
+    char    *p;
+
+    i = conn[ci].hdr_scanned;
+
+    while ( i < conn[ci].in_len && (p=(char*)memchr(conn[ci].in+i, '\n', conn[ci].in_len-i)) )
+    {
+        i = p - conn[ci].in;
+
+        /* "\n\n" or "\n\r\n" -- new line characters may have come with the previous read */
+
+        if ( (i > 0 && *(p-1) == '\n') || (i > 1 && *(p-1) == '\r' && *(p-2) == '\n') )
+            return TRUE;
+
+        ++i;
+    }
+
+    conn[ci].hdr_scanned = conn[ci].in_len;
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Set new connection state after read or write
+-------------------------------------------------------------------------- */
+static void set_state(int ci, long bytes)
+{
+    if ( bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    {
+        DBG("Socket would block, waiting for it to be ready again");
+        return;
+    }
+
+    if ( bytes <= 0 )   /* read failure stop now */
+    {
+        DBG("bytes = %ld, errno = %d (%s), disconnecting slot %d\n", bytes, errno, strerror(errno), ci);
+        close_conn(ci);
+        return;
+    }
+
+    /* bytes > 0 */
+
+    DBG("bytes = %ld", bytes);
+
+    if ( conn[ci].conn_state == CONN_STATE_CONNECTED || conn[ci].conn_state == CONN_STATE_READING_HEADER )
+    {
+        set_state_header_read(ci);
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )  /* it could have been received only partially */
     {
         if ( conn[ci].was_read < conn[ci].clen )
         {
@@ -868,59 +1423,136 @@ static void set_state_sec(int ci, long bytes)
             conn[ci].conn_state = CONN_STATE_READY_FOR_PROCESS;
         }
     }
-    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )  /* the whole header has been sent, possibly with some body */
     {
-        if ( conn[ci].clen > 0 )
+        if ( conn[ci].data_sent < conn[ci].clen )
         {
 //          DBG("Changing state to CONN_STATE_READY_TO_SEND_BODY");
-            conn[ci].conn_state = CONN_STATE_READY_TO_SEND_BODY;
+            conn[ci].conn_state = conn[ci].data_sent ? CONN_STATE_SENDING_BODY : CONN_STATE_READY_TO_SEND_BODY;
         }
-        else /* no body to send */
+        else    /* the whole response has gone with header */
         {
-            DBG("clen = 0");
-            log_proc_time(ci);
-            if ( conn[ci].keep_alive )
-            {
-                DBG("End of processing, reset_conn\n");
-                reset_conn(ci, CONN_STATE_CONNECTED);
-            }
-            else
-            {
-                DBG("End of processing, close_conn\n");
-                close_conn(ci);
-            }
+            resp_sent(ci);
         }
     }
-    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[ci].conn_state == CONN_STATE_SENDING_BODY )
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY )    /* it could have been sent only partially */
     {
-        log_proc_time(ci);
-        if ( conn[ci].keep_alive )
+        if ( conn[ci].data_sent < conn[ci].clen )
         {
-            DBG("End of processing, reset_conn\n");
-            reset_conn(ci, CONN_STATE_CONNECTED);
+//          DBG("Changing state to CONN_STATE_SENDING_BODY");
+            conn[ci].conn_state = CONN_STATE_SENDING_BODY;
         }
-        else
+        else /* assuming the whole body has been sent at once */
         {
-            DBG("End of processing, close_conn\n");
-            close_conn(ci);
+            resp_sent(ci);
+        }
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_SENDING_BODY )
+    {
+        if ( conn[ci].data_sent < conn[ci].clen )
+        {
+            DBG("Continue sending");
+        }
+        else    /* body sent */
+        {
+            resp_sent(ci);
         }
     }
-#endif
 }
 
 
 /* --------------------------------------------------------------------------
-   Read & parse conf file and set global parameters
+   Set new connection state after read or write for secure connections
 -------------------------------------------------------------------------- */
-static void read_conf()
+static void set_state_sec(int ci, long bytes)
 {
-    char    *p_conf_path=NULL;
-    char    conf_path[512];
+    int     e;
+    char    ec[64]="";
+#ifdef HTTPS
+    e = errno;
 
-    /* set defaults */
+    conn[ci].ssl_err = SSL_get_error(conn[ci].ssl, bytes);
 
-    G_logLevel = 4;
-    G_httpPort = 80;
+    if ( bytes <= 0 )
+    {
+        if ( conn[ci].ssl_err == SSL_ERROR_SYSCALL )
+            sprintf(ec, ", errno = %d (%s)", e, strerror(e));
+
+        DBG("bytes = %ld, ssl_err = %d%s", bytes, conn[ci].ssl_err, ec);
+
+        if ( conn[ci].ssl_err != SSL_ERROR_WANT_READ && conn[ci].ssl_err != SSL_ERROR_WANT_WRITE )
+        {
+            DBG("Closing connection\n");
+            close_conn(ci);
+        }
+
+        return;
+    }
+
+    /* bytes > 0 */
+
+    DBG("bytes = %ld", bytes);
+
+    // we have no way of knowing if accept finished before reading actual request
+    if ( conn[ci].conn_state == CONN_STATE_ACCEPTING
+            || conn[ci].conn_state == CONN_STATE_CONNECTED
+            || conn[ci].conn_state == CONN_STATE_READING_HEADER )
+    {
+        set_state_header_read(ci);
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )
+    {
+        if ( conn[ci].was_read < conn[ci].clen )
+        {
+            DBG("Continue receiving");
+        }
+        else    /* data received */
+        {
+            conn[ci].data[conn[ci].was_read] = EOS;
+#ifdef DUMP     /* low-level tests */
+//          log_long(conn[ci].data, conn[ci].was_read, "POST data received");
+#else
+            DBG("POST data received");
+#endif
+//          DBG("Changing state to CONN_STATE_READY_FOR_PROCESS");
+            conn[ci].conn_state = CONN_STATE_READY_FOR_PROCESS;
+        }
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
+    {
+        if ( conn[ci].data_sent < conn[ci].clen )
+        {
+//          DBG("Changing state to CONN_STATE_READY_TO_SEND_BODY");
+            conn[ci].conn_state = conn[ci].data_sent ? CONN_STATE_SENDING_BODY : CONN_STATE_READY_TO_SEND_BODY;
+        }
+        else    /* the whole response has gone with header */
+        {
+            resp_sent(ci);
+        }
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[ci].conn_state == CONN_STATE_SENDING_BODY )
+    {
+        if ( conn[ci].data_sent < conn[ci].clen )   /* file on disk goes one record at a time */
+            conn[ci].conn_state = CONN_STATE_SENDING_BODY;
+        else
+            resp_sent(ci);
+    }
+#endif
+}
+
+
+/* --------------------------------------------------------------------------
+   Read & parse conf file and set global parameters
+-------------------------------------------------------------------------- */
+static void read_conf()
+{
+    char    *p_conf_path=NULL;
+    char    conf_path[512];
+
+    /* set defaults */
+
+    G_logLevel = 4;
+    G_httpPort = 80;
     G_httpsPort = 443;
     G_certFile[0] = EOS;
     G_certChainFile[0] = EOS;
@@ -931,6 +1563,14 @@ static void read_conf()
     G_dbUser[0] = EOS;
     G_dbPassword[0] = EOS;
     G_blockedIPList[0] = EOS;
+    G_workers = 1;
+    G_threads = 1;
+    G_acceptBatch = 64;
+    G_largeStatic = 1048576;
+    G_largePost = 1048576;
+    G_largePostDir[0] = EOS;
+    G_compressMin = 1024;
+    G_statVersioned = 0;
     G_test = 0;
 
     /* get the conf file path & name */
@@ -1023,6 +1663,12 @@ static void log_proc_time(int ci)
 -------------------------------------------------------------------------- */
 static void close_conn(int ci)
 {
+#ifdef IOURING
+    if ( conn[ci].uring_pending )
+        uring_cancel(ci);   /* while the fd is still there */
+    ++conn[ci].uring_gen;   /* whatever comes back later is not for us */
+    conn[ci].uring_pending = 0;
+#endif
 #ifdef HTTPS
     if ( conn[ci].secure )
         SSL_free(conn[ci].ssl);
@@ -1030,8 +1676,10 @@ static void close_conn(int ci)
 #ifdef _WIN32   /* Windows */
     closesocket(conn[ci].fd);
 #else
-    close(conn[ci].fd);
+    close(conn[ci].fd);     /* this also removes it from the epoll set */
 #endif  /* _WIN32 */
+    release_conn(ci);
+    timer_del(TIMER_CONN+ci);
     reset_conn(ci, CONN_STATE_DISCONNECTED);
 }
 
@@ -1083,9 +1731,13 @@ static bool init(int argc, char **argv)
     /* init time variables */
 
     G_now = time(NULL);
-    G_ptm = gmtime(&G_now);
+    G_ptm = lib_gmtime(&G_now);
     sprintf(G_dt, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
 
+    /* multipart/byteranges boundary */
+
+    silgy_random(M_range_boundary, RANGE_BOUNDARY_LEN);
+
     /* start log */
 
     if ( !log_start("", G_test) )
@@ -1110,8 +1762,49 @@ static bool init(int argc, char **argv)
     ALWAYS("G_dbHost [%s]", G_dbHost);
     ALWAYS("G_dbPort = %d", G_dbPort);
     ALWAYS("G_dbName [%s]", G_dbName);
+    ALWAYS("workers = %d", G_workers);
+    ALWAYS("threads = %d", G_threads);
+    ALWAYS("acceptBatch = %d", G_acceptBatch);
+    ALWAYS("largeStatic = %ld", G_largeStatic);
+    ALWAYS("largePost = %ld", G_largePost);
+    ALWAYS("largePostDir [%s]", G_largePostDir);
+    ALWAYS("compressMin = %ld", G_compressMin);
+    ALWAYS("statVersioned = %d", G_statVersioned);
     ALWAYS("G_test = %d", G_test);
 
+    if ( G_acceptBatch < 1 )
+        G_acceptBatch = 1;
+
+#ifdef THREADS
+    if ( G_threads > 1 && G_workers > 1 )
+    {
+        WAR("workers and threads can't be combined, ignoring workers");
+        G_workers = 1;
+    }
+#else
+    if ( G_threads > 1 )
+    {
+        WAR("threads require THREADS compilation switch, running single thread");
+        G_threads = 1;
+    }
+#endif
+
+#ifdef _WIN32   /* Windows */
+    if ( G_workers > 1 )
+    {
+        WAR("workers are not available on Windows, running single process");
+        G_workers = 1;
+    }
+#endif
+#ifdef ASYNC
+    if ( G_workers > 1 || G_threads > 1 )   /* responses come through one queue and must go back to the same loop */
+    {
+        WAR("ASYNC requires single process and thread, ignoring workers and threads");
+        G_workers = 1;
+        G_threads = 1;
+    }
+#endif
+
     /* pid file --------------------------------------------------------------------------- */
 
     if ( !(M_pidfile=lib_create_pid_file(argv[0])) )
@@ -1121,6 +1814,9 @@ static bool init(int argc, char **argv)
 
     strcpy(M_stat[0].name, "-");
 
+    for ( i=0; i<STAT_HASH_SIZE; ++i )
+        M_stat_hash[i] = -1;
+
     /* check endianness and some parameters */
 
     get_byteorder();
@@ -1180,6 +1876,13 @@ static bool init(int argc, char **argv)
 #endif
 #ifdef QS_DEF_HTML_ESCAPE
     ALWAYS(" Query string security = QS_DEF_HTML_ESCAPE");
+#endif
+#ifdef IOURING
+    ALWAYS("        Event notifier = io_uring");
+#elif defined(EPOLL)
+    ALWAYS("        Event notifier = EPOLL");
+#else
+    ALWAYS("        Event notifier = select");
 #endif
     ALWAYS("");
     ALWAYS("Program:");
@@ -1213,6 +1916,8 @@ static bool init(int argc, char **argv)
     ALWAYS("----------------------------------------------------------------------------------------------");
     ALWAYS("");
 
+    hdr_init();     /* prebuilt response header lines */
+
     /* custom init
        Among others, that may contain generating statics, like css and js */
 
@@ -1226,6 +1931,10 @@ static bool init(int argc, char **argv)
 
     /* read static resources */
 
+#ifndef _WIN32
+    stat_bundle_open();     /* prepared by silgy_pack */
+#endif
+
     if ( !read_files(FALSE) )   /* normal */
     {
         ERR("read_files() failed");
@@ -1244,32 +1953,7 @@ static bool init(int argc, char **argv)
 
     /* special case statics -- check if present */
 
-    for ( i=0; M_stat[i].name[0] != '-'; ++i )
-    {
-        if ( 0==strcmp(M_stat[i].name, "favicon.ico") )
-        {
-            M_favicon_exists = TRUE;
-            break;
-        }
-    }
-
-    for ( i=0; M_stat[i].name[0] != '-'; ++i )
-    {
-        if ( 0==strcmp(M_stat[i].name, "robots.txt") )
-        {
-            M_robots_exists = TRUE;
-            break;
-        }
-    }
-
-    for ( i=0; M_stat[i].name[0] != '-'; ++i )
-    {
-        if ( 0==strcmp(M_stat[i].name, "apple-touch-icon.png") )
-        {
-            M_appleicon_exists = TRUE;
-            break;
-        }
-    }
+    stat_check_special();
 
     DBG("Standard icons OK");
 
@@ -1294,7 +1978,7 @@ static bool init(int argc, char **argv)
     DBG("Now is: %s\n", G_last_modified);
 
     sometimeahead = G_now + 3600*24*EXPIRES_IN_DAYS;
-    G_ptm = gmtime(&sometimeahead);
+    G_ptm = lib_gmtime(&sometimeahead);
 #ifdef _WIN32   /* Windows */
     strftime(M_expires, 32, "%a, %d %b %Y %H:%M:%S GMT", G_ptm);
 #else
@@ -1302,7 +1986,7 @@ static bool init(int argc, char **argv)
 #endif  /* _WIN32 */
     DBG("M_expires: %s\n", M_expires);
 
-    G_ptm = gmtime(&G_now); /* reset to today */
+    G_ptm = lib_gmtime(&G_now); /* reset to today */
 
 #ifndef _WIN32
     /* handle signals */
@@ -1416,1037 +2100,3353 @@ static void setnonblocking(int sock)
 }
 
 
+#ifdef IOURING
 /* --------------------------------------------------------------------------
-  build select list
+  set up io_uring instance
+  both rings are mapped into our memory and shared with the kernel
 -------------------------------------------------------------------------- */
-static void build_select_list()
+static bool uring_init()
 {
-    int i;
+    struct io_uring_params p;
+    size_t  sq_size, cq_size;
+    char    *sq_ptr, *cq_ptr;
 
-    FD_ZERO(&M_readfds);
-    FD_ZERO(&M_writefds);
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
 
-    FD_SET(M_listening_fd, &M_readfds);
-#ifdef HTTPS
-    FD_SET(M_listening_sec_fd, &M_readfds);
-#endif
+    if ( (M_ring.fd=syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p)) < 0 )
+    {
+        ERR("io_uring_setup failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
+    }
 
-    G_open_conn = 0;
+    if ( !(p.features & IORING_FEAT_EXT_ARG) )
+    {
+        ERR("io_uring is too old, kernel 5.11 or newer is required");
+        return FALSE;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
 
-    for ( i=0; i<MAX_CONNECTIONS; ++i )
+    if ( p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size )
+        sq_size = cq_size;
+
+    sq_ptr = (char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, M_ring.fd, IORING_OFF_SQ_RING);
+
+    if ( sq_ptr == MAP_FAILED )
     {
-        if ( conn[i].conn_state != CONN_STATE_DISCONNECTED )
-        {
-            FD_SET(conn[i].fd, &M_readfds);
+        ERR("mmap(IORING_OFF_SQ_RING) failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
+    }
 
-            /* only for certain states */
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+        cq_ptr = sq_ptr;
+    else if ( (cq_ptr=(char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, M_ring.fd, IORING_OFF_CQ_RING)) == MAP_FAILED )
+    {
+        ERR("mmap(IORING_OFF_CQ_RING) failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
+    }
 
-#ifdef HTTPS
-            if ( conn[i].secure )
-            {
-                if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_HEADER
-                        || conn[i].conn_state == CONN_STATE_READY_TO_SEND_BODY
-                        || conn[i].conn_state == CONN_STATE_SENDING_BODY
-                        || conn[i].ssl_err == SSL_ERROR_WANT_WRITE )
-                {
-                    FD_SET(conn[i].fd, &M_writefds);
-                }
-            }
-            else
-            {
-#endif
-                if ( conn[i].conn_state != CONN_STATE_CONNECTED
-                        && conn[i].conn_state != CONN_STATE_READING_DATA )
-                    FD_SET(conn[i].fd, &M_writefds);
-#ifdef HTTPS
-            }
-#endif
-            if (conn[i].fd > M_highsock)
-                M_highsock = conn[i].fd;
-            ++G_open_conn;
-        }
+    M_ring.sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, M_ring.fd, IORING_OFF_SQES);
+
+    if ( M_ring.sqes == MAP_FAILED )
+    {
+        ERR("mmap(IORING_OFF_SQES) failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
     }
+
+    M_ring.sq_head = (unsigned*)(sq_ptr + p.sq_off.head);
+    M_ring.sq_tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+    M_ring.sq_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+    M_ring.sq_array = (unsigned*)(sq_ptr + p.sq_off.array);
+    M_ring.sq_entries = p.sq_entries;
+    M_ring.tail = *M_ring.sq_tail;
+
+    M_ring.cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+    M_ring.cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+    M_ring.cq_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+    M_ring.cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+
+    DBG("io_uring sq_entries = %u, cq_entries = %u", p.sq_entries, p.cq_entries);
+
+    return TRUE;
 }
 
 
 /* --------------------------------------------------------------------------
-   Handle a brand new connection
-   we've got fd and IP here for conn array
+  get next free submission queue entry
+  it goes to the kernel with the next uring_enter()
 -------------------------------------------------------------------------- */
-static void accept_http()
+static struct io_uring_sqe *uring_get_sqe()
 {
-    int     i;          /* current item in conn_sockets for for loops */
-    int     connection; /* socket file descriptor for incoming connections */
-static struct   sockaddr_in cli_addr;   /* static = initialised to zeros */
-    socklen_t   addr_len;
-    char    remote_addr[INET_ADDRSTRLEN]="";    /* remote address */
-    long    bytes;
+    struct io_uring_sqe *sqe;
+    unsigned idx;
 
-    /* We have a new connection coming in! We'll
-       try to find a spot for it in conn_sockets.  */
+    if ( M_ring.tail - __atomic_load_n(M_ring.sq_head, __ATOMIC_ACQUIRE) >= M_ring.sq_entries )
+        uring_enter(0, 0);  /* full -- hand over what's there */
 
-    addr_len = sizeof(cli_addr);
+    idx = M_ring.tail & *M_ring.sq_mask;
+    sqe = &M_ring.sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    M_ring.sq_array[idx] = idx;
+    ++M_ring.tail;
 
-    /* connection is a fd that accept gives us that we'll be communicating through now with the remote client */
-    /* this fd will become our conn id for the whole connection's life (that is, until one of the sides close()-s) */
+    return sqe;
+}
 
-    connection = accept(M_listening_fd, (struct sockaddr*)&cli_addr, &addr_len);
 
-    if (connection < 0)
-    {
-        ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
-        return;
-    }
+/* --------------------------------------------------------------------------
+  submit queued entries and wait for min_complete completions
+  (up to timeout_ms milliseconds)
+  return number of completions ready or -1 on error
+-------------------------------------------------------------------------- */
+static int uring_enter(unsigned min_complete, int timeout_ms)
+{
+    unsigned    to_submit;
+    unsigned    flags=0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
 
-    /* get the remote address */
-#ifdef _WIN32   /* Windows */
-    strcpy(remote_addr, inet_ntoa(cli_addr.sin_addr));
-#else
-    inet_ntop(AF_INET, &(cli_addr.sin_addr), remote_addr, INET_ADDRSTRLEN);
-#endif
+    __atomic_store_n(M_ring.sq_tail, M_ring.tail, __ATOMIC_RELEASE);
 
-    if ( G_blockedIPList[0] && ip_blocked(remote_addr) )
+    to_submit = M_ring.tail - __atomic_load_n(M_ring.sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+
+    if ( min_complete )
     {
-        ++G_cnts_today.blocked;
-#ifdef _WIN32   /* Windows */
-        closesocket(connection);
-#else
-        close(connection);
-#endif  /* _WIN32 */
-        return;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (__u64)(unsigned long)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
     }
 
-    setnonblocking(connection);
+    if ( (to_submit || min_complete)
+            && syscall(__NR_io_uring_enter, M_ring.fd, to_submit, min_complete, flags, &arg, sizeof(arg)) < 0
+            && errno != ETIME && errno != EINTR )
+        return -1;
+
+    return __atomic_load_n(M_ring.cq_tail, __ATOMIC_ACQUIRE) - *M_ring.cq_head;
+}
+
 
-    /* find a free slot in conn */
+/* --------------------------------------------------------------------------
+  multishot accept on listening socket or poll on async response queue
+  needs to be submitted again only when the kernel says it's stopped
+  Before 5.19 accept is single-shot and re-armed after every completion
+  user_data's low bit marks multishot accept
+-------------------------------------------------------------------------- */
+static void uring_listen(int op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe();
 
-    for (i=0; (i<MAX_CONNECTIONS) && (connection != -1); ++i)
+    if ( op == URING_ASYNC_RES )
+    {
+#ifdef ASYNC
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = G_queue_res;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+#endif
+    }
+    else
     {
-        if ( conn[i].conn_state == CONN_STATE_DISCONNECTED )    /* free connection slot -- we'll use it */
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = op==URING_ACCEPT ? M_listening_fd : M_listening_sec_fd;
+        sqe->accept_flags = SOCK_NONBLOCK;
+
+        if ( !M_uring_single_accept )
         {
-            DBG("\nConnection accepted: %s, slot=%d, fd=%d", remote_addr, i, connection);
-            conn[i].fd = connection;
-            conn[i].secure = FALSE;
-            strcpy(conn[i].ip, remote_addr);        /* possibly client IP */
-            strcpy(conn[i].pip, remote_addr);       /* possibly proxy IP */
-            conn[i].conn_state = CONN_STATE_CONNECTED;
-            conn[i].last_activity = G_now;
-            connection = -1;                        /* mark as OK */
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = (__u64)op << 24 | 1;
+            return;
         }
     }
 
-    if (connection != -1)   /* none was free */
-    {
-        /* No room left in the queue! */
-        WAR("No room left for new client, sending 503");
-#ifdef _WIN32   /* Windows */
-        bytes = send(connection, "HTTP/1.1 503 Service Unavailable\r\n\r\n", 36, 0);
-#else
-        bytes = write(connection, "HTTP/1.1 503 Service Unavailable\r\n\r\n", 36);
-#endif  /* _WIN32 */
-        if ( bytes < 36 )
-            ERR("write error, bytes = %d of 36", bytes);
-#ifdef _WIN32   /* Windows */
-        closesocket(connection);
-#else
-        close(connection);
-#endif  /* _WIN32 */
-    }
+    sqe->user_data = (__u64)op << 24;
 }
 
 
+#if defined(HTTPS) || defined(ASYNC)
 /* --------------------------------------------------------------------------
-   Handle a brand new connection
-   we've got fd and IP here for conn array
+  one-shot poll
+  used for HTTPS connections (OpenSSL does the I/O) and for waking up
+  connections waiting for async response
 -------------------------------------------------------------------------- */
-static void accept_https()
+static void uring_poll(int ci, unsigned events)
 {
-#ifdef HTTPS
-    int     i;          /* current item in conn_sockets for for loops */
-    int     connection; /* socket file descriptor for incoming connections */
-static struct   sockaddr_in cli_addr;   /* static = initialised to zeros */
-    socklen_t   addr_len;
-    char    remote_addr[INET_ADDRSTRLEN]="";    /* remote address */
-    long    bytes;
-    int     ret, ssl_err;
+    struct io_uring_sqe *sqe;
+
+    if ( conn[ci].uring_pending ) return;
+
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn[ci].fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (__u64)conn[ci].uring_gen << 32 | URING_POLL << 24 | ci;
+
+    ++conn[ci].uring_pending;
+}
+#endif  /* HTTPS || ASYNC */
 
-    /* We have a new connection coming in! We'll
-       try to find a spot for it in conn_sockets.  */
 
-    addr_len = sizeof(cli_addr);
+/* --------------------------------------------------------------------------
+  queue recv / send
+  for URING_SEND_HEADER buf points to msghdr with header and body
+-------------------------------------------------------------------------- */
+static void uring_io(int ci, int op, void *buf, unsigned len, int flags)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe();
+    if ( op == URING_RECV )
+        sqe->opcode = IORING_OP_RECV;
+    else if ( op == URING_SEND_HEADER )
+        sqe->opcode = IORING_OP_SENDMSG;    /* buf = struct msghdr */
+    else
+        sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn[ci].fd;
+    sqe->addr = (__u64)(unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = (__u64)conn[ci].uring_gen << 32 | op << 24 | ci;
+
+    ++conn[ci].uring_pending;
+}
 
-    /* connection is a fd that accept gives us that we'll be communicating through now with the remote client */
-    /* this fd will become our conn id for the whole connection's life (that is, until one of the sides close()-s) */
 
-    connection = accept(M_listening_sec_fd, (struct sockaddr*)&cli_addr, &addr_len);
+/* --------------------------------------------------------------------------
+  queue whatever the connection state needs next
+  the same states as with select / epoll, only I/O is done by the kernel
+-------------------------------------------------------------------------- */
+static void uring_arm(int ci)
+{
+    char    *body;
+
+    if ( conn[ci].conn_state == CONN_STATE_DISCONNECTED
+            || conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC     /* woken up by response */
+            || conn[ci].uring_pending )
+        return;
 
-    if (connection < 0)
+#ifdef HTTPS
+    if ( conn[ci].secure )
     {
-        ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
+        if ( conn[ci].ssl_err == SSL_ERROR_WANT_WRITE )
+            uring_poll(ci, POLLOUT);
+        else if ( conn[ci].ssl_err == SSL_ERROR_WANT_READ )
+            uring_poll(ci, POLLIN);
+        else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER
+                || conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY
+                || conn[ci].conn_state == CONN_STATE_SENDING_BODY )
+            uring_poll(ci, POLLOUT);
+        else
+            uring_poll(ci, POLLIN);
         return;
     }
-
-    /* get the remote address */
-#ifdef _WIN32   /* Windows */
-    strcpy(remote_addr, inet_ntoa(cli_addr.sin_addr));
-#else
-    inet_ntop(AF_INET, &(cli_addr.sin_addr), remote_addr, INET_ADDRSTRLEN);
 #endif
 
-    if ( G_blockedIPList[0] && ip_blocked(remote_addr) )
+    body = resp_body(ci);
+
+    if ( conn[ci].conn_state == CONN_STATE_CONNECTED || conn[ci].conn_state == CONN_STATE_READING_HEADER )
     {
-        ++G_cnts_today.blocked;
-#ifdef _WIN32   /* Windows */
-        closesocket(connection);
-#else
-        close(connection);
-#endif  /* _WIN32 */
-        return;
+        uring_io(ci, URING_RECV, conn[ci].in+conn[ci].in_len, IN_BUFSIZE-1-conn[ci].in_len, 0);
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READING_DATA )
+    {
+        uring_io(ci, URING_RECV, conn[ci].data+conn[ci].was_read, conn[ci].clen-conn[ci].was_read, 0);
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER )
+    {
+        /* header and body go together in one sendmsg */
+        conn[ci].uring_iov[0].iov_base = conn[ci].header;
+        conn[ci].uring_iov[0].iov_len = strlen(conn[ci].header);
+        conn[ci].uring_iov[1].iov_base = body;
+        conn[ci].uring_iov[1].iov_len = conn[ci].clen;
+        memset(&conn[ci].uring_msg, 0, sizeof(struct msghdr));
+        conn[ci].uring_msg.msg_iov = conn[ci].uring_iov;
+        conn[ci].uring_msg.msg_iovlen = conn[ci].clen > 0 ? 2 : 1;
+        uring_io(ci, URING_SEND_HEADER, &conn[ci].uring_msg, 1, MSG_WAITALL);
+    }
+    else if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY || conn[ci].conn_state == CONN_STATE_SENDING_BODY )
+    {
+        uring_io(ci, URING_SEND_BODY, body+conn[ci].data_sent, conn[ci].clen-conn[ci].data_sent, MSG_WAITALL);
     }
+}
+
+
+/* --------------------------------------------------------------------------
+  take the oldest completion off the queue and handle it
+-------------------------------------------------------------------------- */
+static void uring_complete()
+{
+    unsigned    head;
+    __u64       user_data;
+    int         res;
+    unsigned    flags;
+    int         op;
+    int         ci;
+static THREAD_LOCAL struct sockaddr_in cli_addr;
+    socklen_t   addr_len;
 
-    setnonblocking(connection);
+    head = *M_ring.cq_head;
+    user_data = M_ring.cqes[head & *M_ring.cq_mask].user_data;
+    res = M_ring.cqes[head & *M_ring.cq_mask].res;
+    flags = M_ring.cqes[head & *M_ring.cq_mask].flags;
+    __atomic_store_n(M_ring.cq_head, head+1, __ATOMIC_RELEASE);
 
-    /* find a free slot in conn */
+    op = (user_data >> 24) & 0xff;
+    ci = user_data & 0xffffff;
 
-    for (i=0; (i<MAX_CONNECTIONS) && (connection != -1); ++i)
+    if ( op == URING_ACCEPT || op == URING_ACCEPT_SEC )
     {
-        if ( conn[i].conn_state == CONN_STATE_DISCONNECTED )    /* free connection slot -- we'll use it */
+        if ( res == -EINVAL && (user_data & 1) )     /* no multishot in this kernel */
         {
-            DBG("\nSecure connection accepted: %s, slot=%d, fd=%d", remote_addr, i, connection);
-            conn[i].fd = connection;
-            conn[i].secure = TRUE;
-
-            conn[i].ssl = SSL_new(M_ssl_ctx);
-
-            if ( !conn[i].ssl )
+            if ( !M_uring_single_accept )
             {
-                ERR("SSL_new failed");
-                close_conn(i);
-                break;
+                WAR("Multishot accept not supported, using single-shot");
+                M_uring_single_accept = TRUE;
             }
+        }
+        else if ( res >= 0 )
+        {
+            ++G_cnts_today.accepts;
+            addr_len = sizeof(cli_addr);
+            getpeername(res, (struct sockaddr*)&cli_addr, &addr_len);
+#ifdef HTTPS
+            if ( op == URING_ACCEPT_SEC )
+                new_conn_https(res, &cli_addr);
+            else
+#endif
+                new_conn_http(res, &cli_addr);
+        }
+        else
+        {
+            ERR("accept failed, errno = %d (%s)", -res, strerror(-res));
+        }
 
-            /* SSL_set_fd() sets the file descriptor fd as the input/output facility
-               for the TLS/SSL (encrypted) side of ssl. fd will typically be the socket
-               file descriptor of a network connection.
-               When performing the operation, a socket BIO is automatically created to
-               interface between the ssl and fd. The BIO and hence the SSL engine inherit
-               the behaviour of fd. If fd is non-blocking, the ssl will also have non-blocking behaviour.
-               If there was already a BIO connected to ssl, BIO_free() will be called
-               (for both the reading and writing side, if different). */
+        if ( !(flags & IORING_CQE_F_MORE) )
+            uring_listen(op);
 
-            ret = SSL_set_fd(conn[i].ssl, connection);
+        return;
+    }
+    else if ( op == URING_ASYNC_RES )
+    {
+        /* the queue is read in the main loop */
+        if ( !(flags & IORING_CQE_F_MORE) )
+            uring_listen(op);
+        return;
+    }
+    else if ( op == URING_CANCEL )
+    {
+        return;
+    }
 
-            if ( ret <= 0 )
-            {
-                ERR("SSL_set_fd failed, ret = %d", ret);
-                close_conn(i);
-                return;
-            }
+    /* connection */
 
-            ret = SSL_accept(conn[i].ssl);  /* handshake here */
+    if ( (unsigned)(user_data >> 32) != conn[ci].uring_gen )
+        return;     /* closed in the meantime */
 
-            if ( ret <= 0 )
-            {
-                conn[i].ssl_err = SSL_get_error(conn[i].ssl, ret);
+    --conn[ci].uring_pending;
 
-                if ( conn[i].ssl_err != SSL_ERROR_WANT_READ && conn[i].ssl_err != SSL_ERROR_WANT_WRITE )
-                {
-                    ERR("SSL_accept failed, ssl_err = %d", conn[i].ssl_err);
-                    close_conn(i);
-                    return;
-                }
-            }
+    if ( op == URING_POLL )
+    {
+        if ( res < 0 )
+            close_conn(ci);
+        else
+            handle_conn(ci, res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR), res & (POLLOUT | POLLHUP | POLLERR));
+        return;
+    }
+
+    if ( res < 0 )
+        errno = -res;   /* for set_state's log */
 
-            strcpy(conn[i].ip, remote_addr);        /* possibly client IP */
-            strcpy(conn[i].pip, remote_addr);       /* possibly proxy IP */
-            conn[i].conn_state = CONN_STATE_ACCEPTING;
-            conn[i].last_activity = G_now;
-            connection = -1;                        /* mark as OK */
+    if ( op == URING_RECV )
+    {
+        if ( res > 0 )
+        {
+            if ( conn[ci].conn_state == CONN_STATE_CONNECTED || conn[ci].conn_state == CONN_STATE_READING_HEADER )
+            {
+                conn[ci].in_len += res;
+                conn[ci].in[conn[ci].in_len] = EOS;
+            }
+            else
+                conn[ci].was_read += res;
         }
     }
-
-    if (connection != -1)   /* none was free */
+    else if ( op == URING_SEND_BODY )
     {
-        /* No room left in the queue! */
-        WAR("No room left for new client, closing");
-#ifdef _WIN32   /* Windows */
-        closesocket(connection);
-#else
-        close(connection);
-#endif  /* _WIN32 */
+        if ( res > 0 )
+            conn[ci].data_sent += res;
     }
-#endif
+
+    if ( res < 0 )
+        errno = -res;   /* for set_state */
+
+    if ( op == URING_SEND_HEADER )
+        set_state_hdr(ci, res);
+    else
+        set_state(ci, res);     /* the same transitions as after read() / write() */
+
+    process_conn(ci);
+
+    uring_arm(ci);
 }
 
 
 /* --------------------------------------------------------------------------
-   Read list of blocked IPs from the file
+  cancel everything in flight for the connection
+  submitted straight away, before the fd is closed
 -------------------------------------------------------------------------- */
-static bool read_blocked_ips()
+static void uring_cancel(int ci)
 {
-    char    fname[256];
-    FILE    *h_file=NULL;
-    int     c=0;
-    int     i=0;
-    char    now_value=1;
-    char    now_comment=0;
-    char    value[64]="";
+    struct io_uring_sqe *sqe;
 
-    INF("Updating blocked IPs list");
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = conn[ci].fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = (__u64)URING_CANCEL << 24;
 
-    /* open the file */
+    uring_enter(0, 0);
+}
 
-    if ( G_blockedIPList[0] == '/' )    /* full path */
-        strcpy(fname, G_blockedIPList);
-    else    /* just a file name */
-        sprintf(fname, "%s/bin/%s", G_appdir, G_blockedIPList);
+#elif defined(EPOLL)
+/* --------------------------------------------------------------------------
+  add fd to the epoll set (level-triggered, read only)
+  used for listening sockets and async response queue
+-------------------------------------------------------------------------- */
+static bool epoll_add_fd(int fd, unsigned id)
+{
+    struct epoll_event ev;
 
-    if ( NULL == (h_file=fopen(fname, "r")) )
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.u32 = id;
+
+    if ( epoll_ctl(M_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0 )
     {
-        ERR("Error opening %s\n", fname);
+        ERR("epoll_ctl(ADD) failed for fd=%d, errno = %d (%s)", fd, errno, strerror(errno));
         return FALSE;
     }
 
-    G_blacklist_cnt = 0;
+    return TRUE;
+}
 
-    /* parse the file */
 
-    while ( EOF != (c=fgetc(h_file)) )
-    {
-        if ( c == ' ' || c == ' ' || c == '\r' ) continue;  /* omit whitespaces */
+/* --------------------------------------------------------------------------
+  events we want to wake up for, according to connection state
+-------------------------------------------------------------------------- */
+static unsigned epoll_events(int ci)
+{
+    unsigned events = EPOLLET | EPOLLRDHUP;
 
-        if ( c == '\n' )    /* end of value or end of comment or empty line */
-        {
-            if ( now_value && i )   /* end of value */
-            {
-                value[i] = EOS;
-                if ( !ip_blocked(value) )   /* avoid duplicates */
-                {
-                    strcpy(G_blacklist[G_blacklist_cnt++], value);
-                    if ( G_blacklist_cnt == MAX_BLACKLIST )
-                    {
-                        WAR("Blacklist full! (%d IPs)", G_blacklist_cnt);
-                        now_value = 0;
-                        break;
-                    }
-                }
-                i = 0;
-            }
-            now_value = 1;
-            now_comment = 0;
-        }
-        else if ( now_comment )
-        {
-            continue;
-        }
-        else if ( c == '#' )    /* possible end of value */
-        {
-            if ( now_value && i )   /* end of value */
-            {
-                value[i] = EOS;
-                strcpy(G_blacklist[G_blacklist_cnt++], value);
-                if ( G_blacklist_cnt == MAX_BLACKLIST )
-                {
-                    WAR("Blacklist full! (%d IPs)", G_blacklist_cnt);
-                    now_value = 0;
-                    break;
-                }
-                i = 0;
-            }
-            now_value = 0;
-            now_comment = 1;
-        }
-        else if ( now_value )   /* value */
-        {
-            if ( i < INET_ADDRSTRLEN-1 )
-                value[i++] = c;
-        }
-    }
+    if ( conn[ci].conn_state == CONN_STATE_READY_TO_SEND_HEADER
+            || conn[ci].conn_state == CONN_STATE_READY_TO_SEND_BODY
+            || conn[ci].conn_state == CONN_STATE_SENDING_BODY
+            || conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+        events |= EPOLLOUT;
+    else
+        events |= EPOLLIN;
 
-    if ( now_value && i )   /* end of value */
+#ifdef HTTPS
+    if ( conn[ci].secure )
     {
-        value[i] = EOS;
-        strcpy(G_blacklist[G_blacklist_cnt++], value);
-    }
-
-    if ( NULL != h_file )
-        fclose(h_file);
-
-    ALWAYS("%d IPs blacklisted", G_blacklist_cnt);
+        if ( conn[ci].conn_state == CONN_STATE_ACCEPTING )
+            events |= EPOLLIN | EPOLLOUT;
 
-    /* show the list */
-
-/*  DBG("");
-    for ( i=0; i<G_blacklist_cnt; ++i )
-        DBG("%s", G_blacklist[i]);
-    DBG("");*/
+        if ( conn[ci].ssl_err == SSL_ERROR_WANT_WRITE )
+            events |= EPOLLOUT;
+        else if ( conn[ci].ssl_err == SSL_ERROR_WANT_READ )
+            events |= EPOLLIN;
+    }
+#endif
 
-    return TRUE;
+    return events;
 }
 
 
 /* --------------------------------------------------------------------------
-   Return TRUE if addr is on our blacklist
+  set events we want to wake up for
+  edge-triggered, so it has to be called every time they change
 -------------------------------------------------------------------------- */
-static bool ip_blocked(const char *addr)
+static void set_epoll_events(int ci, int op)
 {
-    int i;
+    struct epoll_event ev;
 
-    for ( i=0; i<G_blacklist_cnt; ++i )
-    {
-        if ( 0==strcmp(G_blacklist[i], addr) )
-            return TRUE;
-    }
+    ev.events = epoll_events(ci);
+    ev.data.u64 = 0;
+    ev.data.u32 = ci;
 
-    return FALSE;
+    if ( epoll_ctl(M_epollfd, op, conn[ci].fd, &ev) < 0 )
+        ERR("epoll_ctl(%s) failed for ci=%d, fd=%d, errno = %d (%s)", op==EPOLL_CTL_ADD?"ADD":"MOD", ci, conn[ci].fd, errno, strerror(errno));
 }
 
+#else   /* select */
 
 /* --------------------------------------------------------------------------
-  read static resources from disk
-  read all the files from G_appdir/res directory
+  build select list
 -------------------------------------------------------------------------- */
-static bool read_files(bool minify)
+static void build_select_list()
 {
-    int     i=0;
-    char    resdir[256]="";
-    DIR     *dir;
-struct dirent *dirent;
-    char    namewpath[256]="";
-    FILE    *fd;
-    char    *data_tmp=NULL;
-    char    *data_tmp_min=NULL;
-struct stat fstat;
-    char    mod_time[32];
+    int i, j;
 
-    DBG("read_files, minify = %s\n", minify?"TRUE":"FALSE");
+    FD_ZERO(&M_readfds);
+    FD_ZERO(&M_writefds);
 
-    if ( minify )
-        sprintf(resdir, "%s/resmin", G_appdir);
-    else
-        sprintf(resdir, "%s/res", G_appdir);
+    FD_SET(M_listening_fd, &M_readfds);
+#ifdef HTTPS
+    FD_SET(M_listening_sec_fd, &M_readfds);
+#endif
 
-    if ( (dir=opendir(resdir)) == NULL )
+    for ( j=0; j<G_open_conn; ++j )
     {
-        /* we may be in src, so try one level up */
+        i = M_active_ci[j];
 
-        if ( 0==strcmp(G_appdir, ".") )     /* no SILGYDIR explicitly defined */
-        {
-            if ( minify )
-                strcpy(resdir, "../resmin");
-            else
-                strcpy(resdir, "../res");
+        FD_SET(conn[i].fd, &M_readfds);
 
-            if ( (dir=opendir(resdir)) == NULL )
-                return TRUE;    /* don't panic, just no external resources will be used */
-            else
-                strcpy(G_appdir, "..");     /* change G_appdir */
+        /* only for certain states */
+
+#ifdef HTTPS
+        if ( conn[i].secure )
+        {
+            if ( conn[i].conn_state == CONN_STATE_READY_TO_SEND_HEADER
+                    || conn[i].conn_state == CONN_STATE_READY_TO_SEND_BODY
+                    || conn[i].conn_state == CONN_STATE_SENDING_BODY
+                    || conn[i].ssl_err == SSL_ERROR_WANT_WRITE )
+            {
+                FD_SET(conn[i].fd, &M_writefds);
+            }
         }
         else
         {
-            WAR("Couldn't open directory %s", resdir);
-            return TRUE;    /* don't panic, just no external resources will be used */
+#endif
+            if ( conn[i].conn_state != CONN_STATE_CONNECTED
+                    && conn[i].conn_state != CONN_STATE_READING_HEADER
+                    && conn[i].conn_state != CONN_STATE_READING_DATA )
+                FD_SET(conn[i].fd, &M_writefds);
+#ifdef HTTPS
         }
-    }
-
-#ifdef _DIRENT_HAVE_D_TYPE
-    INF("_DIRENT_HAVE_D_TYPE is defined");  /* we could use d_type in the future? */
 #endif
+        if (conn[i].fd > M_highsock)
+            M_highsock = conn[i].fd;
+    }
+}
+#endif  /* EPOLL */
 
-    /* find the first unused slot in M_stat array */
 
-    i = first_free_stat();
+/* --------------------------------------------------------------------------
+   Set up free slots list and empty active list for our part of conn
+-------------------------------------------------------------------------- */
+static void init_conn_slots()
+{
+    int i;
 
-    /* read the files into memory */
+    M_free_cnt = 0;
 
-    while ( (dirent=readdir(dir)) )
+    for ( i=M_last_ci-1; i>=M_first_ci; --i )   /* lowest on top */
     {
-        if ( dirent->d_name[0] == '.' ) /* skip ".", ".." and hidden files */
-            continue;
+        M_free_ci[M_free_cnt++] = i;
+        M_active_pos[i] = -1;
+    }
 
-        strcpy(M_stat[i].name, dirent->d_name);
+    G_open_conn = 0;
+}
 
-        if ( minify )
-            sprintf(namewpath, "%s/resmin/%s", G_appdir, M_stat[i].name);
-        else
-            sprintf(namewpath, "%s/res/%s", G_appdir, M_stat[i].name);
 
-#ifdef _WIN32   /* Windows */
-        if ( NULL == (fd=fopen(namewpath, "rb")) )
-#else
-        if ( NULL == (fd=fopen(namewpath, "r")) )
-#endif  /* _WIN32 */
-            ERR("Couldn't open %s", namewpath);
-        else
-        {
-            fseek(fd, 0, SEEK_END);     /* determine the file size */
-            M_stat[i].len = ftell(fd);
-            rewind(fd);
+/* --------------------------------------------------------------------------
+   Take a free conn slot and add it to the active list
+   return -1 if none left
+-------------------------------------------------------------------------- */
+static int get_free_conn()
+{
+    int ci;
 
-            if ( minify )
-            {
-                /* we don't know the minified size yet -- read file into temp buffer */
-
-                if ( NULL == (data_tmp=(char*)malloc(M_stat[i].len+1)) )
-                {
-                    ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len, M_stat[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
+    if ( M_free_cnt == 0 ) return -1;
 
-                if ( NULL == (data_tmp_min=(char*)malloc(M_stat[i].len+1)) )
-                {
-                    ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len, M_stat[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
+    ci = M_free_ci[--M_free_cnt];
 
-                fread(data_tmp, M_stat[i].len, 1, fd);
-                *(data_tmp+M_stat[i].len) = EOS;
+    M_active_pos[ci] = G_open_conn;
+    M_active_ci[G_open_conn++] = ci;
 
-                M_stat[i].len = silgy_minify(data_tmp_min, data_tmp);  /* new length */
-            }
+    return ci;
+}
 
-            /* allocate the final destination */
 
-            if ( NULL == (M_stat[i].data=(char*)malloc(M_stat[i].len+1)) )
-            {
-                ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len+1, M_stat[i].name);
-                fclose(fd);
-                closedir(dir);
-                return FALSE;
-            }
+/* --------------------------------------------------------------------------
+   Give conn slot back
+   the last active one takes its place in the list
+-------------------------------------------------------------------------- */
+static void release_conn(int ci)
+{
+    int pos=M_active_pos[ci];
 
-            if ( minify )
-            {
-                memcpy(M_stat[i].data, data_tmp_min, M_stat[i].len+1);
-                free(data_tmp);
-                free(data_tmp_min);
-                data_tmp = NULL;
-                data_tmp_min = NULL;
-            }
-            else
-            {
-                fread(M_stat[i].data, M_stat[i].len, 1, fd);
-            }
+    if ( pos == -1 ) return;    /* already released */
 
-            fclose(fd);
+    M_active_ci[pos] = M_active_ci[--G_open_conn];
+    M_active_pos[M_active_ci[pos]] = pos;
+    M_active_pos[ci] = -1;
 
-            M_stat[i].type = get_res_type(M_stat[i].name);
+    M_free_ci[M_free_cnt++] = ci;
+}
 
-            /* last modified */
 
-            if ( stat(namewpath, &fstat) == 0 )
-                M_stat[i].modified = fstat.st_mtime;
-            else
-            {
-                ERR("stat failed, errno = %d (%s)", errno, strerror(errno));
-                return FALSE;
-            }
+#ifndef IOURING   /* io_uring accepts by itself */
+/* --------------------------------------------------------------------------
+   Handle a brand new connection
+   we've got fd and IP here for conn array
+-------------------------------------------------------------------------- */
+static void accept_http()
+{
+    int     connection; /* socket file descriptor for incoming connections */
+static THREAD_LOCAL struct sockaddr_in cli_addr;    /* static = initialised to zeros */
+    socklen_t   addr_len;
+    int     accepted=0;
 
-            G_ptm = gmtime(&M_stat[i].modified);
-            sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
-            ALWAYS("%s %s\t\t%ld Bytes", lib_add_spaces(M_stat[i].name, 28), mod_time, M_stat[i].len);
-        }
+    /* We have new connections coming in! We'll take up to acceptBatch of them
+       and try to find a spot for each in conn_sockets.  */
 
-//      if ( minify )   /* temporarily */
-//      {
-//          DBG("minified %s: [%s]", M_stat[i].name, M_stat[i].data);
-//      }
+    while ( accepted < G_acceptBatch )
+    {
+        addr_len = sizeof(cli_addr);
 
-        ++i;
+        /* connection is a fd that accept gives us that we'll be communicating through now with the remote client */
+        /* this fd will become our conn id for the whole connection's life (that is, until one of the sides close()-s) */
+#ifdef __linux__
+        connection = accept4(M_listening_fd, (struct sockaddr*)&cli_addr, &addr_len, SOCK_NONBLOCK);
+#else
+        connection = accept(M_listening_fd, (struct sockaddr*)&cli_addr, &addr_len);
+#endif
+        if (connection < 0)
+        {
+#ifdef _WIN32   /* Windows */
+            if ( WSAGetLastError() != WSAEWOULDBLOCK )
+                ERR("accept failed, error code = %d", WSAGetLastError());
+#else
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )  /* otherwise nothing more waiting */
+                ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
+#endif
+            break;
+        }
+#ifndef __linux__
+        setnonblocking(connection);
+#endif
+        ++accepted;
+        new_conn_http(connection, &cli_addr);
     }
 
-    closedir(dir);
-
-    strcpy(M_stat[i].name, "-");    /* end of list */
-
-    G_ptm = gmtime(&G_now);     /* set it back */
-
-    DBG("");
-
-    return TRUE;
+    G_cnts_today.accepts += accepted;
 }
+#endif  /* IOURING */
 
 
 /* --------------------------------------------------------------------------
-  find first free slot in M_stat
+   Find a slot in conn for the accepted connection
 -------------------------------------------------------------------------- */
-static int first_free_stat()
+static void new_conn_http(int connection, struct sockaddr_in *cli_addr)
 {
-    int i=0;
+    int     i;          /* current item in conn_sockets for for loops */
+    char    remote_addr[INET_ADDRSTRLEN]="";    /* remote address */
+    long    bytes;
 
-    for ( i=0; i<MAX_STATICS; ++i )
-        if ( 0==strcmp(M_stat[i].name, "-") )
-            return i;
+    /* get the remote address */
+#ifdef _WIN32   /* Windows */
+    strcpy(remote_addr, inet_ntoa(cli_addr->sin_addr));
+#else
+    inet_ntop(AF_INET, &(cli_addr->sin_addr), remote_addr, INET_ADDRSTRLEN);
+#endif
+
+    if ( G_blockedIPList[0] && ip_blocked(remote_addr) )
+    {
+        ++G_cnts_today.blocked;
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+        return;
+    }
 
-    ERR("Big trouble, ran out of statics! i = %d", i);
+    /* take a free slot in conn */
 
-    return -1;  /* nothing's free, we ran out of statics! */
+    if ( (i=get_free_conn()) != -1 )
+    {
+        DBG("\nConnection accepted: %s, slot=%d, fd=%d", remote_addr, i, connection);
+        conn[i].fd = connection;
+        conn[i].secure = FALSE;
+        strcpy(conn[i].ip, remote_addr);        /* possibly client IP */
+        strcpy(conn[i].pip, remote_addr);       /* possibly proxy IP */
+        conn[i].conn_state = CONN_STATE_CONNECTED;
+        conn[i].last_activity = G_now;
+        timer_set(TIMER_CONN+i, G_now+CONN_TIMEOUT+1);
+#ifdef IOURING
+        uring_arm(i);
+#elif defined(EPOLL)
+        set_epoll_events(i, EPOLL_CTL_ADD);
+#endif
+    }
+    else    /* none was free */
+    {
+        /* No room left in the queue! */
+        WAR("No room left for new client, sending 503");
+#ifdef _WIN32   /* Windows */
+        bytes = send(connection, "HTTP/1.1 503 Service Unavailable\r\n\r\n", 36, 0);
+#else
+        bytes = write(connection, "HTTP/1.1 503 Service Unavailable\r\n\r\n", 36);
+#endif  /* _WIN32 */
+        if ( bytes < 36 )
+            ERR("write error, bytes = %d of 36", bytes);
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+    }
 }
 
 
+#ifndef IOURING
 /* --------------------------------------------------------------------------
-   Return M_stat array index if name is on statics' list
+   Handle a brand new connection
+   we've got fd and IP here for conn array
 -------------------------------------------------------------------------- */
-static int is_static_res(int ci, const char *name)
+static void accept_https()
 {
-    int i;
+#ifdef HTTPS
+    int     connection; /* socket file descriptor for incoming connections */
+static THREAD_LOCAL struct sockaddr_in cli_addr;    /* static = initialised to zeros */
+    socklen_t   addr_len;
+    int     accepted=0;
 
-    for ( i=0; M_stat[i].name[0] != '-'; ++i )
+    /* We have new connections coming in! We'll take up to acceptBatch of them
+       and try to find a spot for each in conn_sockets.  */
+
+    while ( accepted < G_acceptBatch )
     {
-        if ( 0==strcmp(M_stat[i].name, name) )
+        addr_len = sizeof(cli_addr);
+
+        /* connection is a fd that accept gives us that we'll be communicating through now with the remote client */
+        /* this fd will become our conn id for the whole connection's life (that is, until one of the sides close()-s) */
+#ifdef __linux__
+        connection = accept4(M_listening_sec_fd, (struct sockaddr*)&cli_addr, &addr_len, SOCK_NONBLOCK);
+#else
+        connection = accept(M_listening_sec_fd, (struct sockaddr*)&cli_addr, &addr_len);
+#endif
+        if (connection < 0)
         {
-//          DBG("It is static");
-            if ( conn[ci].if_mod_since >= M_stat[i].modified )
-            {
-//              DBG("Not Modified");
-                conn[ci].status = 304;  /* Not Modified */
-            }
-            return i;
+#ifdef _WIN32   /* Windows */
+            if ( WSAGetLastError() != WSAEWOULDBLOCK )
+                ERR("accept failed, error code = %d", WSAGetLastError());
+#else
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )  /* otherwise nothing more waiting */
+                ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
+#endif
+            break;
         }
+#ifndef __linux__
+        setnonblocking(connection);
+#endif
+        ++accepted;
+        new_conn_https(connection, &cli_addr);
     }
 
-    return -1;
+    G_cnts_today.accepts += accepted;
+#endif
 }
+#endif  /* IOURING */
 
 
+#ifdef HTTPS
 /* --------------------------------------------------------------------------
-   Open database connection
+   Find a slot in conn for the accepted secure connection
+   and start SSL handshake
 -------------------------------------------------------------------------- */
-static bool open_db()
+static void new_conn_https(int connection, struct sockaddr_in *cli_addr)
 {
-#ifdef DBMYSQL
-    if ( NULL == (G_dbconn=mysql_init(NULL)) )
-    {
-        ERR("Error %u: %s", mysql_errno(G_dbconn), mysql_error(G_dbconn));
-        return FALSE;
-    }
+    int     i;          /* current item in conn_sockets for for loops */
+    char    remote_addr[INET_ADDRSTRLEN]="";    /* remote address */
+    int     ret;
 
-#ifdef DBMYSQLRECONNECT
-    my_bool reconnect=1;
-    mysql_options(G_dbconn, MYSQL_OPT_RECONNECT, &reconnect);
+    /* get the remote address */
+#ifdef _WIN32   /* Windows */
+    strcpy(remote_addr, inet_ntoa(cli_addr->sin_addr));
+#else
+    inet_ntop(AF_INET, &(cli_addr->sin_addr), remote_addr, INET_ADDRSTRLEN);
 #endif
 
-//    unsigned long max_packet=33554432;  /* 32 MB */
-//    mysql_options(G_dbconn, MYSQL_OPT_MAX_ALLOWED_PACKET, &max_packet);
-
-    if ( NULL == mysql_real_connect(G_dbconn, G_dbHost[0]?G_dbHost:NULL, G_dbUser, G_dbPassword, G_dbName, G_dbPort, NULL, 0) )
+    if ( G_blockedIPList[0] && ip_blocked(remote_addr) )
     {
-        ERR("Error %u: %s", mysql_errno(G_dbconn), mysql_error(G_dbconn));
-        return FALSE;
+        ++G_cnts_today.blocked;
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+        return;
     }
-#endif
-    return TRUE;
-}
 
+    /* take a free slot in conn */
 
-/* --------------------------------------------------------------------------
-   Main new request processing
-   Request received over current conn is already parsed
--------------------------------------------------------------------------- */
-static void process_req(int ci)
-{
-    int     ret=OK;
-
-    DBG("process_req, ci=%d", ci);
+    if ( (i=get_free_conn()) != -1 )
+    {
+        DBG("\nSecure connection accepted: %s, slot=%d, fd=%d", remote_addr, i, connection);
+        conn[i].fd = connection;
+        conn[i].secure = TRUE;
 
-    conn[ci].p_curr_c = conn[ci].out_data;
+        conn[i].ssl = SSL_new(M_ssl_ctx);
 
-    conn[ci].location[COLON_POSITION] = '-';    /* no protocol here yet */
+        if ( !conn[i].ssl )
+        {
+            ERR("SSL_new failed");
+            close_conn(i);
+            return;
+        }
 
-    /* ------------------------------------------------------------------------ */
-    /* Generate HTML content before header -- to know its size & type --------- */
+        /* SSL_set_fd() sets the file descriptor fd as the input/output facility
+           for the TLS/SSL (encrypted) side of ssl. fd will typically be the socket
+           file descriptor of a network connection.
+           When performing the operation, a socket BIO is automatically created to
+           interface between the ssl and fd. The BIO and hence the SSL engine inherit
+           the behaviour of fd. If fd is non-blocking, the ssl will also have non-blocking behaviour.
+           If there was already a BIO connected to ssl, BIO_free() will be called
+           (for both the reading and writing side, if different). */
 
-    /* ------------------------------------------------------------------------ */
-    /* authorization check / log in from cookies ------------------------------ */
+        ret = SSL_set_fd(conn[i].ssl, connection);
 
-    if ( conn[ci].static_res == NOT_STATIC && conn[ci].status == 200 )
-    {
-#ifdef USERS
-        if ( conn[ci].cookie_in_l[0] )  /* logged in sesid cookie present */
+        if ( ret <= 0 )
         {
-            ret = libusr_l_usession_ok(ci);     /* is it valid? */
-
-            if ( ret == OK )    /* valid sesid -- user logged in */
-                DBG("User logged in from cookie");
-            else if ( ret != ERR_INT_SERVER_ERROR && ret != ERR_SERVER_TOOBUSY )    /* dodged sesid... or session expired */
-                WAR("Invalid ls cookie");
+            ERR("SSL_set_fd failed, ret = %d", ret);
+            close_conn(i);
+            return;
         }
 
-        if ( conn[ci].auth_level==AUTH_LEVEL_ADMIN && !ADMIN )  /* return not found */
-        {
-            INF("AUTH_LEVEL_ADMIN required, returning 404");
-            ret = ERR_NOT_FOUND;
-            RES_DONT_CACHE;
-        }
-        else if ( conn[ci].auth_level==AUTH_LEVEL_LOGGEDIN && !LOGGED )    /* redirect to login page */
-        {
-            INF("AUTH_LEVEL_LOGGEDIN required, redirecting to login");
-            ret = ERR_REDIRECTION;
-            if ( !strlen(APP_LOGIN_URI) )   /* login page = landing page */
-                sprintf(conn[ci].location, "%s://%s", PROTOCOL, conn[ci].host);
-            else
-                strcpy(conn[ci].location, APP_LOGIN_URI);
-        }
-        else    /* login not required for this URI */
-        {
-            ret = OK;
-        }
+        ret = SSL_accept(conn[i].ssl);  /* handshake here */
 
-        if ( conn[ci].auth_level==AUTH_LEVEL_ANONYMOUS && !REQ_BOT && !conn[ci].head_only && !LOGGED )    /* anonymous user session required */
-#else
-        if ( conn[ci].auth_level==AUTH_LEVEL_ANONYMOUS && !REQ_BOT && !conn[ci].head_only )
-#endif
+        if ( ret <= 0 )
         {
-            if ( !conn[ci].cookie_in_a[0] || !a_usession_ok(ci) )       /* valid anonymous sesid cookie not present */
+            conn[i].ssl_err = SSL_get_error(conn[i].ssl, ret);
+
+            if ( conn[i].ssl_err != SSL_ERROR_WANT_READ && conn[i].ssl_err != SSL_ERROR_WANT_WRITE )
             {
-                if ( !eng_uses_start(ci) )  /* start new anonymous user session */
-                    ret = ERR_SERVER_TOOBUSY;   /* user sessions exhausted */
+                ERR("SSL_accept failed, ssl_err = %d", conn[i].ssl_err);
+                close_conn(i);
+                return;
             }
         }
 
-        /* ------------------------------------------------------------------------ */
-        /* process request -------------------------------------------------------- */
+        strcpy(conn[i].ip, remote_addr);        /* possibly client IP */
+        strcpy(conn[i].pip, remote_addr);       /* possibly proxy IP */
+        conn[i].conn_state = CONN_STATE_ACCEPTING;
+        conn[i].last_activity = G_now;
+        timer_set(TIMER_CONN+i, G_now+CONN_TIMEOUT+1);
+#ifdef IOURING
+        uring_arm(i);
+#elif defined(EPOLL)
+        set_epoll_events(i, EPOLL_CTL_ADD);
+#endif
+    }
+    else    /* none was free */
+    {
+        /* No room left in the queue! */
+        WAR("No room left for new client, closing");
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+    }
+}
+#endif  /* HTTPS */
 
-        if ( ret == OK )
-        {
-            if ( !conn[ci].location[0] )
-                ret = app_process_req(ci);  /* main application called here */
-        }
 
-        conn[ci].last_activity = G_now;
-        if ( conn[ci].usi ) US.last_activity = G_now;
+/* --------------------------------------------------------------------------
+   Read list of blocked IPs from the file
+-------------------------------------------------------------------------- */
+static bool read_blocked_ips()
+{
+    char    fname[256];
+    FILE    *h_file=NULL;
+    int     c=0;
+    int     i=0;
+    char    now_value=1;
+    char    now_comment=0;
+    char    value[64]="";
 
-#ifdef ASYNC
-        if ( conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
-        {
-            return;
-        }
-#endif
-        /* ------------------------------------------------------------------------ */
-
-        if ( conn[ci].location[0] || ret == ERR_REDIRECTION )   /* redirection has a priority */
-            conn[ci].status = 303;
-        else if ( ret == ERR_INVALID_REQUEST )
-            conn[ci].status = 400;
-        else if ( ret == ERR_UNAUTHORIZED )
-            conn[ci].status = 401;
-        else if ( ret == ERR_FORBIDDEN )
-            conn[ci].status = 403;
-        else if ( ret == ERR_NOT_FOUND )
-            conn[ci].status = 404;
-        else if ( ret == ERR_INT_SERVER_ERROR )
-            conn[ci].status = 500;
-        else if ( ret == ERR_SERVER_TOOBUSY )
-            conn[ci].status = 503;
+    INF("Updating blocked IPs list");
 
-        if ( ret==ERR_REDIRECTION || ret==ERR_INVALID_REQUEST || ret==ERR_UNAUTHORIZED || ret==ERR_FORBIDDEN || ret==ERR_NOT_FOUND || ret==ERR_INT_SERVER_ERROR || ret==ERR_SERVER_TOOBUSY )
-        {
-            conn[ci].p_curr_c = conn[ci].out_data;      /* reset out buffer pointer as it could have contained something already */
-#ifdef USERS
-            if ( conn[ci].usi && !LOGGED ) close_a_uses(conn[ci].usi);
-#else
-            if ( conn[ci].usi ) close_a_uses(conn[ci].usi);
-#endif
-            gen_page_msg(ci, ret);
-        }
-    }
-}
+    /* open the file */
 
+    if ( G_blockedIPList[0] == '/' )    /* full path */
+        strcpy(fname, G_blockedIPList);
+    else    /* just a file name */
+        sprintf(fname, "%s/bin/%s", G_appdir, G_blockedIPList);
 
-/* --------------------------------------------------------------------------
-   Generate HTTP response header
--------------------------------------------------------------------------- */
-static void gen_response_header(int ci)
-{
-    DBG("gen_response_header, ci=%d", ci);
+    if ( NULL == (h_file=fopen(fname, "r")) )
+    {
+        ERR("Error opening %s\n", fname);
+        return FALSE;
+    }
 
-    conn[ci].p_curr_h = conn[ci].header;
+    G_blacklist_cnt = 0;
 
-    PRINT_HTTP_STATUS(conn[ci].status);
+    /* parse the file */
 
-    if ( conn[ci].status == 301 || conn[ci].status == 303 )     /* redirection */
+    while ( EOF != (c=fgetc(h_file)) )
     {
-        DBG("Redirecting");
-
-        /*
-           1 - upgrade 2 https, keep URI (301)
-           2 - app new page version, ignore URI, use location (303)
-           3 - redirect to final domain, keep URI (301)
-        */
+        if ( c == ' ' || c == ' ' || c == '\r' ) continue;  /* omit whitespaces */
 
-        if ( conn[ci].upgrade2https )   /* (1) */
-        {
-            PRINT_HTTP_VARY_UIR;    /* Upgrade-Insecure-Requests */
-            sprintf(G_tmp, "Location: https://%s/%s\r\n", conn[ci].host, conn[ci].uri);
-        }
-        else if ( conn[ci].location[COLON_POSITION] == ':' )        /* (2) full address already present */
+        if ( c == '\n' )    /* end of value or end of comment or empty line */
         {
-            sprintf(G_tmp, "Location: %s\r\n", conn[ci].location);
+            if ( now_value && i )   /* end of value */
+            {
+                value[i] = EOS;
+                if ( !ip_blocked(value) )   /* avoid duplicates */
+                {
+                    strcpy(G_blacklist[G_blacklist_cnt++], value);
+                    if ( G_blacklist_cnt == MAX_BLACKLIST )
+                    {
+                        WAR("Blacklist full! (%d IPs)", G_blacklist_cnt);
+                        now_value = 0;
+                        break;
+                    }
+                }
+                i = 0;
+            }
+            now_value = 1;
+            now_comment = 0;
         }
-        else if ( conn[ci].location[0] )        /* (2) */
+        else if ( now_comment )
         {
-            sprintf(G_tmp, "Location: %s://%s/%s\r\n", PROTOCOL, conn[ci].host, conn[ci].location);
+            continue;
         }
-        else if ( conn[ci].uri[0] ) /* (3) URI */
+        else if ( c == '#' )    /* possible end of value */
         {
-#ifdef DOMAINONLY
-            sprintf(G_tmp, "Location: %s://%s/%s\r\n", PROTOCOL, G_test?conn[ci].host:APP_DOMAIN, conn[ci].uri);
-#else
-            sprintf(G_tmp, "Location: %s://%s/%s\r\n", PROTOCOL, conn[ci].host, conn[ci].uri);
-#endif
+            if ( now_value && i )   /* end of value */
+            {
+                value[i] = EOS;
+                strcpy(G_blacklist[G_blacklist_cnt++], value);
+                if ( G_blacklist_cnt == MAX_BLACKLIST )
+                {
+                    WAR("Blacklist full! (%d IPs)", G_blacklist_cnt);
+                    now_value = 0;
+                    break;
+                }
+                i = 0;
+            }
+            now_value = 0;
+            now_comment = 1;
         }
-        else    /* (3) No URI */
+        else if ( now_value )   /* value */
         {
-#ifdef DOMAINONLY
-            sprintf(G_tmp, "Location: %s://%s\r\n", PROTOCOL, G_test?conn[ci].host:APP_DOMAIN);
-#else
-            sprintf(G_tmp, "Location: %s://%s\r\n", PROTOCOL, conn[ci].host);
-#endif
+            if ( i < INET_ADDRSTRLEN-1 )
+                value[i++] = c;
         }
-        HOUT(G_tmp);
-
-        conn[ci].clen = 0;
     }
-    else if ( conn[ci].status == 304 )      /* not modified since */
+
+    if ( now_value && i )   /* end of value */
     {
-//        DBG("Not Modified");
+        value[i] = EOS;
+        strcpy(G_blacklist[G_blacklist_cnt++], value);
+    }
 
-        if ( conn[ci].static_res == NOT_STATIC )
-        {
-            PRINT_HTTP_LAST_MODIFIED(G_last_modified);
-        }
-        else    /* static res */
-        {
-            PRINT_HTTP_LAST_MODIFIED(time_epoch2http(M_stat[conn[ci].static_res].modified));
-        }
+    if ( NULL != h_file )
+        fclose(h_file);
 
-        conn[ci].clen = 0;
+    ALWAYS("%d IPs blacklisted", G_blacklist_cnt);
+
+    /* show the list */
+
+/*  DBG("");
+    for ( i=0; i<G_blacklist_cnt; ++i )
+        DBG("%s", G_blacklist[i]);
+    DBG("");*/
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Return TRUE if addr is on our blacklist
+-------------------------------------------------------------------------- */
+static bool ip_blocked(const char *addr)
+{
+    int i;
+
+    for ( i=0; i<G_blacklist_cnt; ++i )
+    {
+        if ( 0==strcmp(G_blacklist[i], addr) )
+            return TRUE;
     }
-    else    /* normal response with content: 2xx, 4xx, 5xx */
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+  read static resources from disk
+  read all the files from G_appdir/res directory
+  files from res of largeStatic size or more are mapped instead
+-------------------------------------------------------------------------- */
+static bool read_files(bool minify)
+{
+    char    resdir[256]="";
+    DIR     *dir;
+
+    DBG("read_files, minify = %s\n", minify?"TRUE":"FALSE");
+
+    if ( minify )
+        sprintf(resdir, "%s/resmin", G_appdir);
+    else
+        sprintf(resdir, "%s/res", G_appdir);
+
+    if ( (dir=opendir(resdir)) == NULL )
     {
-//        DBG("Normal response");
+        /* we may be in src, so try one level up */
 
-        if ( conn[ci].dont_cache )  /* dynamic content */
-        {
-            PRINT_HTTP_VARY_DYN;
-            PRINT_HTTP_NO_CACHE;
-        }
-        else    /* static content */
+        if ( 0==strcmp(G_appdir, ".") )     /* no SILGYDIR explicitly defined */
         {
-            PRINT_HTTP_VARY_STAT;
-
-            if ( conn[ci].static_res == NOT_STATIC )
-            {
-                if ( conn[ci].modified )
-                    PRINT_HTTP_LAST_MODIFIED(time_epoch2http(conn[ci].modified));
-                else
-                    PRINT_HTTP_LAST_MODIFIED(G_last_modified);
+            if ( minify )
+                strcpy(resdir, "../resmin");
+            else
+                strcpy(resdir, "../res");
 
-                PRINT_HTTP_EXPIRES;
-            }
-            else    /* static res */
-            {
-                PRINT_HTTP_LAST_MODIFIED(time_epoch2http(M_stat[conn[ci].static_res].modified));
-            }
+            if ( (dir=opendir(resdir)) == NULL )
+                return TRUE;    /* don't panic, just no external resources will be used */
+            else
+                strcpy(G_appdir, "..");     /* change G_appdir */
         }
-
-        if ( conn[ci].static_res == NOT_STATIC )
-            conn[ci].clen = conn[ci].p_curr_c - conn[ci].out_data;
         else
-            conn[ci].clen = M_stat[conn[ci].static_res].len;
+        {
+            WAR("Couldn't open directory %s", resdir);
+            return TRUE;    /* don't panic, just no external resources will be used */
+        }
     }
 
-    /* Date */
+#ifdef _DIRENT_HAVE_D_TYPE
+    INF("_DIRENT_HAVE_D_TYPE is defined");  /* we could use d_type in the future? */
+#endif
 
-    PRINT_HTTP_DATE;
+    /* read the files into memory */
 
-    /* Connection */
+    read_dir(dir, "", minify);
 
-    PRINT_HTTP_CONNECTION(ci);
+    closedir(dir);
 
-    /* Content-Length */
+    DBG("");
 
-    PRINT_HTTP_CONTENT_LEN(conn[ci].clen);
+    return TRUE;
+}
 
-    /* Cookie */
 
-    if ( conn[ci].static_res == NOT_STATIC && (conn[ci].status == 200 || conn[ci].status == 303) && !conn[ci].head_only )
+/* --------------------------------------------------------------------------
+   Read static resources from directory and its subdirectories
+   path is relative to res or resmin, "" or ending with '/'
+   Names include it, i.e. static/v123/app.js
+-------------------------------------------------------------------------- */
+static void read_dir(DIR *dir, const char *path, bool minify)
+{
+    int     i;
+struct dirent *dirent;
+    char    name[256];
+    char    namewpath[1024];
+struct stat fstat;
+    DIR     *subdir;
+
+    while ( (dirent=readdir(dir)) )
     {
-        if ( conn[ci].cookie_out_l[0] )         /* logged in cookie has been produced */
+        if ( dirent->d_name[0] == '.' ) /* skip ".", ".." and hidden files */
+            continue;
+
+        if ( snprintf(name, sizeof(name)-1, "%s%s", path, dirent->d_name) >= (int)sizeof(name)-1 )  /* leave room for '/' */
         {
-            if ( conn[ci].cookie_out_l_exp[0] )
-            {
-                PRINT_HTTP_COOKIE_L_EXP(ci);    /* with expiration date */
-            }
-            else
-            {
-                PRINT_HTTP_COOKIE_L(ci);
-            }
+            WAR("%s%s name is too long, ignoring", path, dirent->d_name);
+            continue;
         }
 
-        if ( conn[ci].cookie_out_a[0] )         /* anonymous cookie has been produced */
+        if ( minify )
+            sprintf(namewpath, "%s/resmin/%s", G_appdir, name);
+        else
+            sprintf(namewpath, "%s/res/%s", G_appdir, name);
+
+        if ( stat(namewpath, &fstat) == 0 && S_ISDIR(fstat.st_mode) )
         {
-            if ( conn[ci].cookie_out_a_exp[0] )
+            if ( (subdir=opendir(namewpath)) == NULL )
             {
-                PRINT_HTTP_COOKIE_A_EXP(ci);    /* with expiration date */
+                WAR("Couldn't open directory %s", namewpath);
+                continue;
             }
-            else
+
+            strcat(name, "/");
+            read_dir(subdir, name, minify);
+            closedir(subdir);
+            continue;
+        }
+
+        if ( M_stat_cnt >= MAX_STATICS-1 )  /* the last one is for "-" */
+        {
+            ERR("Too many static resources, %s and further ones won't be served", name);
+            return;
+        }
+
+        i = M_stat_cnt;
+
+        strcpy(M_stat[i].name, name);
+
+#ifndef _WIN32
+        if ( !stat_from_bundle(i, namewpath, minify) && !read_stat(i, namewpath, minify) )
+#else
+        if ( !read_stat(i, namewpath, minify) )
+#endif
+        {
+            strcpy(M_stat[i].name, "-");    /* still the end of list */
+            continue;
+        }
+
+        stat_index_add(i);
+
+        M_stat_cnt = i + 1;
+        strcpy(M_stat[M_stat_cnt].name, "-");   /* end of list */
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Is static resource in versioned directory (v + digits)
+   Its content never changes, so it can be cached for good
+-------------------------------------------------------------------------- */
+static bool stat_versioned(const char *name)
+{
+    const char *p=name;
+    const char *d;
+
+    while ( *p )
+    {
+        if ( *p == 'v' && isdigit(*(p+1)) )
+        {
+            for ( d=p+1; isdigit(*d); ++d );
+
+            if ( *d == '/' )
+                return TRUE;
+        }
+
+        /* next path segment */
+
+        while ( *p && *p != '/' ) ++p;
+        if ( *p == '/' ) ++p;
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+  read one static resource into M_stat[i], its name has to be set already
+  minify if it's from resmin, map if it's of largeStatic size or more
+-------------------------------------------------------------------------- */
+static bool read_stat(int i, const char *namewpath, bool minify)
+{
+    FILE    *fd;
+    char    *data_tmp=NULL;
+    char    *data_tmp_min=NULL;
+struct stat fstat;
+    char    mod_time[32];
+
+#ifdef _WIN32   /* Windows */
+    if ( NULL == (fd=fopen(namewpath, "rb")) )
+#else
+    if ( NULL == (fd=fopen(namewpath, "r")) )
+#endif  /* _WIN32 */
+    {
+        ERR("Couldn't open %s", namewpath);
+        return FALSE;
+    }
+
+    fseek(fd, 0, SEEK_END);     /* determine the file size */
+    M_stat[i].len = ftell(fd);
+    rewind(fd);
+
+    if ( minify )
+    {
+        /* we don't know the minified size yet -- read file into temp buffer */
+
+        if ( NULL == (data_tmp=(char*)malloc(M_stat[i].len+1)) )
+        {
+            ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len, M_stat[i].name);
+            fclose(fd);
+            return FALSE;
+        }
+
+        if ( NULL == (data_tmp_min=(char*)malloc(M_stat[i].len+M_stat[i].len/3+2)) )
+        {
+            ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len+M_stat[i].len/3+2, M_stat[i].name);
+            free(data_tmp);
+            fclose(fd);
+            return FALSE;
+        }
+
+        fread(data_tmp, M_stat[i].len, 1, fd);
+        *(data_tmp+M_stat[i].len) = EOS;
+
+        M_stat[i].len = silgy_minify(data_tmp_min, data_tmp);  /* new length */
+    }
+
+    M_stat[i].on_disk = FALSE;
+    M_stat[i].in_bundle = FALSE;
+#ifndef _WIN32
+    if ( !minify && G_largeStatic > 0 && M_stat[i].len >= G_largeStatic )
+    {
+        /* large file -- leave it in page cache, keep fd for sendfile() */
+
+        if ( (M_stat[i].fd=open(namewpath, O_RDONLY)) == -1 )
+            WAR("Couldn't open %s, errno = %d (%s), reading into memory", namewpath, errno, strerror(errno));
+        else if ( (M_stat[i].data=(char*)mmap(NULL, M_stat[i].len, PROT_READ, MAP_SHARED, M_stat[i].fd, 0)) == MAP_FAILED )
+        {
+            WAR("mmap failed for %s, errno = %d (%s), reading into memory", namewpath, errno, strerror(errno));
+            close(M_stat[i].fd);
+        }
+        else
+        {
+            M_stat[i].on_disk = TRUE;
+            M_stat[i].fd_base = M_stat[i].data;
+        }
+    }
+#endif
+    if ( !M_stat[i].on_disk )
+    {
+        /* allocate the final destination */
+
+        if ( NULL == (M_stat[i].data=(char*)malloc(M_stat[i].len+1)) )
+        {
+            ERR("Couldn't allocate %ld bytes for %s!!!", M_stat[i].len+1, M_stat[i].name);
+            if ( minify )
             {
-                PRINT_HTTP_COOKIE_A(ci);
+                free(data_tmp);
+                free(data_tmp_min);
             }
+            fclose(fd);
+            return FALSE;
+        }
+
+        if ( minify )
+        {
+            memcpy(M_stat[i].data, data_tmp_min, M_stat[i].len+1);
+            free(data_tmp);
+            free(data_tmp_min);
+        }
+        else
+        {
+            fread(M_stat[i].data, M_stat[i].len, 1, fd);
+        }
+    }
+
+    fclose(fd);
+
+    M_stat[i].type = get_res_type(M_stat[i].name);
+    M_stat[i].minified = minify;
+
+    /* last modified */
+
+    if ( stat(namewpath, &fstat) == 0 )
+        M_stat[i].modified = fstat.st_mtime;
+    else
+    {
+        ERR("stat failed, errno = %d (%s)", errno, strerror(errno));
+        free_stat(i);
+        return FALSE;
+    }
+
+    stat_set_validators(i);
+#if defined(GZIP) || defined(BROTLI)
+    compress_stat(i);
+#endif
+    stat_set_headers(i);
+    G_ptm = lib_gmtime(&M_stat[i].modified);
+    sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
+    ALWAYS("%s %s\t\t%ld Bytes%s", lib_add_spaces(M_stat[i].name, 28), mod_time, M_stat[i].len, M_stat[i].on_disk?" (on disk)":"");
+
+    G_ptm = lib_gmtime(&G_now);     /* set it back */
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+  release static resource's buffers
+-------------------------------------------------------------------------- */
+static void free_stat(int i)
+{
+    int enc;
+
+    for ( enc=CONTENT_ENC_IDENTITY; enc<=CONTENT_ENC_BR; ++enc )
+    {
+        free(M_stat[i].hdr[enc]);
+        M_stat[i].hdr[enc] = NULL;
+    }
+
+    if ( M_stat[i].in_bundle )  /* nothing else is ours */
+    {
+        M_stat[i].on_disk = FALSE;
+        M_stat[i].data = NULL;
+#ifdef GZIP
+        M_stat[i].data_gz = NULL;
+#endif
+#ifdef BROTLI
+        M_stat[i].data_br = NULL;
+#endif
+        M_stat[i].in_bundle = FALSE;
+        return;
+    }
+
+#ifndef _WIN32
+    if ( M_stat[i].on_disk )
+    {
+        munmap(M_stat[i].data, M_stat[i].len);
+        close(M_stat[i].fd);
+        M_stat[i].on_disk = FALSE;
+    }
+    else
+#endif
+        free(M_stat[i].data);
+
+    M_stat[i].data = NULL;
+#ifdef GZIP
+    free(M_stat[i].data_gz);
+    M_stat[i].data_gz = NULL;
+#endif
+#ifdef BROTLI
+    free(M_stat[i].data_br);
+    M_stat[i].data_br = NULL;
+#endif
+}
+
+
+/* --------------------------------------------------------------------------
+   Copy len bytes of static resource body at src to dest
+   Files on disk are read with pread() rather than from the mapping,
+   which would give SIGBUS if the file has been truncated in the meantime
+   i = NOT_STATIC or not on disk -- plain memcpy
+-------------------------------------------------------------------------- */
+static bool stat_copy(int i, char *dest, const char *src, long len)
+{
+#ifndef _WIN32
+    if ( i != NOT_STATIC && M_stat[i].on_disk )
+    {
+        if ( pread(M_stat[i].fd, dest, len, src - M_stat[i].fd_base) != len )
+        {
+            ERR("Couldn't read %ld bytes of %s, errno = %d (%s) -- has it been written over? Replace static files by renaming", len, M_stat[i].name, errno, strerror(errno));
+            return FALSE;
+        }
+        return TRUE;
+    }
+#endif
+    memcpy(dest, src, len);
+    return TRUE;
+}
+
+
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Map static resources bundle if there is one
+   It's shared by all workers through page cache
+-------------------------------------------------------------------------- */
+static void stat_bundle_open()
+{
+    char    bundle[512];
+struct stat bundle_stat;
+const stat_bundle_hdr_t *hdr;
+
+    sprintf(bundle, "%s/bin/%s", G_appdir, STAT_BUNDLE_FILE);
+
+    if ( (M_bundle_fd=open(bundle, O_RDONLY)) == -1 )
+        return;     /* no bundle, read everything */
+
+    if ( fstat(M_bundle_fd, &bundle_stat) != 0 || bundle_stat.st_size < (off_t)(sizeof(stat_bundle_hdr_t) + MAX_STATICS * sizeof(stat_bundle_entry_t)) )
+    {
+        WAR("%s is invalid, ignoring", bundle);
+        close(M_bundle_fd);
+        M_bundle_fd = -1;
+        return;
+    }
+
+    M_bundle_len = bundle_stat.st_size;
+
+    if ( (M_bundle=(char*)mmap(NULL, M_bundle_len, PROT_READ, MAP_SHARED, M_bundle_fd, 0)) == MAP_FAILED )
+    {
+        WAR("mmap failed for %s, errno = %d (%s), ignoring", bundle, errno, strerror(errno));
+        M_bundle = NULL;
+        close(M_bundle_fd);
+        M_bundle_fd = -1;
+        return;
+    }
+
+    hdr = (const stat_bundle_hdr_t*)M_bundle;
+
+    if ( memcmp(hdr->magic, STAT_BUNDLE_MAGIC, 8) != 0 || hdr->cnt < 0 || hdr->cnt > MAX_STATICS )
+    {
+        WAR("%s is invalid, ignoring", bundle);
+        munmap(M_bundle, M_bundle_len);
+        M_bundle = NULL;
+        close(M_bundle_fd);
+        M_bundle_fd = -1;
+        return;
+    }
+
+#ifdef GZIP
+    if ( !hdr->gzip )
+        M_bundle_uncompressed = TRUE;
+#endif
+#ifdef BROTLI
+    if ( !hdr->brotli )
+        M_bundle_uncompressed = TRUE;
+#endif
+    if ( M_bundle_uncompressed )
+        WAR("%s has been packed without the compression this app uses, text resources will be read from disk", bundle);
+
+    ALWAYS("Using %s with %ld static resources", bundle, hdr->cnt);
+}
+
+
+/* --------------------------------------------------------------------------
+   Compare bundle entries by minified & name (bsearch)
+-------------------------------------------------------------------------- */
+static int stat_bundle_cmp(const void *a, const void *b)
+{
+    const stat_bundle_entry_t *ea=(const stat_bundle_entry_t*)a;
+    const stat_bundle_entry_t *eb=(const stat_bundle_entry_t*)b;
+
+    if ( ea->minified != eb->minified )
+        return ea->minified - eb->minified;
+
+    return strcmp(ea->name, eb->name);
+}
+
+
+/* --------------------------------------------------------------------------
+   Point M_stat[i] to the bundle if it has up to date copy of the file
+   Return FALSE to have it read the usual way
+-------------------------------------------------------------------------- */
+static bool stat_from_bundle(int i, const char *namewpath, bool minify)
+{
+const stat_bundle_entry_t *e;
+    stat_bundle_entry_t key;
+struct stat fstat;
+    char    mod_time[32];
+
+    if ( !M_bundle )
+        return FALSE;
+
+    strcpy(key.name, M_stat[i].name);
+    key.minified = minify;
+
+    e = (const stat_bundle_entry_t*)bsearch(&key, M_bundle+sizeof(stat_bundle_hdr_t), ((const stat_bundle_hdr_t*)M_bundle)->cnt, sizeof(stat_bundle_entry_t), stat_bundle_cmp);
+
+    if ( !e )
+        return FALSE;
+
+    if ( stat(namewpath, &fstat) != 0 || fstat.st_mtime != e->modified || fstat.st_size != e->src_len )
+    {
+        INF("%s has changed since packing", namewpath);
+        return FALSE;
+    }
+
+    if ( e->off + e->len > M_bundle_len || e->off_gz + e->len_gz > M_bundle_len || e->off_br + e->len_br > M_bundle_len )
+        return FALSE;
+
+    M_stat[i].data = M_bundle + e->off;
+    M_stat[i].len = e->len;
+    M_stat[i].type = get_res_type(M_stat[i].name);
+    M_stat[i].modified = e->modified;
+    M_stat[i].minified = minify;
+    M_stat[i].in_bundle = TRUE;
+
+    /* large ones go with sendfile() from the bundle */
+
+    M_stat[i].on_disk = (G_largeStatic > 0 && M_stat[i].len >= G_largeStatic);
+    M_stat[i].fd = M_bundle_fd;
+    M_stat[i].fd_base = M_bundle;
+
+#if defined(GZIP) || defined(BROTLI)
+    if ( M_bundle_uncompressed && stat_compressible(i) )   /* it'd go without compressed variants */
+    {
+        free_stat(i);
+        return FALSE;
+    }
+#endif
+
+#ifdef GZIP
+    if ( e->off_gz )
+    {
+        M_stat[i].data_gz = M_bundle + e->off_gz;
+        M_stat[i].len_gz = e->len_gz;
+    }
+#endif
+#ifdef BROTLI
+    if ( e->off_br )
+    {
+        M_stat[i].data_br = M_bundle + e->off_br;
+        M_stat[i].len_br = e->len_br;
+    }
+#endif
+    strcpy(M_stat[i].etag, e->etag);
+    strcpy(M_stat[i].last_modified, time_epoch2http(M_stat[i].modified));
+
+    stat_set_headers(i);
+
+    G_ptm = lib_gmtime(&M_stat[i].modified);
+    strftime(mod_time, 32, "%Y-%m-%d %H:%M:%S", G_ptm);
+    ALWAYS("%s %s\t\t%ld Bytes (bundle)", lib_add_spaces(M_stat[i].name, 28), mod_time, M_stat[i].len);
+
+    G_ptm = lib_gmtime(&G_now);     /* set it back */
+
+    return TRUE;
+}
+#endif  /* _WIN32 */
+
+
+/* --------------------------------------------------------------------------
+  find first free slot in M_stat
+-------------------------------------------------------------------------- */
+static int first_free_stat()
+{
+    if ( M_stat_cnt < MAX_STATICS-1 )   /* the last one is for "-" */
+        return M_stat_cnt;
+
+    ERR("Big trouble, ran out of statics! i = %d", M_stat_cnt);
+
+    return -1;  /* nothing's free, we ran out of statics! */
+}
+
+
+/* --------------------------------------------------------------------------
+   Static resource name hash for M_stat index
+-------------------------------------------------------------------------- */
+static unsigned stat_hash(const char *name)
+{
+    unsigned hash=2166136261u;  /* FNV-1a */
+
+    while ( *name )
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash % STAT_HASH_SIZE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Return M_stat index of the resource or -1
+-------------------------------------------------------------------------- */
+static int stat_find(const char *name)
+{
+    int i;
+
+    for ( i=M_stat_hash[stat_hash(name)]; i != -1; i=M_stat_next[i] )
+        if ( 0==strcmp(M_stat[i].name, name) )
+            return i;
+
+    return -1;
+}
+
+
+/* --------------------------------------------------------------------------
+   Check if special case statics are present
+   Again after each reload, they may have come or gone
+-------------------------------------------------------------------------- */
+static void stat_check_special()
+{
+    M_favicon_exists = (stat_find("favicon.ico") != -1);
+    M_robots_exists = (stat_find("robots.txt") != -1);
+    M_appleicon_exists = (stat_find("apple-touch-icon.png") != -1);
+}
+
+
+/* --------------------------------------------------------------------------
+   Add static resource to name index
+   If the name is already there (res and resmin), the first one stays
+-------------------------------------------------------------------------- */
+static void stat_index_add(int i)
+{
+    unsigned hash;
+
+    if ( stat_find(M_stat[i].name) != -1 )
+    {
+        WAR("%s is already among statics, ignoring the second one", M_stat[i].name);
+        return;
+    }
+
+    hash = stat_hash(M_stat[i].name);
+
+    M_stat_next[i] = M_stat_hash[hash];
+#ifdef THREADS
+    __sync_synchronize();   /* on reload other threads may be looking it up already */
+#endif
+    M_stat_hash[hash] = i;
+}
+
+
+#ifdef __linux__
+/* --------------------------------------------------------------------------
+   Put M_stat[i] in place of M_stat[old] in name index (i = -1 removes old)
+   Other threads may be walking the chain -- link the new entry in
+   completely before making it visible, old one keeps its next link
+   until it's freed, which is after every thread has been through
+   the top of its loop (see stat_grace_over)
+-------------------------------------------------------------------------- */
+static void stat_index_replace(int old, int i)
+{
+    int *link;
+
+    for ( link=&M_stat_hash[stat_hash(M_stat[old].name)]; *link != -1; link=&M_stat_next[*link] )
+    {
+        if ( *link == old )
+        {
+            if ( i == -1 )
+            {
+                *link = M_stat_next[old];
+            }
+            else
+            {
+                M_stat_next[i] = M_stat_next[old];
+#ifdef THREADS
+                __sync_synchronize();
+#endif
+                *link = i;
+            }
+            return;
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Start watching res & resmin for changes
+   Watcher belongs to the process (or thread) looking after shared stuff
+-------------------------------------------------------------------------- */
+static void stat_watch_init()
+{
+    if ( (M_stat_watch_fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 )
+    {
+        WAR("inotify_init1 failed, errno = %d (%s), static resources won't be reloaded", errno, strerror(errno));
+        return;
+    }
+
+    stat_watch_add("", FALSE, FALSE);
+    stat_watch_add("", TRUE, FALSE);
+
+    if ( !M_stat_watch_cnt )
+    {
+        close(M_stat_watch_fd);
+        M_stat_watch_fd = -1;
+        return;
+    }
+
+    INF("Watching %d static resources directories for changes", M_stat_watch_cnt);
+}
+
+
+/* --------------------------------------------------------------------------
+   Watch directory and its subdirectories
+   For new directory (load) also read the files that are already there
+-------------------------------------------------------------------------- */
+static void stat_watch_add(const char *path, bool minify, bool load)
+{
+    char    dir[1024];
+    char    name[256];
+    char    namewpath[1024];
+    int     w, wd;
+    DIR     *d;
+struct dirent *dirent;
+struct stat fstat;
+
+    sprintf(dir, "%s/%s/%s", G_appdir, minify?"resmin":"res", path);
+
+    for ( w=0; w<M_stat_watch_cnt; ++w )    /* reuse the ones of removed directories */
+        if ( M_stat_watch[w].wd == -1 )
+            break;
+
+    if ( w == STAT_MAX_DIRS )
+    {
+        WAR("Too many static resources directories, %s won't be watched", dir);
+        return;
+    }
+
+    if ( (wd=inotify_add_watch(M_stat_watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_CREATE)) == -1 )
+        return;
+
+    M_stat_watch[w].wd = wd;
+    M_stat_watch[w].minify = minify;
+    strcpy(M_stat_watch[w].path, path);
+    if ( w == M_stat_watch_cnt ) ++M_stat_watch_cnt;
+
+    if ( (d=opendir(dir)) == NULL )
+        return;
+
+    while ( (dirent=readdir(d)) )
+    {
+        if ( dirent->d_name[0] == '.' )
+            continue;
+
+        if ( snprintf(name, sizeof(name)-1, "%s%s", path, dirent->d_name) >= (int)sizeof(name)-1
+                || snprintf(namewpath, sizeof(namewpath), "%s%s", dir, dirent->d_name) >= (int)sizeof(namewpath) )
+            continue;
+
+        if ( stat(namewpath, &fstat) != 0 )
+            continue;
+
+        if ( S_ISDIR(fstat.st_mode) )
+        {
+            strcat(name, "/");
+            stat_watch_add(name, minify, load);
+        }
+        else if ( load )
+        {
+            stat_reload(name, minify);
+        }
+    }
+
+    closedir(d);
+}
+
+
+/* --------------------------------------------------------------------------
+   Pick up changes in res & resmin and their subdirectories
+   Called once a second
+-------------------------------------------------------------------------- */
+static void stat_watch_check()
+{
+    char    buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char    *p;
+const struct inotify_event *event;
+    int     w, i;
+    char    name[256];
+
+    if ( M_stat_watch_fd != -1 )
+    {
+        while ( (len=read(M_stat_watch_fd, buf, sizeof(buf))) > 0 )
+        {
+            for ( p=buf; p < buf+len; p += sizeof(struct inotify_event) + event->len )
+            {
+                event = (const struct inotify_event*)p;
+
+                for ( w=0; w<M_stat_watch_cnt; ++w )
+                    if ( M_stat_watch[w].wd == event->wd )
+                        break;
+
+                if ( w == M_stat_watch_cnt )
+                    continue;
+
+                if ( event->mask & IN_IGNORED )     /* directory is gone */
+                {
+                    M_stat_watch[w].wd = -1;
+                    continue;
+                }
+
+                if ( !event->len || event->name[0] == '.' )
+                    continue;
+
+                if ( snprintf(name, sizeof(name)-1, "%s%s", M_stat_watch[w].path, event->name) >= (int)sizeof(name)-1 )
+                    continue;
+
+                if ( event->mask & IN_ISDIR )
+                {
+                    if ( event->mask & (IN_CREATE | IN_MOVED_TO) )
+                    {
+                        strcat(name, "/");
+                        stat_watch_add(name, M_stat_watch[w].minify, TRUE);
+                    }
+                }
+                else if ( event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) )
+                {
+                    if ( (event->mask & IN_CLOSE_WRITE) && (i=stat_find(name)) != -1 && M_stat[i].on_disk && !M_stat[i].in_bundle )
+                        WAR("%s has been written over while mapped, connections sending it may get broken content -- replace large static files by renaming", name);
+                    stat_reload(name, M_stat_watch[w].minify);
+                }
+                else if ( event->mask & (IN_DELETE | IN_MOVED_FROM) )
+                    stat_unload(name, M_stat_watch[w].minify);
+            }
+        }
+    }
+
+    if ( M_stat_retired_cnt )
+        stat_free_retired();
+}
+
+
+/* --------------------------------------------------------------------------
+   Read changed or new file into a fresh M_stat entry and swap it in
+   Connections still sending the old one keep its buffer until it's freed
+-------------------------------------------------------------------------- */
+static void stat_reload(const char *name, bool minify)
+{
+    int     old, i;
+    char    namewpath[1024];
+    bool    ok;
+
+    old = stat_find(name);
+
+    if ( old != -1 && M_stat[old].minified != minify )
+    {
+        DBG("%s is served from %s, ignoring change", name, M_stat[old].minified?"resmin":"res");
+        return;
+    }
+
+    if ( old != -1 && M_stat[old].immutable )
+        WAR("%s has been sent as immutable, browsers may keep the old copy -- put new version in a new directory", name);
+
+    if ( M_stat_free_cnt )
+        i = M_stat_free[--M_stat_free_cnt];
+    else if ( (i=first_free_stat()) == -1 )
+        return;
+
+    memset(&M_stat[i], 0, sizeof(stat_res_t));
+    strcpy(M_stat[i].name, name);
+    M_stat[i].minified = minify;
+
+    if ( minify )
+        sprintf(namewpath, "%s/resmin/%s", G_appdir, name);
+    else
+        sprintf(namewpath, "%s/res/%s", G_appdir, name);
+
+    INF("Reloading %s", namewpath);
+
+    M_stat_reloading = TRUE;    /* the loop is waiting -- take cheaper compression */
+    ok = read_stat(i, namewpath, minify);
+    M_stat_reloading = FALSE;
+
+    if ( !ok )
+    {
+        if ( i == M_stat_cnt )
+            strcpy(M_stat[i].name, "-");
+        else
+        {
+            M_stat[i].name[0] = EOS;
+            M_stat_free[M_stat_free_cnt++] = i;
+        }
+        return;
+    }
+
+    if ( i == M_stat_cnt )  /* appended */
+    {
+        ++M_stat_cnt;
+        strcpy(M_stat[M_stat_cnt].name, "-");
+    }
+
+    if ( old == -1 )
+    {
+        stat_index_add(i);
+        stat_check_special();
+    }
+    else
+    {
+        M_stat[i].hits = M_stat[old].hits;
+        stat_index_replace(old, i);
+        stat_retire(old);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Remove deleted file from statics
+-------------------------------------------------------------------------- */
+static void stat_unload(const char *name, bool minify)
+{
+    int i;
+
+    if ( (i=stat_find(name)) == -1 || M_stat[i].minified != minify )
+        return;
+
+    INF("Removing %s from statics", name);
+
+    stat_index_replace(i, -1);
+    stat_retire(i);
+    stat_check_special();
+}
+
+
+/* --------------------------------------------------------------------------
+   Queue M_stat entry that's no longer in the index to be freed
+-------------------------------------------------------------------------- */
+static void stat_retire(int i)
+{
+    M_stat[i].hits = 0;
+    M_stat_retired[M_stat_retired_cnt] = i;
+#ifdef THREADS
+    M_stat_retired_epoch[M_stat_retired_cnt] = ++M_stat_epoch;
+#endif
+    ++M_stat_retired_cnt;
+}
+
+
+#ifdef THREADS
+/* --------------------------------------------------------------------------
+   Whether every thread has been through the top of its loop since epoch
+   Lookups that could have found retired entry are finished by then,
+   so it can only be referenced from conn[].static_res
+-------------------------------------------------------------------------- */
+static bool stat_grace_over(unsigned epoch)
+{
+    int i;
+
+    if ( !M_thread_epoch )  /* single thread */
+        return TRUE;
+
+    __sync_synchronize();
+
+    for ( i=1; i<=G_threads; ++i )
+        if ( (int)(M_thread_epoch[i] - epoch) < 0 )
+            return FALSE;
+
+    return TRUE;
+}
+#endif
+
+
+/* --------------------------------------------------------------------------
+   Free retired M_stat entries no connection is using anymore
+   With threads, other threads' conn[].static_res can only go back
+   to NOT_STATIC after the grace period, seeing old value just means
+   trying again in the next second
+-------------------------------------------------------------------------- */
+static void stat_free_retired()
+{
+    int     r, i, ci;
+
+    for ( r=0; r<M_stat_retired_cnt; ++r )
+    {
+        i = M_stat_retired[r];
+#ifdef THREADS
+        if ( !stat_grace_over(M_stat_retired_epoch[r]) )
+            continue;
+#endif
+
+        for ( ci=0; ci<MAX_CONNECTIONS; ++ci )
+            if ( conn[ci].static_res == i )
+                break;
+
+        if ( ci < MAX_CONNECTIONS )     /* still being sent */
+            continue;
+
+        DBG("Freeing old %s (%d)", M_stat[i].name, i);
+
+        free_stat(i);
+        M_stat[i].name[0] = EOS;
+        M_stat_free[M_stat_free_cnt++] = i;
+
+        /* take it off the retired list */
+
+        --M_stat_retired_cnt;
+        M_stat_retired[r] = M_stat_retired[M_stat_retired_cnt];
+#ifdef THREADS
+        M_stat_retired_epoch[r] = M_stat_retired_epoch[M_stat_retired_cnt];
+#endif
+        --r;
+    }
+}
+#endif  /* __linux__ */
+
+
+#if defined(GZIP) || defined(BROTLI)
+/* --------------------------------------------------------------------------
+   Whether static resource should have compressed variants
+-------------------------------------------------------------------------- */
+static bool stat_compressible(int i)
+{
+    stat_res_t  *res=&M_stat[i];
+
+    if ( res->on_disk || res->len < STAT_COMPRESS_MIN )
+        return FALSE;
+
+    return (res->type == RES_TEXT || res->type == RES_HTML || res->type == RES_CSS || res->type == RES_JS);
+}
+
+
+/* --------------------------------------------------------------------------
+   Prepare compressed variants of text static resource
+   Only the ones that came out smaller are kept
+-------------------------------------------------------------------------- */
+static void compress_stat(int i)
+{
+    stat_res_t  *res=&M_stat[i];
+#ifdef GZIP
+    z_stream    zs;
+    long        gz_len;
+    int         level;
+#endif
+#ifdef BROTLI
+    size_t      br_len;
+#endif
+
+    if ( !stat_compressible(i) )
+        return;
+
+#ifdef GZIP
+    memset(&zs, 0, sizeof(z_stream));
+
+    level = M_stat_reloading ? STAT_RELOAD_GZIP_LEVEL : Z_BEST_COMPRESSION;
+    if ( deflateInit2(&zs, level, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) != Z_OK )  /* 15+16 = gzip wrapper */
+    {
+        WAR("deflateInit2 failed for %s", res->name);
+    }
+    else
+    {
+        gz_len = deflateBound(&zs, res->len);
+
+        if ( NULL == (res->data_gz=(char*)malloc(gz_len)) )
+        {
+            WAR("Couldn't allocate %ld bytes for gzipped %s", gz_len, res->name);
+        }
+        else
+        {
+            zs.next_in = (Bytef*)res->data;
+            zs.avail_in = res->len;
+            zs.next_out = (Bytef*)res->data_gz;
+            zs.avail_out = gz_len;
+
+            if ( deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < (uLong)res->len )
+            {
+                res->len_gz = zs.total_out;
+            }
+            else
+            {
+                free(res->data_gz);
+                res->data_gz = NULL;
+            }
+        }
+
+        deflateEnd(&zs);
+    }
+#endif  /* GZIP */
+
+#ifdef BROTLI
+    br_len = BrotliEncoderMaxCompressedSize(res->len);
+
+    if ( br_len == 0 || NULL == (res->data_br=(char*)malloc(br_len)) )
+    {
+        WAR("Couldn't allocate %ld bytes for brotli %s", (long)br_len, res->name);
+    }
+    else if ( BrotliEncoderCompress(M_stat_reloading?STAT_RELOAD_BROTLI_QUALITY:BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, res->len, (const uint8_t*)res->data, &br_len, (uint8_t*)res->data_br) && br_len < (size_t)res->len )
+    {
+        res->len_br = br_len;
+    }
+    else
+    {
+        free(res->data_br);
+        res->data_br = NULL;
+    }
+#endif  /* BROTLI */
+
+#ifdef GZIP
+    if ( res->data_gz ) INF("%s gzip: %ld Bytes", res->name, res->len_gz);
+#endif
+#ifdef BROTLI
+    if ( res->data_br ) INF("%s brotli: %ld Bytes", res->name, res->len_br);
+#endif
+}
+#endif  /* GZIP || BROTLI */
+
+
+/* --------------------------------------------------------------------------
+   Pick static resource's variant the client accepts, set clen
+   Byte ranges always refer to the identity
+-------------------------------------------------------------------------- */
+static void select_stat_enc(int ci)
+{
+    stat_res_t  *res=&M_stat[conn[ci].static_res];
+
+    conn[ci].clen = res->len;
+#ifdef BROTLI
+    if ( res->data_br && (conn[ci].accept_enc & CONTENT_ENC_BR) )
+    {
+        conn[ci].content_enc = CONTENT_ENC_BR;
+        conn[ci].clen = res->len_br;
+        return;
+    }
+#endif
+#ifdef GZIP
+    if ( res->data_gz && (conn[ci].accept_enc & CONTENT_ENC_GZIP) )
+    {
+        conn[ci].content_enc = CONTENT_ENC_GZIP;
+        conn[ci].clen = res->len_gz;
+    }
+#endif
+}
+
+
+/* --------------------------------------------------------------------------
+   Compute static resource's ETag and Last-Modified once
+-------------------------------------------------------------------------- */
+static void stat_set_validators(int i)
+{
+    sprintf(M_stat[i].etag, "%016llx", (unsigned long long)lib_hash64(M_stat[i].data, M_stat[i].len));
+    strcpy(M_stat[i].last_modified, time_epoch2http(M_stat[i].modified));
+}
+
+
+/* --------------------------------------------------------------------------
+   Build static resource's 200 response headers once, one per encoding
+   Only Date and Connection are left to add per request
+-------------------------------------------------------------------------- */
+static void stat_set_headers(int i)
+{
+    char    hdr[1024];
+    int     enc;
+    long    len;
+#ifdef NO_IDENTITY
+    const char *server="";
+#else
+    const char *server="Server: Silgy\r\n";
+#endif
+
+    M_stat[i].immutable = (G_statVersioned && stat_versioned(M_stat[i].name));
+
+    for ( enc=CONTENT_ENC_IDENTITY; enc<=CONTENT_ENC_BR; ++enc )
+    {
+        free(M_stat[i].hdr[enc]);
+        M_stat[i].hdr[enc] = NULL;
+
+        len = M_stat[i].len;
+#ifdef GZIP
+        if ( enc == CONTENT_ENC_GZIP )
+        {
+            if ( !M_stat[i].data_gz ) continue;
+            len = M_stat[i].len_gz;
+        }
+#else
+        if ( enc == CONTENT_ENC_GZIP ) continue;
+#endif
+#ifdef BROTLI
+        if ( enc == CONTENT_ENC_BR )
+        {
+            if ( !M_stat[i].data_br ) continue;
+            len = M_stat[i].len_br;
+        }
+#else
+        if ( enc == CONTENT_ENC_BR ) continue;
+#endif
+        M_stat[i].hdr_len[enc] = sprintf(hdr, "HTTP/1.1 200 %s\r\n"
+                "Vary: Accept-Encoding\r\n"
+                "%s"
+                "Last-Modified: %s\r\n"
+                "Accept-Ranges: bytes\r\n"
+                "Content-Length: %ld\r\n"
+                "Content-Type: %s\r\n"
+                "ETag: \"%s%s\"\r\n"
+                "%s%s", get_http_descr(200),
+                M_stat[i].immutable?"Cache-Control: public, max-age=31536000, immutable\r\n":"", M_stat[i].last_modified, len, get_content_type(M_stat[i].type),
+                M_stat[i].etag, enc==CONTENT_ENC_GZIP?"-gz":enc==CONTENT_ENC_BR?"-br":"",
+                enc==CONTENT_ENC_GZIP?"Content-Encoding: gzip\r\n":enc==CONTENT_ENC_BR?"Content-Encoding: br\r\n":"", server);
+
+        if ( NULL == (M_stat[i].hdr[enc]=(char*)malloc(M_stat[i].hdr_len[enc])) )
+        {
+            ERR("Couldn't allocate %d bytes for %s header", M_stat[i].hdr_len[enc], M_stat[i].name);
+            continue;   /* it'll be generated */
+        }
+
+        memcpy(M_stat[i].hdr[enc], hdr, M_stat[i].hdr_len[enc]);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Copy static resource's prebuilt 200 header and complete it
+   Return FALSE if there's none
+-------------------------------------------------------------------------- */
+static bool stat_header(int ci)
+{
+    stat_res_t  *res=&M_stat[conn[ci].static_res];
+    int         enc;
+
+    select_stat_enc(ci);    /* sets clen */
+
+    enc = conn[ci].content_enc;
+
+    if ( !res->hdr[enc] )
+        return FALSE;
+
+    memcpy(conn[ci].header, res->hdr[enc], res->hdr_len[enc]);
+    conn[ci].p_curr_h = conn[ci].header + res->hdr_len[enc];
+
+    PRINT_HTTP_DATE;
+    HOUT(conn[ci].keep_alive?"Connection: Keep-Alive\r\n\r\n":"Connection: close\r\n\r\n");
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Does any entity tag in If-None-Match match etag
+   Weak comparison -- W/ and our -gz/-br suffixes don't matter
+-------------------------------------------------------------------------- */
+static bool etag_match(const char *if_none_match, const char *etag)
+{
+    const char *p=if_none_match;
+    int     len=strlen(etag);
+
+    while ( *p )
+    {
+        while ( *p == ' ' || *p == ',' ) ++p;
+
+        if ( *p == '*' )
+            return TRUE;
+
+        if ( *p == 'W' && *(p+1) == '/' )
+            p += 2;
+
+        if ( *p == '"' && 0==strncmp(p+1, etag, len) && (*(p+1+len) == '"' || *(p+1+len) == '-') )
+            return TRUE;
+
+        while ( *p && *p != ',' ) ++p;  /* next one */
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Dynamic response opted in for ETag -- hash out_data
+   If client already has it, turn the response into 304
+-------------------------------------------------------------------------- */
+static void dyn_etag(int ci)
+{
+    sprintf(conn[ci].etag, "%016llx", (unsigned long long)lib_hash64(conn[ci].out_data, conn[ci].p_curr_c-conn[ci].out_data));
+
+    if ( conn[ci].if_none_match[0] && etag_match(conn[ci].if_none_match, conn[ci].etag) )
+    {
+        DBG("ETag matches, Not Modified");
+        conn[ci].status = 304;
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Return M_stat array index if name is on statics' list
+-------------------------------------------------------------------------- */
+static int is_static_res(int ci, const char *name)
+{
+    int i;
+
+    if ( (i=stat_find(name)) == -1 )
+        return -1;
+
+//  DBG("It is static");
+
+#ifdef THREADS
+    __sync_fetch_and_add(&M_stat[i].hits, 1);
+#else
+    ++M_stat[i].hits;
+#endif
+
+    if ( conn[ci].if_none_match[0] )     /* takes precedence over If-Modified-Since */
+    {
+        if ( etag_match(conn[ci].if_none_match, M_stat[i].etag) )
+            conn[ci].status = 304;  /* Not Modified */
+    }
+    else if ( conn[ci].if_mod_since >= M_stat[i].modified )
+    {
+//      DBG("Not Modified");
+        conn[ci].status = 304;  /* Not Modified */
+    }
+
+    return i;
+}
+
+
+/* --------------------------------------------------------------------------
+   Open database connection
+-------------------------------------------------------------------------- */
+static bool open_db()
+{
+#ifdef DBMYSQL
+    if ( NULL == (G_dbconn=mysql_init(NULL)) )
+    {
+        ERR("Error %u: %s", mysql_errno(G_dbconn), mysql_error(G_dbconn));
+        return FALSE;
+    }
+
+#ifdef DBMYSQLRECONNECT
+    my_bool reconnect=1;
+    mysql_options(G_dbconn, MYSQL_OPT_RECONNECT, &reconnect);
+#endif
+
+//    unsigned long max_packet=33554432;  /* 32 MB */
+//    mysql_options(G_dbconn, MYSQL_OPT_MAX_ALLOWED_PACKET, &max_packet);
+
+    if ( NULL == mysql_real_connect(G_dbconn, G_dbHost[0]?G_dbHost:NULL, G_dbUser, G_dbPassword, G_dbName, G_dbPort, NULL, 0) )
+    {
+        ERR("Error %u: %s", mysql_errno(G_dbconn), mysql_error(G_dbconn));
+        return FALSE;
+    }
+#endif
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Main new request processing
+   Request received over current conn is already parsed
+-------------------------------------------------------------------------- */
+static void process_req(int ci)
+{
+    int     ret=OK;
+
+    DBG("process_req, ci=%d", ci);
+
+    conn[ci].p_curr_c = conn[ci].out_data;
+
+    conn[ci].location[COLON_POSITION] = '-';    /* no protocol here yet */
+
+    /* ------------------------------------------------------------------------ */
+    /* Generate HTML content before header -- to know its size & type --------- */
+
+    /* ------------------------------------------------------------------------ */
+    /* authorization check / log in from cookies ------------------------------ */
+
+    if ( conn[ci].static_res == NOT_STATIC && conn[ci].status == 200 )
+    {
+#ifdef USERS
+        if ( conn[ci].cookie_in_l[0] )  /* logged in sesid cookie present */
+        {
+            ret = libusr_l_usession_ok(ci);     /* is it valid? */
+
+            if ( ret == OK )    /* valid sesid -- user logged in */
+                DBG("User logged in from cookie");
+            else if ( ret != ERR_INT_SERVER_ERROR && ret != ERR_SERVER_TOOBUSY )    /* dodged sesid... or session expired */
+                WAR("Invalid ls cookie");
+        }
+
+        if ( conn[ci].auth_level==AUTH_LEVEL_ADMIN && !ADMIN )  /* return not found */
+        {
+            INF("AUTH_LEVEL_ADMIN required, returning 404");
+            ret = ERR_NOT_FOUND;
+            RES_DONT_CACHE;
+        }
+        else if ( conn[ci].auth_level==AUTH_LEVEL_LOGGEDIN && !LOGGED )    /* redirect to login page */
+        {
+            INF("AUTH_LEVEL_LOGGEDIN required, redirecting to login");
+            ret = ERR_REDIRECTION;
+            if ( !strlen(APP_LOGIN_URI) )   /* login page = landing page */
+                sprintf(conn[ci].location, "%s://%s", PROTOCOL, conn[ci].host);
+            else
+                strcpy(conn[ci].location, APP_LOGIN_URI);
+        }
+        else    /* login not required for this URI */
+        {
+            ret = OK;
+        }
+
+        if ( conn[ci].auth_level==AUTH_LEVEL_ANONYMOUS && !REQ_BOT && !conn[ci].head_only && !LOGGED )    /* anonymous user session required */
+#else
+        if ( conn[ci].auth_level==AUTH_LEVEL_ANONYMOUS && !REQ_BOT && !conn[ci].head_only )
+#endif
+        {
+            if ( !conn[ci].cookie_in_a[0] || !a_usession_ok(ci) )       /* valid anonymous sesid cookie not present */
+            {
+                if ( !eng_uses_start(ci) )  /* start new anonymous user session */
+                    ret = ERR_SERVER_TOOBUSY;   /* user sessions exhausted */
+            }
+        }
+
+        /* ------------------------------------------------------------------------ */
+        /* process request -------------------------------------------------------- */
+
+        if ( ret == OK )
+        {
+            if ( !conn[ci].location[0] )
+                ret = app_process_req(ci);  /* main application called here */
+        }
+
+        conn[ci].last_activity = G_now;
+        if ( conn[ci].usi ) US.last_activity = G_now;
+
+#ifdef ASYNC
+        if ( conn[ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+        {
+            return;
+        }
+#endif
+        /* ------------------------------------------------------------------------ */
+
+        if ( conn[ci].location[0] || ret == ERR_REDIRECTION )   /* redirection has a priority */
+            conn[ci].status = 303;
+        else if ( ret == ERR_INVALID_REQUEST )
+            conn[ci].status = 400;
+        else if ( ret == ERR_UNAUTHORIZED )
+            conn[ci].status = 401;
+        else if ( ret == ERR_FORBIDDEN )
+            conn[ci].status = 403;
+        else if ( ret == ERR_NOT_FOUND )
+            conn[ci].status = 404;
+        else if ( ret == ERR_INT_SERVER_ERROR )
+            conn[ci].status = 500;
+        else if ( ret == ERR_SERVER_TOOBUSY )
+            conn[ci].status = 503;
+
+        if ( ret==ERR_REDIRECTION || ret==ERR_INVALID_REQUEST || ret==ERR_UNAUTHORIZED || ret==ERR_FORBIDDEN || ret==ERR_NOT_FOUND || ret==ERR_INT_SERVER_ERROR || ret==ERR_SERVER_TOOBUSY )
+        {
+            conn[ci].p_curr_c = conn[ci].out_data;      /* reset out buffer pointer as it could have contained something already */
+#ifdef USERS
+            if ( conn[ci].usi && !LOGGED ) close_a_uses(conn[ci].usi);
+#else
+            if ( conn[ci].usi ) close_a_uses(conn[ci].usi);
+#endif
+            gen_page_msg(ci, ret);
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Get the next part of streamed response from the app
+   and frame it as a chunk -- app is called until it's produced
+   OUT_STREAM_CHUNK or finished
+   HTTP/1.0 can't do chunks so it gets the whole thing at once
+-------------------------------------------------------------------------- */
+static void stream_chunk(int ci)
+{
+    bool    more=TRUE;
+    long    len;
+    char    size[16];
+    int     size_len;
+    char    *p;
+
+    while ( more && (conn[ci].http10 || conn[ci].p_curr_c - conn[ci].out_data < OUT_STREAM_CHUNK) )
+        more = conn[ci].stream(ci);
+
+    if ( !more )
+        conn[ci].stream = NULL;
+
+    len = conn[ci].p_curr_c - conn[ci].out_data;
+
+    conn[ci].data_sent = 0;
+
+    if ( conn[ci].http10 )
+    {
+        conn[ci].clen = len;
+        return;
+    }
+
+    conn[ci].chunked = TRUE;
+
+    /* make room for size in front and CRLF + last chunk at the end */
+
+#ifdef OUTCHECKREALLOC
+    if ( len+32 >= conn[ci].out_data_allocated && !out_grow(ci, 32) )
+        len = conn[ci].out_data_allocated - 32;
+#else
+    if ( len+32 > OUT_BUFSIZE )
+    {
+        WAR("Streamed chunk too big, truncating");
+        len = OUT_BUFSIZE - 32;
+    }
+#endif
+
+    p = conn[ci].out_data;
+
+    if ( len )
+    {
+        size_len = sprintf(size, "%lx\r\n", len);
+        memmove(p+size_len, p, len);
+        memcpy(p, size, size_len);
+        p += size_len + len;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+
+    if ( !more )    /* last chunk */
+    {
+        memcpy(p, "0\r\n\r\n", 5);
+        p += 5;
+    }
+
+    conn[ci].clen = p - conn[ci].out_data;
+
+    DBG("Streamed chunk of %ld bytes%s", len, more?"":", last");
+}
+
+
+/* --------------------------------------------------------------------------
+   Generate HTTP response header
+-------------------------------------------------------------------------- */
+static void gen_response_header(int ci)
+{
+    char    total[24];
+
+    DBG("gen_response_header, ci=%d", ci);
+
+    conn[ci].p_curr_h = conn[ci].header;
+
+    if ( conn[ci].use_etag && conn[ci].static_res == NOT_STATIC && conn[ci].status == 200 && !conn[ci].stream )
+        dyn_etag(ci);   /* may turn it into 304 */
+
+    if ( conn[ci].static_res != NOT_STATIC && conn[ci].status == 200 && stat_header(ci) )
+    {
+        DBG("Prebuilt header for %s", M_stat[conn[ci].static_res].name);
+        conn[ci].conn_state = CONN_STATE_READY_TO_SEND_HEADER;
+        conn[ci].last_activity = G_now;
+        if ( conn[ci].usi ) US.last_activity = G_now;
+        return;
+    }
+
+    PRINT_HTTP_STATUS(conn[ci].status);
+
+    if ( conn[ci].status == 301 || conn[ci].status == 303 )     /* redirection */
+    {
+        DBG("Redirecting");
+
+        /*
+           1 - upgrade 2 https, keep URI (301)
+           2 - app new page version, ignore URI, use location (303)
+           3 - redirect to final domain, keep URI (301)
+        */
+
+        if ( conn[ci].upgrade2https )   /* (1) */
+        {
+            PRINT_HTTP_VARY_UIR;    /* Upgrade-Insecure-Requests */
+            hdr_line(ci, 5, "Location: https://", conn[ci].host, "/", conn[ci].uri, "\r\n");
+        }
+        else if ( conn[ci].location[COLON_POSITION] == ':' )        /* (2) full address already present */
+        {
+            hdr_line(ci, 3, "Location: ", conn[ci].location, "\r\n");
+        }
+        else if ( conn[ci].location[0] )        /* (2) */
+        {
+            hdr_line(ci, 7, "Location: ", PROTOCOL, "://", conn[ci].host, "/", conn[ci].location, "\r\n");
+        }
+        else if ( conn[ci].uri[0] ) /* (3) URI */
+        {
+#ifdef DOMAINONLY
+            hdr_line(ci, 7, "Location: ", PROTOCOL, "://", G_test?conn[ci].host:APP_DOMAIN, "/", conn[ci].uri, "\r\n");
+#else
+            hdr_line(ci, 7, "Location: ", PROTOCOL, "://", conn[ci].host, "/", conn[ci].uri, "\r\n");
+#endif
+        }
+        else    /* (3) No URI */
+        {
+#ifdef DOMAINONLY
+            hdr_line(ci, 5, "Location: ", PROTOCOL, "://", G_test?conn[ci].host:APP_DOMAIN, "\r\n");
+#else
+            hdr_line(ci, 5, "Location: ", PROTOCOL, "://", conn[ci].host, "\r\n");
+#endif
+        }
+
+        conn[ci].clen = 0;
+    }
+    else if ( conn[ci].status == 304 )      /* not modified since */
+    {
+//        DBG("Not Modified");
+
+        if ( conn[ci].static_res == NOT_STATIC )
+        {
+            PRINT_HTTP_LAST_MODIFIED(G_last_modified);
+        }
+        else    /* static res */
+        {
+            if ( M_stat[conn[ci].static_res].immutable )
+                PRINT_HTTP_CACHE_IMMUTABLE;
+            PRINT_HTTP_LAST_MODIFIED(M_stat[conn[ci].static_res].last_modified);
+            select_stat_enc(ci);    /* only for ETag to be the same as with 200 */
+        }
+
+        conn[ci].clen = 0;
+    }
+    else    /* normal response with content: 2xx, 4xx, 5xx */
+    {
+//        DBG("Normal response");
+
+        if ( conn[ci].dont_cache )  /* dynamic content */
+        {
+            PRINT_HTTP_VARY_DYN;
+            PRINT_HTTP_NO_CACHE;
+        }
+        else    /* static content */
+        {
+            PRINT_HTTP_VARY_STAT;
+
+            if ( conn[ci].static_res == NOT_STATIC )
+            {
+                if ( conn[ci].modified )
+                    PRINT_HTTP_LAST_MODIFIED(time_epoch2http(conn[ci].modified));
+                else
+                    PRINT_HTTP_LAST_MODIFIED(G_last_modified);
+
+                PRINT_HTTP_EXPIRES;
+            }
+            else    /* static res */
+            {
+                if ( M_stat[conn[ci].static_res].immutable )
+                    PRINT_HTTP_CACHE_IMMUTABLE;
+                PRINT_HTTP_LAST_MODIFIED(M_stat[conn[ci].static_res].last_modified);
+            }
+        }
+
+        if ( conn[ci].static_res != NOT_STATIC )
+        {
+            PRINT_HTTP_ACCEPT_RANGES;
+
+            if ( conn[ci].status == 206 )
+                print_content_range(ci);    /* sets clen */
+            else if ( conn[ci].status == 416 )
+            {
+                hdr_ltoa(total, M_stat[conn[ci].static_res].len);
+                hdr_line(ci, 3, "Content-Range: bytes */", total, "\r\n");
+                conn[ci].clen = 0;
+            }
+            else
+                select_stat_enc(ci);    /* sets clen */
+        }
+        else if ( conn[ci].stream && conn[ci].status == 200 && !conn[ci].head_only )
+            stream_chunk(ci);   /* sets clen */
+        else
+        {
+#ifdef GZIP
+            compress_out(ci);   /* may replace out_data content */
+#endif
+            conn[ci].clen = conn[ci].p_curr_c - conn[ci].out_data;
+        }
+    }
+
+    if ( conn[ci].status != 200 || conn[ci].head_only )     /* nothing to stream */
+        conn[ci].stream = NULL;
+
+    /* Date */
+
+    PRINT_HTTP_DATE;
+
+    /* Connection */
+
+    PRINT_HTTP_CONNECTION(ci);
+
+    /* Content-Length */
+
+    if ( conn[ci].chunked )
+        HOUT("Transfer-Encoding: chunked\r\n");
+    else
+        PRINT_HTTP_CONTENT_LEN(conn[ci].clen);
+
+    /* Cookie */
+
+    if ( conn[ci].static_res == NOT_STATIC && (conn[ci].status == 200 || conn[ci].status == 303) && !conn[ci].head_only )
+    {
+        if ( conn[ci].cookie_out_l[0] )         /* logged in cookie has been produced */
+        {
+            if ( conn[ci].cookie_out_l_exp[0] )
+            {
+                PRINT_HTTP_COOKIE_L_EXP(ci);    /* with expiration date */
+            }
+            else
+            {
+                PRINT_HTTP_COOKIE_L(ci);
+            }
+        }
+
+        if ( conn[ci].cookie_out_a[0] )         /* anonymous cookie has been produced */
+        {
+            if ( conn[ci].cookie_out_a_exp[0] )
+            {
+                PRINT_HTTP_COOKIE_A_EXP(ci);    /* with expiration date */
+            }
+            else
+            {
+                PRINT_HTTP_COOKIE_A(ci);
+            }
+        }
+    }
+
+    /* Content-Type */
+
+    if ( conn[ci].clen == 0 )   /* don't set for these */
+    {                   /* this covers 301, 303, 304 and 416 */
+    }
+    else if ( conn[ci].ranges_cnt > 1 )     /* multiple byte ranges */
+    {
+        hdr_line(ci, 3, "Content-Type: multipart/byteranges; boundary=", M_range_boundary, "\r\n");
+    }
+    else if ( conn[ci].static_res != NOT_STATIC )   /* static resource */
+    {
+        print_content_type(ci, M_stat[conn[ci].static_res].type);
+    }
+    else if ( conn[ci].ctype == CONTENT_TYPE_USER )
+    {
+        hdr_line(ci, 3, "Content-Type: ", conn[ci].ctypestr, "\r\n");
+    }
+    else if ( conn[ci].ctype != CONTENT_TYPE_UNSET )
+    {
+        print_content_type(ci, conn[ci].ctype);
+    }
+
+    /* ETag -- after compression, as it differs per encoding */
+
+    if ( conn[ci].status == 200 || conn[ci].status == 206 || conn[ci].status == 304 )
+    {
+        if ( conn[ci].static_res != NOT_STATIC )
+            PRINT_HTTP_ETAG(M_stat[conn[ci].static_res].etag, conn[ci].content_enc);
+        else if ( conn[ci].etag[0] )
+            PRINT_HTTP_ETAG(conn[ci].etag, conn[ci].content_enc);
+    }
+
+    /* Content-Encoding */
+
+    if ( conn[ci].status != 304 )   /* no body */
+    {
+        if ( conn[ci].content_enc == CONTENT_ENC_GZIP )
+            HOUT("Content-Encoding: gzip\r\n");
+        else if ( conn[ci].content_enc == CONTENT_ENC_BR )
+            HOUT("Content-Encoding: br\r\n");
+    }
+
+    if ( conn[ci].cdisp[0] )
+    {
+        hdr_line(ci, 3, "Content-Disposition: ", conn[ci].cdisp, "\r\n");
+    }
+
+#ifndef NO_IDENTITY
+    PRINT_HTTP_SERVER;
+#endif
+
+    PRINT_HTTP_END_OF_HEADER;
+
+    DBG("Response status: %d", conn[ci].status);
+
+//  DBG("Changing state to CONN_STATE_READY_TO_SEND_HEADER");
+    conn[ci].conn_state = CONN_STATE_READY_TO_SEND_HEADER;
+
+    DBG("\nResponse header:\n\n[%s]\n", conn[ci].header);
+
+#ifdef DUMP     /* low-level tests */
+    if ( G_logLevel>=LOG_DBG && conn[ci].clen > 0 && !conn[ci].head_only && conn[ci].static_res == NOT_STATIC && conn[ci].content_enc == CONTENT_ENC_IDENTITY && (conn[ci].ctype == CONTENT_TYPE_UNSET || conn[ci].ctype == RES_TEXT || conn[ci].ctype == RES_HTML) )
+        log_long(conn[ci].out_data, conn[ci].clen, "Sent");
+#endif
+
+    conn[ci].last_activity = G_now;
+    if ( conn[ci].usi ) US.last_activity = G_now;
+}
+
+
+#ifdef GZIP
+/* --------------------------------------------------------------------------
+   Is dynamic response of the kind that compresses well
+   Images, archives etc. already are compressed
+-------------------------------------------------------------------------- */
+static bool compressible(int ci)
+{
+    if ( conn[ci].ctype == RES_HTML || conn[ci].ctype == RES_TEXT || conn[ci].ctype == RES_CSS || conn[ci].ctype == RES_JS )
+        return TRUE;
+
+    if ( conn[ci].ctype == CONTENT_TYPE_USER )
+        return ( 0==strncmp(conn[ci].ctypestr, "text/", 5) || strstr(conn[ci].ctypestr, "json") || strstr(conn[ci].ctypestr, "xml") || strstr(conn[ci].ctypestr, "javascript") );
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Gzip out_data if it's at least compressMin long, of compressible type
+   and the client accepts it
+   Thread's deflate context is only reset between responses
+-------------------------------------------------------------------------- */
+static void compress_out(int ci)
+{
+    long    len=conn[ci].p_curr_c - conn[ci].out_data;
+    long    bound;
+    char    *tmp;
+struct timespec start;
+struct timespec end;
+
+    if ( G_compressMin < 1 || len < G_compressMin || !(conn[ci].accept_enc & CONTENT_ENC_GZIP) || !compressible(ci) )
+        return;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    if ( !M_deflate_ready )
+    {
+        memset(&M_deflate, 0, sizeof(z_stream));
+
+        if ( deflateInit2(&M_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK )   /* 15+16 = gzip wrapper */
+        {
+            ERR("deflateInit2 failed");
+            return;
+        }
+
+        M_deflate_ready = TRUE;
+    }
+    else
+    {
+        deflateReset(&M_deflate);
+    }
+
+    bound = deflateBound(&M_deflate, len);
+
+    if ( bound > M_deflate_buf_size )
+    {
+        if ( NULL == (tmp=(char*)realloc(M_deflate_buf, bound)) )
+        {
+            ERR("Couldn't allocate %ld bytes for compression", bound);
+            return;
+        }
+        M_deflate_buf = tmp;
+        M_deflate_buf_size = bound;
+    }
+
+    M_deflate.next_in = (Bytef*)conn[ci].out_data;
+    M_deflate.avail_in = len;
+    M_deflate.next_out = (Bytef*)M_deflate_buf;
+    M_deflate.avail_out = bound;
+
+    if ( deflate(&M_deflate, Z_FINISH) != Z_STREAM_END || M_deflate.total_out >= (uLong)len )
+    {
+        DBG("Response not compressed");
+        return;
+    }
+
+    memcpy(conn[ci].out_data, M_deflate_buf, M_deflate.total_out);
+    conn[ci].p_curr_c = conn[ci].out_data + M_deflate.total_out;
+    conn[ci].content_enc = CONTENT_ENC_GZIP;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+    ++G_cnts_today.gz_resp;
+    G_cnts_today.gz_in += len;
+    G_cnts_today.gz_out += M_deflate.total_out;
+    G_cnts_today.gz_usec += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    DBG("Response gzipped from %ld to %ld bytes", len, M_deflate.total_out);
+}
+#endif  /* GZIP */
+
+
+/* --------------------------------------------------------------------------
+   Set up 206 response to Range request
+   Single range goes straight from the static resource,
+   multiple ones are copied to out_data as multipart/byteranges
+-------------------------------------------------------------------------- */
+static void print_content_range(int ci)
+{
+    stat_res_t  *res=&M_stat[conn[ci].static_res];
+    range_t     *r;
+    long        len;
+    int         i;
+    char        range[80];
+    char        *p;
+
+    if ( conn[ci].ranges_cnt == 1 )
+    {
+        r = &conn[ci].ranges[0];
+        p = hdr_ltoa(range, r->from);
+        *p++ = '-';
+        p = hdr_ltoa(p, r->to);
+        *p++ = '/';
+        hdr_ltoa(p, res->len);
+        hdr_line(ci, 3, "Content-Range: bytes ", range, "\r\n");
+        conn[ci].clen = r->to - r->from + 1;
+        return;
+    }
+
+    /* parse_range has made sure it fits */
+
+    conn[ci].p_curr_c = conn[ci].out_data;
+
+    for ( i=0; i<conn[ci].ranges_cnt; ++i )
+    {
+        r = &conn[ci].ranges[i];
+        conn[ci].p_curr_c += sprintf(conn[ci].p_curr_c, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n", M_range_boundary, get_content_type(res->type), r->from, r->to, res->len);
+        len = r->to - r->from + 1;
+        if ( !stat_copy(conn[ci].static_res, conn[ci].p_curr_c, res->data+r->from, len) )
+            memset(conn[ci].p_curr_c, 0, len);     /* Content-Length is what we say it is, keep the framing */
+        conn[ci].p_curr_c += len;
+    }
+
+    conn[ci].p_curr_c += sprintf(conn[ci].p_curr_c, "\r\n--%s--\r\n", M_range_boundary);
+
+    conn[ci].clen = conn[ci].p_curr_c - conn[ci].out_data;
+}
+
+
+/* --------------------------------------------------------------------------
+   Print Content-Type to response header
+-------------------------------------------------------------------------- */
+static void print_content_type(int ci, char type)
+{
+    if ( type > 0 && M_ctype_line[(int)type].str )
+        hdr_add(ci, M_ctype_line[(int)type].str, M_ctype_line[(int)type].len);
+    else
+        hdr_line(ci, 3, "Content-Type: ", get_content_type(type), "\r\n");
+}
+
+
+/* --------------------------------------------------------------------------
+   Return HTTP name of content type
+-------------------------------------------------------------------------- */
+static const char *get_content_type(char type)
+{
+    if ( type == RES_HTML )
+        return "text/html; charset=utf-8";
+    else if ( type == RES_CSS )
+        return "text/css";
+    else if ( type == RES_JS )
+        return "application/javascript";
+    else if ( type == RES_GIF )
+        return "image/gif";
+    else if ( type == RES_JPG )
+        return "image/jpeg";
+    else if ( type == RES_ICO )
+        return "image/x-icon";
+    else if ( type == RES_PNG )
+        return "image/png";
+    else if ( type == RES_BMP )
+        return "image/bmp";
+    else if ( type == RES_PDF )
+        return "application/pdf";
+    else if ( type == RES_AMPEG )
+        return "audio/mpeg";
+    else if ( type == RES_EXE )
+        return "application/x-msdownload";
+    else if ( type == RES_ZIP )
+        return "application/zip";
+
+    return "text/plain";    /* default */
+}
+
+
+/* --------------------------------------------------------------------------
+   Prebuild status and Content-Type header lines
+-------------------------------------------------------------------------- */
+static void hdr_init()
+{
+    char    line[256];
+    int     st;
+    int     i;
+
+    for ( i=0; M_http_status[i].status != -1; ++i )
+    {
+        st = M_http_status[i].status;
+
+        if ( st < 100 || st >= 600 ) continue;
+
+        M_status_line[st].len = sprintf(line, "HTTP/1.1 %d %s\r\n", st, M_http_status[i].description);
+        M_status_line[st].str = strdup(line);
+    }
+
+    for ( i=1; i<128; ++i )
+    {
+        M_ctype_line[i].len = sprintf(line, "Content-Type: %s\r\n", get_content_type(i));
+        M_ctype_line[i].str = strdup(line);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Append len bytes to response header
+   There's always room left for the final CRLF -- line that doesn't fit is skipped
+-------------------------------------------------------------------------- */
+static void hdr_add(int ci, const char *s, int len)
+{
+    if ( conn[ci].p_curr_h + len + 3 > conn[ci].header + OUT_HEADER_BUFSIZE )
+    {
+        WAR("Response header too long, skipping %d bytes", len);
+        return;
+    }
+
+    memcpy(conn[ci].p_curr_h, s, len);
+    conn[ci].p_curr_h += len;
+    *conn[ci].p_curr_h = EOS;
+}
+
+
+/* --------------------------------------------------------------------------
+   Append header line made of cnt (up to 8) strings
+   It goes in whole or not at all
+-------------------------------------------------------------------------- */
+static void hdr_line(int ci, int cnt, ...)
+{
+    va_list     plist;
+    const char  *s[8];
+    int         len[8];
+    int         total=0;
+    int         i;
+    char        *p;
+
+    va_start(plist, cnt);
+
+    for ( i=0; i<cnt; ++i )
+    {
+        s[i] = va_arg(plist, const char*);
+        len[i] = strlen(s[i]);
+        total += len[i];
+    }
+
+    va_end(plist);
+
+    if ( conn[ci].p_curr_h + total + 3 > conn[ci].header + OUT_HEADER_BUFSIZE )
+    {
+        WAR("Response header too long, skipping %s line", s[0]);
+        return;
+    }
+
+    p = conn[ci].p_curr_h;
+
+    for ( i=0; i<cnt; ++i )
+    {
+        memcpy(p, s[i], len[i]);
+        p += len[i];
+    }
+
+    *p = EOS;
+    conn[ci].p_curr_h = p;
+}
+
+
+/* --------------------------------------------------------------------------
+   Append header line with a number
+-------------------------------------------------------------------------- */
+static void hdr_num(int ci, const char *name, long n)
+{
+    char    num[24];
+
+    hdr_ltoa(num, n);
+    hdr_line(ci, 3, name, num, "\r\n");
+}
+
+
+/* --------------------------------------------------------------------------
+   Append status line
+-------------------------------------------------------------------------- */
+static void hdr_status(int ci, int status)
+{
+    char    num[24];
+
+    if ( status >= 100 && status < 600 && M_status_line[status].str )
+    {
+        hdr_add(ci, M_status_line[status].str, M_status_line[status].len);
+        return;
+    }
+
+    hdr_ltoa(num, status);
+    hdr_line(ci, 3, "HTTP/1.1 ", num, " \r\n");
+}
+
+
+/* --------------------------------------------------------------------------
+   Write n as decimal, return pointer to the terminating EOS
+-------------------------------------------------------------------------- */
+static char *hdr_ltoa(char *dest, long n)
+{
+    char    tmp[24];
+    int     i=0;
+    unsigned long u=(n<0)?-(unsigned long)n:(unsigned long)n;
+
+    if ( n < 0 )
+        *dest++ = '-';
+
+    do
+    {
+        tmp[i++] = '0' + u % 10;
+        u /= 10;
+    }
+    while ( u );
+
+    while ( i )
+        *dest++ = tmp[--i];
+
+    *dest = EOS;
+
+    return dest;
+}
+
+
+/* --------------------------------------------------------------------------
+   Verify IP & User-Agent against sesid in uses (anonymous users)
+   Return user session array index if all ok
+-------------------------------------------------------------------------- */
+static bool a_usession_ok(int ci)
+{
+    int i;
+
+    if ( !(i=eng_uses_hold(conn[ci].cookie_in_a)) )
+        return FALSE;   /* not found */
+
+    if ( !uses[i].logged
+/*          && 0==strcmp(conn[ci].ip, uses[i].ip) */
+            && 0==strcmp(conn[ci].uagent, uses[i].uagent) )
+    {
+        DBG("Anonymous session found, usi=%d, sesid [%s]", i, uses[i].sesid);
+        conn[ci].usi = i;
+        return TRUE;
+    }
+
+    eng_uses_release(i);
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   sesid hash for uses index
+-------------------------------------------------------------------------- */
+static unsigned uses_hash(const char *sesid)
+{
+    unsigned hash=2166136261u;  /* FNV-1a */
+
+    while ( *sesid )
+    {
+        hash ^= (unsigned char)*sesid++;
+        hash *= 16777619u;
+    }
+
+    return hash % USES_HASH_SIZE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Add session to sesid index
+   USES_LOCK has to be held
+-------------------------------------------------------------------------- */
+static void uses_index_add(int usi)
+{
+    unsigned hash=uses_hash(uses[usi].sesid);
+
+    M_uses_next[usi] = M_uses_hash[hash];
+    M_uses_hash[hash] = usi;
+}
+
+
+/* --------------------------------------------------------------------------
+   Remove session from sesid index
+   USES_LOCK has to be held
+-------------------------------------------------------------------------- */
+static void uses_index_remove(int usi)
+{
+    int     *p;
+
+    if ( !uses[usi].sesid[0] ) return;
+
+    for ( p=&M_uses_hash[uses_hash(uses[usi].sesid)]; *p; p=&M_uses_next[*p] )
+    {
+        if ( *p == usi )
+        {
+            *p = M_uses_next[usi];
+            break;
         }
     }
 
-    /* Content-Type */
+    M_uses_next[usi] = 0;
+}
 
-    if ( conn[ci].clen == 0 )   /* don't set for these */
-    {                   /* this covers 301, 303 and 304 */
-    }
-    else if ( conn[ci].static_res != NOT_STATIC )   /* static resource */
-    {
-        print_content_type(ci, M_stat[conn[ci].static_res].type);
-    }
-    else if ( conn[ci].ctype == CONTENT_TYPE_USER )
-    {
-        sprintf(G_tmp, "Content-Type: %s\r\n", conn[ci].ctypestr);
-        HOUT(G_tmp);
-    }
-    else if ( conn[ci].ctype != CONTENT_TYPE_UNSET )
-    {
-        print_content_type(ci, conn[ci].ctype);
-    }
 
-    if ( conn[ci].cdisp[0] )
+/* --------------------------------------------------------------------------
+   Find session in sesid index
+   USES_LOCK has to be held
+   Return usi or 0 if not found
+-------------------------------------------------------------------------- */
+static int uses_index_find(const char *sesid)
+{
+    int     usi;
+
+    for ( usi=M_uses_hash[uses_hash(sesid)]; usi; usi=M_uses_next[usi] )
     {
-        sprintf(G_tmp, "Content-Disposition: %s\r\n", conn[ci].cdisp);
-        HOUT(G_tmp);
+        if ( 0==strcmp(uses[usi].sesid, sesid) )
+            break;
     }
 
-#ifndef NO_IDENTITY
-    PRINT_HTTP_SERVER;
-#endif
-
-    PRINT_HTTP_END_OF_HEADER;
+    return usi;
+}
 
-    DBG("Response status: %d", conn[ci].status);
 
-//  DBG("Changing state to CONN_STATE_READY_TO_SEND_HEADER");
-    conn[ci].conn_state = CONN_STATE_READY_TO_SEND_HEADER;
+/* --------------------------------------------------------------------------
+   Set up empty timer wheel
+-------------------------------------------------------------------------- */
+static void init_timers()
+{
+    int i;
 
-    DBG("\nResponse header:\n\n[%s]\n", conn[ci].header);
+    for ( i=0; i<TIMER_NODES; ++i )
+        M_timers[i].slot = -1;
 
-#ifdef DUMP     /* low-level tests */
-    if ( G_logLevel>=LOG_DBG && conn[ci].clen > 0 && !conn[ci].head_only && conn[ci].static_res == NOT_STATIC && (conn[ci].ctype == CONTENT_TYPE_UNSET || conn[ci].ctype == RES_TEXT || conn[ci].ctype == RES_HTML) )
-        log_long(conn[ci].out_data, conn[ci].clen, "Sent");
-#endif
+    for ( i=0; i<TIMER_L0_SIZE+TIMER_L1_SIZE; ++i )
+        M_timer_slots[i] = -1;
 
-    conn[ci].last_activity = G_now;
-    if ( conn[ci].usi ) US.last_activity = G_now;
+    M_timer_now = G_now;
 }
 
 
 /* --------------------------------------------------------------------------
-   Print Content-Type to response header
+   Set timer n to expire at given time
+   level 0 holds the next TIMER_L0_SIZE seconds, level 1 the rest
 -------------------------------------------------------------------------- */
-static void print_content_type(int ci, char type)
+static void timer_set(int n, time_t expires)
 {
-    char    http_type[32]="text/plain";     /* default */
+    int     slot;
+    time_t  delta;
 
-    if ( type == RES_HTML )
-        strcpy(http_type, "text/html; charset=utf-8");
-    else if ( type == RES_CSS )
-        strcpy(http_type, "text/css");
-    else if ( type == RES_JS )
-        strcpy(http_type, "application/javascript");
-    else if ( type == RES_GIF )
-        strcpy(http_type, "image/gif");
-    else if ( type == RES_JPG )
-        strcpy(http_type, "image/jpeg");
-    else if ( type == RES_ICO )
-        strcpy(http_type, "image/x-icon");
-    else if ( type == RES_PNG )
-        strcpy(http_type, "image/png");
-    else if ( type == RES_BMP )
-        strcpy(http_type, "image/bmp");
-    else if ( type == RES_PDF )
-        strcpy(http_type, "application/pdf");
-    else if ( type == RES_AMPEG )
-        strcpy(http_type, "audio/mpeg");
-    else if ( type == RES_EXE )
-        strcpy(http_type, "application/x-msdownload");
-    else if ( type == RES_ZIP )
-        strcpy(http_type, "application/zip");
+    timer_del(n);
+
+    if ( expires <= M_timer_now )
+        expires = M_timer_now + 1;
+
+    delta = expires - M_timer_now;
 
-    sprintf(G_tmp, "Content-Type: %s\r\n", http_type);
-    HOUT(G_tmp);
+    if ( delta < TIMER_L0_SIZE )
+        slot = expires & (TIMER_L0_SIZE-1);
+    else if ( delta < TIMER_L0_SIZE*(TIMER_L1_SIZE-1) )
+        slot = TIMER_L0_SIZE + (expires >> TIMER_L0_BITS) % TIMER_L1_SIZE;
+    else    /* too far -- park it in the last one, it'll be looked at again */
+        slot = TIMER_L0_SIZE + ((M_timer_now >> TIMER_L0_BITS) + TIMER_L1_SIZE-1) % TIMER_L1_SIZE;
+
+    M_timers[n].expires = expires;
+    M_timers[n].slot = slot;
+    M_timers[n].prev = -1;
+    M_timers[n].next = M_timer_slots[slot];
+
+    if ( M_timer_slots[slot] != -1 )
+        M_timers[M_timer_slots[slot]].prev = n;
+
+    M_timer_slots[slot] = n;
 }
 
 
 /* --------------------------------------------------------------------------
-   Verify IP & User-Agent against sesid in uses (anonymous users)
-   Return user session array index if all ok
+   Take timer n off the wheel
 -------------------------------------------------------------------------- */
-static bool a_usession_ok(int ci)
+static void timer_del(int n)
 {
-    int i;
+    if ( M_timers[n].slot == -1 ) return;
 
-    for (i=1; i<=MAX_SESSIONS; ++i)
-    {
-        if ( uses[i].sesid[0] && !uses[i].logged && 0==strcmp(conn[ci].cookie_in_a, uses[i].sesid)
-/*              && 0==strcmp(conn[ci].ip, uses[i].ip) */
-                && 0==strcmp(conn[ci].uagent, uses[i].uagent) )
-        {
-            DBG("Anonymous session found, usi=%d, sesid [%s]", i, uses[i].sesid);
-            conn[ci].usi = i;
-            return TRUE;
-        }
-    }
+    if ( M_timers[n].prev != -1 )
+        M_timers[M_timers[n].prev].next = M_timers[n].next;
+    else
+        M_timer_slots[M_timers[n].slot] = M_timers[n].next;
 
-    /* not found */
-    return FALSE;
+    if ( M_timers[n].next != -1 )
+        M_timers[M_timers[n].next].prev = M_timers[n].prev;
+
+    M_timers[n].slot = -1;
 }
 
 
 /* --------------------------------------------------------------------------
-   Close timeouted connections
+   Fire expired timers
+   every second passed since the last call moves the wheel by one slot
 -------------------------------------------------------------------------- */
-static void close_old_conn()
+static void process_timers()
 {
-    int     i;
-    time_t  last_allowed;
-
-    last_allowed = G_now - CONN_TIMEOUT;
+    int     slot;
+    int     n;
 
-    for (i=0; i<MAX_CONNECTIONS; ++i)
+    while ( M_timer_now < G_now )
     {
-        if ( conn[i].conn_state != CONN_STATE_DISCONNECTED && conn[i].last_activity < last_allowed )
+        ++M_timer_now;
+
+        /* beginning of level 0 round -- bring level 1 slot down */
+
+        if ( (M_timer_now & (TIMER_L0_SIZE-1)) == 0 )
         {
-            DBG("Closing timeouted connection %d", i);
-            close_conn(i);
+            slot = TIMER_L0_SIZE + (M_timer_now >> TIMER_L0_BITS) % TIMER_L1_SIZE;
+
+            while ( (n=M_timer_slots[slot]) != -1 )
+            {
+                timer_del(n);
+                if ( M_timers[n].expires <= M_timer_now )
+                    timer_fire(n);
+                else
+                    timer_set(n, M_timers[n].expires);
+            }
+        }
+
+        /* one at a time -- firing may set or delete others */
+
+        slot = M_timer_now & (TIMER_L0_SIZE-1);
+
+        while ( (n=M_timer_slots[slot]) != -1 )
+        {
+            timer_del(n);
+            if ( M_timers[n].expires <= M_timer_now )
+                timer_fire(n);
+            else
+                timer_set(n, M_timers[n].expires);
         }
     }
 }
 
 
 /* --------------------------------------------------------------------------
-  close timeouted anonymous user sessions
+   Timer n has expired
+   last_activity isn't followed by timers, so check it here and set again if needed
 -------------------------------------------------------------------------- */
-static void close_uses_timeout()
+static void timer_fire(int n)
 {
-    int     i;
-    time_t  last_allowed;
+    int     ci;
+    int     usi;
+    int     timeout;
+#ifdef ASYNC
+    int     j;
+#endif
+
+    if ( n < TIMER_USES )   /* connection */
+    {
+        ci = n - TIMER_CONN;
+
+        if ( conn[ci].conn_state == CONN_STATE_DISCONNECTED ) return;
 
-    last_allowed = G_now - USES_TIMEOUT;
+        if ( conn[ci].last_activity >= G_now - CONN_TIMEOUT )
+        {
+            timer_set(n, conn[ci].last_activity+CONN_TIMEOUT+1);
+        }
+        else
+        {
+            DBG("Closing timeouted connection %d", ci);
+            close_conn(ci);
+        }
+    }
+    else if ( n < TIMER_ASYNC )     /* user session */
+    {
+        usi = n - TIMER_USES;
 
-    for (i=1; i<=MAX_SESSIONS; ++i)
+        if ( !uses[usi].sesid[0] || uses[usi].closing ) return;    /* closed already */
+#ifdef USERS
+        timeout = uses[usi].logged ? LUSES_TIMEOUT : USES_TIMEOUT;
+#else
+        timeout = USES_TIMEOUT;
+#endif
+        if ( uses[usi].busy )   /* request in progress, possibly in another thread */
+            timer_set(n, G_now+timeout+1);
+        else if ( uses[usi].last_activity >= G_now - timeout )
+            timer_set(n, uses[usi].last_activity+timeout+1);
+#ifdef USERS
+        else if ( uses[usi].logged )
+            libusr_close_l_uses(-1, usi);
+#endif
+        else
+            close_a_uses(usi);
+    }
+#ifdef ASYNC
+    else    /* async call */
     {
-        if ( uses[i].sesid[0] && !uses[i].logged && uses[i].last_activity < last_allowed )
-            close_a_uses(i);
+        j = n - TIMER_ASYNC;
+
+        if ( ares[j].state != ASYNC_STATE_SENT ) return;    /* response has come */
+
+        if ( ares[j].sent >= G_now - ares[j].timeout )
+        {
+            timer_set(n, ares[j].sent+ares[j].timeout+1);
+        }
+        else
+        {
+            DBG("Async request %d timeout-ed", j);
+            ares[j].state = ASYNC_STATE_TIMEOUTED;
+#ifdef IOURING
+            if ( conn[ares[j].ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+                uring_poll(ares[j].ci, POLLOUT);    /* wake it up */
+#elif defined(EPOLL)
+            if ( conn[ares[j].ci].conn_state == CONN_STATE_WAITING_FOR_ASYNC )
+                set_epoll_events(ares[j].ci, EPOLL_CTL_MOD);    /* wake it up */
+#endif
+        }
     }
+#endif
 }
 
 
@@ -2465,19 +5465,64 @@ static void close_a_uses(int usi)
 -------------------------------------------------------------------------- */
 static void reset_conn(int ci, char conn_state)
 {
+    long    i;
+
+    /* keep pipelined request(s) that came after the current one */
+
+    if ( conn_state == CONN_STATE_CONNECTED && conn[ci].in_len > conn[ci].req_len )
+    {
+        i = conn[ci].req_len;
+
+        while ( i < conn[ci].in_len && (conn[ci].in[i] == '\r' || conn[ci].in[i] == '\n') )  /* empty lines before request are allowed */
+            ++i;
+
+        conn[ci].in_len -= i;
+        memmove(conn[ci].in, conn[ci].in+i, conn[ci].in_len+1);
+        conn[ci].hdr_scanned = 0;
+
+        if ( header_complete(ci) )
+        {
+            DBG("Pipelined request, %ld bytes already in", conn[ci].in_len);
+            conn_state = CONN_STATE_READY_FOR_PARSE;    /* no need to wait for read */
+        }
+        else if ( conn[ci].in_len )
+        {
+            conn_state = CONN_STATE_READING_HEADER;
+        }
+    }
+    else
+    {
+        conn[ci].in_len = 0;
+        conn[ci].hdr_scanned = 0;
+    }
+
+    conn[ci].req_len = 0;
+
     conn[ci].status = 200;
     conn[ci].conn_state = conn_state;
     conn[ci].method[0] = EOS;
     conn[ci].head_only = FALSE;
+    conn[ci].http10 = FALSE;
     conn[ci].post = FALSE;
     if ( conn[ci].data )
     {
-        free(conn[ci].data);
+#ifndef _WIN32
+        if ( conn[ci].data_mapped )
+        {
+            munmap(conn[ci].data, conn[ci].data_mapped);
+            close(conn[ci].data_fd);
+            conn[ci].data_mapped = 0;
+        }
+        else
+#endif
+            free(conn[ci].data);
         conn[ci].data = NULL;
     }
     conn[ci].was_read = 0;
     conn[ci].upgrade2https = FALSE;
     conn[ci].data_sent = 0;
+    conn[ci].stream = NULL;
+    conn[ci].chunked = FALSE;
     conn[ci].resource[0] = EOS;
     conn[ci].id[0] = EOS;
     conn[ci].uagent[0] = EOS;
@@ -2491,10 +5536,22 @@ static void reset_conn(int ci, char conn_state)
     strcpy(conn[ci].website, APP_WEBSITE);
     conn[ci].lang[0] = EOS;
     conn[ci].if_mod_since = 0;
+    conn[ci].range[0] = EOS;
+    conn[ci].if_range[0] = EOS;
+    conn[ci].if_none_match[0] = EOS;
+    conn[ci].use_etag = FALSE;
+    conn[ci].etag[0] = EOS;
+    conn[ci].ranges_cnt = 0;
+    conn[ci].accept_enc = CONTENT_ENC_IDENTITY;
+    conn[ci].content_enc = CONTENT_ENC_IDENTITY;
     conn[ci].in_ctype = CONTENT_TYPE_URLENCODED;
     conn[ci].boundary[0] = EOS;
     conn[ci].auth_level = APP_DEF_AUTH_LEVEL;
-    conn[ci].usi = 0;
+    if ( conn[ci].usi )
+    {
+        eng_uses_release(conn[ci].usi);
+        conn[ci].usi = 0;
+    }
     conn[ci].static_res = NOT_STATIC;
     conn[ci].ctype = RES_HTML;
     conn[ci].cdisp[0] = EOS;
@@ -2528,6 +5585,8 @@ static int parse_req(int ci, long len)
     char    label[MAX_LABEL_LEN+1];
     char    value[MAX_VALUE_LEN+1];
     char    *p_question=NULL;
+    char    stat_path[256];
+    size_t  path_len;
 
     /* --------------------------------------------
 
@@ -2548,6 +5607,8 @@ static int parse_req(int ci, long len)
 //  if ( conn[ci].conn_state != STATE_SENDING ) /* ignore Range requests for now */
 //      conn[ci].conn_state = STATE_RECEIVED;   /* by default */
 
+    conn[ci].req_len = len;     /* until we know better, the whole buffer */
+
     if ( len < 14 ) /* ignore any junk */
     {
         DBG("request len < 14, ignoring");
@@ -2562,18 +5623,16 @@ static int parse_req(int ci, long len)
     {
         p_hend = strstr(conn[ci].in, "\n\n");
 
-        if ( !p_hend )
+        if ( !p_hend )  /* header is read until its end or the buffer is full */
         {
-            if ( 0 == strncmp(conn[ci].in, "GET / HTTP/1.", 13) )   /* temporary solution for good looking partial requests */
-            {
-                strcat(conn[ci].in, "\n");  /* for values reading algorithm */
-                p_hend = conn[ci].in + len;
-            }
-            else
+            if ( len >= IN_BUFSIZE-1 )
             {
-                DBG("Request syntax error, ignoring");
-                return 400; /* Bad Request */
+                DBG("Request header too long, ignoring");
+                return 431; /* Request Header Fields Too Large */
             }
+
+            DBG("Request syntax error, ignoring");
+            return 400; /* Bad Request */
         }
     }
 
@@ -2659,6 +5718,9 @@ static int parse_req(int ci, long len)
         }
     }
 
+    if ( 0==strncmp(conn[ci].in+i+1, "HTTP/1.0", 8) )
+        conn[ci].http10 = TRUE;
+
     /* only for low-level tests ------------------------------------- */
 //  DBG("URI: [%s]", conn[ci].uri);
     /* -------------------------------------------------------------- */
@@ -2725,6 +5787,20 @@ static int parse_req(int ci, long len)
         }
     }
 
+    /* the next pipelined request may start right after this one ---------------- */
+
+    if ( 0==strncmp(p_hend, "\r\n\r\n", 4) )
+        conn[ci].req_len = p_hend - conn[ci].in + 4;
+    else if ( 0==strncmp(p_hend, "\n\n", 2) )
+        conn[ci].req_len = p_hend - conn[ci].in + 2;
+
+    if ( conn[ci].post && conn[ci].clen > 0 )
+    {
+        conn[ci].req_len += conn[ci].clen;
+        if ( conn[ci].req_len > len )   /* content not received entirely yet */
+            conn[ci].req_len = len;
+    }
+
     /* split URI and resource / id ---------------------------------------------- */
 
     if ( conn[ci].uri[0] )  /* if not empty */
@@ -2755,7 +5831,17 @@ static int parse_req(int ci, long len)
         DBG("resource: [%s]", conn[ci].resource);
         DBG("id: [%s]", conn[ci].id);
 
-        conn[ci].static_res = is_static_res(ci, conn[ci].resource);     /* statics --> set the flag!!! */
+        /* statics can be in subdirectories -- look up the whole path first */
+
+        if ( conn[ci].id[0] && (path_len=strcspn(conn[ci].uri, "?")) < 256 )
+        {
+            strncpy(stat_path, conn[ci].uri, path_len);
+            stat_path[path_len] = EOS;
+            conn[ci].static_res = is_static_res(ci, stat_path);
+        }
+
+        if ( conn[ci].static_res == NOT_STATIC )
+            conn[ci].static_res = is_static_res(ci, conn[ci].resource);     /* statics --> set the flag!!! */
         /* now, it may have set conn[ci].status to 304 */
     }
 
@@ -2779,13 +5865,10 @@ static int parse_req(int ci, long len)
         conn[ci].auth_level = AUTH_LEVEL_NONE;
     }
 
-    /* ignore Range requests for now -------------------------------------------- */
+    /* Range request ------------------------------------------------------------ */
 
-/*  if ( conn[ci].conn_state == STATE_SENDING )
-    {
-        DBG("conn_state == STATE_SENDING, this request will be ignored");
-        return 200;
-    } */
+    if ( conn[ci].static_res != NOT_STATIC && conn[ci].status == 200 && conn[ci].range[0] )
+        conn[ci].status = parse_range(ci);
 
     DBG("bot = %s", REQ_BOT?"TRUE":"FALSE");
 
@@ -2826,11 +5909,19 @@ static int parse_req(int ci, long len)
 
         len = conn[ci].in+len - p_hend;         /* remaining request length -- likely a content */
 
-        if ( len > conn[ci].clen )
-            return 400;     /* Bad Request */
+        if ( len > conn[ci].clen )  /* the rest is the next pipelined request */
+            len = conn[ci].clen;
 
         /* copy so far received POST data from conn[ci].in to conn[ci].data */
 
+#ifndef _WIN32
+        if ( G_largePost > 0 && conn[ci].clen >= G_largePost )  /* don't hold it all in memory */
+        {
+            if ( !spill_post_data(ci) )
+                return 500;     /* Internal Sever Error */
+        }
+        else
+#endif
         if ( NULL == (conn[ci].data=(char*)malloc(conn[ci].clen+1)) )
         {
             ERR("Couldn't allocate %d bytes for POST data!!!", conn[ci].clen);
@@ -2840,24 +5931,181 @@ static int parse_req(int ci, long len)
         memcpy(conn[ci].data, p_hend, len);
         conn[ci].was_read = len;    /* if POST then was_read applies to data section only! */
 
-        if ( len < conn[ci].clen )      /* the whole content not received yet */
-        {                               /* this is the only case when conn_state != received */
-            DBG("The whole content not received yet");
-            conn[ci].conn_state = CONN_STATE_READING_DATA;
-            return ret;
-        }
-        else    /* the whole content received with the header at once */
-        {
-            conn[ci].data[len] = EOS;
-            DBG("POST data received with header");
-        }
+        if ( len < conn[ci].clen )      /* the whole content not received yet */
+        {                               /* this is the only case when conn_state != received */
+            DBG("The whole content not received yet");
+            conn[ci].conn_state = CONN_STATE_READING_DATA;
+            return ret;
+        }
+        else    /* the whole content received with the header at once */
+        {
+            conn[ci].data[len] = EOS;
+            DBG("POST data received with header");
+        }
+    }
+
+    if ( conn[ci].status != 200 )   /* Not Modified or Range */
+        return conn[ci].status;
+    else
+        return ret;
+}
+
+
+/* --------------------------------------------------------------------------
+  parse Range header against the static resource length
+  return 206 with conn[ci].ranges set or 416 if none is satisfiable
+  malformed, too many or too big for multipart, or If-Range not matching
+  -- return 200 and the whole resource goes
+-------------------------------------------------------------------------- */
+static int parse_range(int ci)
+{
+    long    len=M_stat[conn[ci].static_res].len;
+    long    from, to;
+    long    total=0;
+    int     cnt=0;
+    char    *p, *e;
+
+    if ( conn[ci].if_range[0] == '"' )  /* entity tag -- strong comparison */
+    {
+        if ( strlen(conn[ci].if_range) != 18 || 0!=strncmp(conn[ci].if_range+1, M_stat[conn[ci].static_res].etag, 16) || conn[ci].if_range[17] != '"' )
+        {
+            DBG("If-Range doesn't match, sending the whole resource");
+            return 200;
+        }
+    }
+    else if ( conn[ci].if_range[0] && 0!=strcmp(conn[ci].if_range, M_stat[conn[ci].static_res].last_modified) )
+    {
+        DBG("If-Range doesn't match, sending the whole resource");
+        return 200;
+    }
+
+    if ( 0!=strncmp(conn[ci].range, "bytes=", 6) )     /* unknown unit */
+        return 200;
+
+    p = conn[ci].range + 6;
+
+    while ( *p )
+    {
+        while ( *p == ' ' || *p == ',' ) ++p;
+
+        if ( !*p ) break;
+
+        if ( *p == '-' && isdigit(p[1]) )   /* suffix -- last n bytes */
+        {
+            to = strtol(p+1, &e, 10);
+            from = to < len ? len - to : 0;
+            to = len - 1;
+        }
+        else if ( isdigit(*p) )
+        {
+            from = strtol(p, &e, 10);
+
+            if ( *e != '-' ) return 200;
+
+            p = e + 1;
+
+            if ( isdigit(*p) )
+            {
+                to = strtol(p, &e, 10);
+                if ( to < from ) return 200;    /* invalid -- the whole header is ignored */
+                if ( to >= len ) to = len - 1;
+            }
+            else    /* till the end */
+            {
+                e = p;
+                to = len - 1;
+            }
+        }
+        else
+            return 200;
+
+        while ( *e == ' ' ) ++e;
+
+        if ( *e && *e != ',' ) return 200;
+
+        p = e;
+
+        if ( from >= len )  /* unsatisfiable, skip it */
+            continue;
+
+        if ( cnt == MAX_RANGES )
+        {
+            DBG("Too many ranges, sending the whole resource");
+            return 200;
+        }
+
+        conn[ci].ranges[cnt].from = from;
+        conn[ci].ranges[cnt].to = to;
+        ++cnt;
+
+        total += to - from + 1 + 256;   /* part's header included */
+    }
+
+    if ( cnt == 0 )
+    {
+        DBG("Range not satisfiable");
+        return 416;
+    }
+
+    if ( cnt > 1 && total > OUT_BUFSIZE )
+    {
+        DBG("Ranges wouldn't fit in out_data, sending the whole resource");
+        return 200;
+    }
+
+    conn[ci].ranges_cnt = cnt;
+
+    DBG("%d range(s), first %ld-%ld", cnt, conn[ci].ranges[0].from, conn[ci].ranges[0].to);
+
+    return 206;
+}
+
+
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+  map conn[ci].data onto a temporary file for large POST content
+  kernel can write it out rather than keep it all in memory
+  the file is unlinked straight away so it disappears with the fd
+  blocks are allocated upfront -- writing to a hole in a mapping
+  on a full filesystem would raise SIGBUS
+-------------------------------------------------------------------------- */
+static bool spill_post_data(int ci)
+{
+    char    path[512];
+    int     ret;
+
+    sprintf(path, "%s/silgy_post_XXXXXX", G_largePostDir[0]?G_largePostDir:P_tmpdir);
+
+    if ( (conn[ci].data_fd=mkstemp(path)) == -1 )
+    {
+        ERR("mkstemp failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
+    }
+
+    unlink(path);
+
+    if ( (ret=posix_fallocate(conn[ci].data_fd, 0, conn[ci].clen+1)) != 0 )
+    {
+        ERR("posix_fallocate failed for %ld bytes, error = %d (%s)", conn[ci].clen+1, ret, strerror(ret));
+        close(conn[ci].data_fd);
+        return FALSE;
+    }
+
+    if ( (conn[ci].data=(char*)mmap(NULL, conn[ci].clen+1, PROT_READ | PROT_WRITE, MAP_SHARED, conn[ci].data_fd, 0)) == MAP_FAILED )
+    {
+        ERR("mmap failed, errno = %d (%s)", errno, strerror(errno));
+        conn[ci].data = NULL;
+        close(conn[ci].data_fd);
+        return FALSE;
     }
 
-    if ( conn[ci].status == 304 )   /* Not Modified */
-        return 304;
-    else
-        return ret;
+    conn[ci].data_mapped = conn[ci].clen+1;
+
+    DBG("POST data (%ld bytes) will go to temporary file", conn[ci].clen);
+
+    return TRUE;
 }
+#endif  /* _WIN32 */
 
 
 /* --------------------------------------------------------------------------
@@ -3035,87 +6283,571 @@ static int set_http_req_val(int ci, const char *label, const char *value)
     }
     else if ( 0==strcmp(ulabel, "FROM") )
     {
-        strcpy(uvalue, upper(value));
-        if ( !REQ_BOT && (strstr(uvalue, "GOOGLEBOT") || strstr(uvalue, "BINGBOT") || strstr(uvalue, "YANDEX") || strstr(uvalue, "CRAWLER")) )
-            REQ_BOT = TRUE;
+        strcpy(uvalue, upper(value));
+        if ( !REQ_BOT && (strstr(uvalue, "GOOGLEBOT") || strstr(uvalue, "BINGBOT") || strstr(uvalue, "YANDEX") || strstr(uvalue, "CRAWLER")) )
+            REQ_BOT = TRUE;
+    }
+    else if ( 0==strcmp(ulabel, "IF-MODIFIED-SINCE") )
+    {
+        conn[ci].if_mod_since = time_http2epoch(value);
+    }
+    else if ( 0==strcmp(ulabel, "RANGE") )
+    {
+        if ( strlen(value) < MAX_VALUE_LEN-1 )  /* truncated one could ask for wrong bytes */
+            strcpy(conn[ci].range, value);
+    }
+    else if ( 0==strcmp(ulabel, "IF-RANGE") )
+    {
+        strncpy(conn[ci].if_range, value, 63);
+        conn[ci].if_range[63] = EOS;
+    }
+    else if ( 0==strcmp(ulabel, "IF-NONE-MATCH") )
+    {
+        strcpy(conn[ci].if_none_match, value);
+    }
+    else if ( 0==strcmp(ulabel, "ACCEPT-ENCODING") )
+    {
+        conn[ci].accept_enc = parse_accept_enc(value);
+    }
+    else if ( !conn[ci].secure && !G_test && 0==strcmp(ulabel, "UPGRADE-INSECURE-REQUESTS") && 0==strcmp(value, "1") )
+    {
+        DBG("Client wants to upgrade to HTTPS");
+        conn[ci].upgrade2https = TRUE;
+    }
+    else if ( 0==strcmp(ulabel, "EXPECT") )
+    {
+        if ( 0==strcmp(value, "100-continue") )
+            conn[ci].expect100 = TRUE;
+    }
+
+    return 200;
+}
+
+
+/* --------------------------------------------------------------------------
+   Parse Accept-Encoding
+   Return CONTENT_ENC_ bits of the ones we can do, q=0 means not acceptable
+-------------------------------------------------------------------------- */
+static char parse_accept_enc(const char *value)
+{
+    char    enc=CONTENT_ENC_IDENTITY;
+    char    token[32];
+    int     i;
+    bool    rejected;
+
+    while ( *value )
+    {
+        while ( *value == ' ' || *value == ',' ) ++value;
+
+        i = 0;
+
+        while ( *value && *value != ',' && *value != ';' && *value != ' ' )
+        {
+            if ( i < 31 ) token[i++] = tolower(*value);
+            ++value;
+        }
+
+        token[i] = EOS;
+
+        rejected = FALSE;
+
+        while ( *value && *value != ',' )   /* parameters */
+        {
+            if ( *value == 'q' && *(value+1) == '=' )
+                rejected = (strtod(value+2, NULL) == 0);
+            ++value;
+        }
+
+        if ( rejected )
+            continue;
+
+        if ( 0==strcmp(token, "gzip") || 0==strcmp(token, "x-gzip") || 0==strcmp(token, "*") )
+            enc |= CONTENT_ENC_GZIP;
+        else if ( 0==strcmp(token, "br") )
+            enc |= CONTENT_ENC_BR;
+    }
+
+    return enc;
+}
+
+
+/* --------------------------------------------------------------------------
+   Check the rules and block IP if matches
+   Return TRUE if blocked
+-------------------------------------------------------------------------- */
+static bool check_block_ip(int ci, const char *rule, const char *value)
+{
+    if ( G_test ) return FALSE;     // don't block for tests
+
+    if ( (rule[0]=='H' && conn[ci].post && 0==strcmp(value, APP_IP))        /* Host */
+            || (rule[0]=='U' && 0==strcmp(value, "Mozilla/5.0 Jorgee"))     /* User-Agent */
+            || (rule[0]=='R' && 0==strcmp(value, "wp-login.php"))           /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "administrator"))          /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "phpmyadmin"))             /* Resource */
+            || (rule[0]=='R' && strstr(value, "setup.php")) )               /* Resource */
+    {
+        eng_block_ip(conn[ci].ip, TRUE);
+        conn[ci].keep_alive = FALSE;    /* disconnect */
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+  return HTTP status description
+-------------------------------------------------------------------------- */
+static char *get_http_descr(int status_code)
+{
+    int i;
+
+    for ( i=0; M_http_status[i].status != -1; ++i )
+    {
+        if ( M_http_status[i].status == status_code )  /* found */
+            return (char*)&(M_http_status[i].description);
+    }
+
+    return NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   Dump counters
+-------------------------------------------------------------------------- */
+static void dump_counters()
+{
+    ALWAYS("");
+    ALWAYS("Counters:\n");
+    ALWAYS("       req: %ld", G_cnts_today.req);
+    ALWAYS("   req_dsk: %ld", G_cnts_today.req_dsk);
+    ALWAYS("   req_mob: %ld", G_cnts_today.req_mob);
+    ALWAYS("   req_bot: %ld", G_cnts_today.req_bot);
+    ALWAYS("    visits: %ld", G_cnts_today.visits);
+    ALWAYS("visits_dsk: %ld", G_cnts_today.visits_dsk);
+    ALWAYS("visits_mob: %ld", G_cnts_today.visits_mob);
+    ALWAYS("   blocked: %ld", G_cnts_today.blocked);
+    ALWAYS("   accepts: %ld", G_cnts_today.accepts);
+    ALWAYS("acc/wakeup: %.2lf", G_cnts_today.accept_wakeups ? (double)G_cnts_today.accepts / G_cnts_today.accept_wakeups : 0.0);
+#ifdef GZIP
+    ALWAYS("   gz_resp: %ld", G_cnts_today.gz_resp);
+    ALWAYS("  gz_ratio: %.2lf", G_cnts_today.gz_out ? (double)G_cnts_today.gz_in / G_cnts_today.gz_out : 0.0);
+    ALWAYS("    gz_cpu: %.3lf ms (%.3lf ms per response)", G_cnts_today.gz_usec / 1000.0, G_cnts_today.gz_resp ? G_cnts_today.gz_usec / 1000.0 / G_cnts_today.gz_resp : 0.0);
+#endif
+    ALWAYS("");
+}
+
+
+/* --------------------------------------------------------------------------
+   Compare static resources by hits, descending (qsort)
+-------------------------------------------------------------------------- */
+static int stat_hits_cmp(const void *a, const void *b)
+{
+    long    hits_a=M_stat[*(const int*)a].hits;
+    long    hits_b=M_stat[*(const int*)b].hits;
+
+    if ( hits_a < hits_b ) return 1;
+    if ( hits_a > hits_b ) return -1;
+    return 0;
+}
+
+
+/* --------------------------------------------------------------------------
+   Dump static resources' hits, most requested first
+   Every worker process has its own
+-------------------------------------------------------------------------- */
+static void dump_stat_hits()
+{
+    int     idx[MAX_STATICS];
+    int     cnt=0;
+    int     i;
+
+    for ( i=0; i<M_stat_cnt; ++i )
+        if ( M_stat[i].hits )
+            idx[cnt++] = i;
+
+    if ( !cnt ) return;
+
+    qsort(idx, cnt, sizeof(int), stat_hits_cmp);
+
+    ALWAYS("Static resources hits:\n");
+
+    for ( i=0; i<cnt; ++i )
+        ALWAYS("%s %ld", lib_add_spaces(M_stat[idx[i]].name, 28), M_stat[idx[i]].hits);
+
+    ALWAYS("");
+}
+
+
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Fork workers and look after them
+   Master stays here until shut down and only returns FALSE on error
+   Workers return TRUE and carry on with the main loop
+-------------------------------------------------------------------------- */
+static bool start_workers()
+{
+    int     i;
+
+    ALWAYS("\nStarting %d workers...\n", G_workers);
+
+    /* counters shared between workers */
+
+    if ( !lib_shm_create(sizeof(counters_t)*3) )
+    {
+        ERR("Couldn't create shared memory segment for counters");
+        return FALSE;
+    }
+
+    M_shared_cnts = (counters_t*)G_shm_segptr;
+    memset(M_shared_cnts, 0, sizeof(counters_t)*3);
+
+    if ( !reserve_ports() )
+        return FALSE;
+
+    if ( !(M_workers_pid=(pid_t*)calloc(G_workers, sizeof(pid_t))) )
+    {
+        ERR("Couldn't allocate memory for workers' pids");
+        return FALSE;
+    }
+
+    log_flush();  /* don't let the children inherit buffered log */
+
+    for ( i=1; i<=G_workers; ++i )
+    {
+        if ( start_worker(i) )
+            return TRUE;
+    }
+
+    ALWAYS("Master is watching workers...\n");
+
+    return master_loop();
+}
+
+
+/* --------------------------------------------------------------------------
+   Master's loop -- restart dead workers and roll counters over once a day
+   Return TRUE in restarted worker, FALSE on error
+-------------------------------------------------------------------------- */
+static bool master_loop()
+{
+    int     i;
+    int     cnt=sizeof(counters_t)/sizeof(long);
+    pid_t   pid;
+    int     status;
+    int     time_elapsed=0;
+    int     prev_day=G_ptm->tm_mday;
+    long    *today;
+    long    *shared;
+    FILE    *prev_log=NULL;
+
+    log_flush();
+
+    for ( ;; )
+    {
+        sleep(1);
+
+        G_now = time(NULL);
+        G_ptm = lib_gmtime(&G_now);
+        strftime(G_dt, 20, "%Y-%m-%d %H:%M:%S", G_ptm);
+
+#ifdef THREADS
+        if ( M_thread_failed )
+        {
+            ERR("Thread %d has stopped, shutting down", M_thread_failed);
+            return FALSE;
+        }
+#endif
+        /* restart the ones that died */
+
+        while ( M_workers_pid && (pid=waitpid(-1, &status, WNOHANG)) > 0 )
+        {
+            for ( i=0; i<G_workers; ++i )
+            {
+                if ( M_workers_pid[i] == pid )
+                {
+                    WAR("Worker %d (pid %d) exited with status %d, restarting", i+1, pid, status);
+                    if ( start_worker(i+1) )
+                        return TRUE;
+                    break;
+                }
+            }
+        }
+
+        /* once a day, over the combined numbers */
+        /* checked every second -- master is the only one rolling them over */
+
+        if ( G_ptm->tm_mday != prev_day )
+        {
+            today = (long*)&G_cnts_today;
+            shared = (long*)&M_shared_cnts[0];
+
+            for ( i=0; i<cnt; ++i )
+                today[i] = __sync_fetch_and_and(&shared[i], 0);
+
+            dump_counters();
+
+            if ( M_workers_pid )
+                log_finish();
+            else    /* threads are using it -- log_start swaps it under lock */
+                prev_log = G_log;
+
+            if ( !log_start("", G_test) )
+                return FALSE;
+
+            if ( prev_log )     /* no thread can be writing to it anymore */
+            {
+                fclose(prev_log);
+                prev_log = NULL;
+            }
+
+            prev_day = G_ptm->tm_mday;
+
+            /* copy & reset counters */
+            memcpy(&G_cnts_day_before, &G_cnts_yesterday, sizeof(counters_t));
+            memcpy(&G_cnts_yesterday, &G_cnts_today, sizeof(counters_t));
+            memset(&G_cnts_today, 0, sizeof(counters_t));
+
+            memcpy(&M_shared_cnts[1], &G_cnts_yesterday, sizeof(counters_t));
+            memcpy(&M_shared_cnts[2], &G_cnts_day_before, sizeof(counters_t));
+
+            lib_log_memory();
+            ++G_days_up;
+        }
+
+        if ( ++time_elapsed < 60 )
+            continue;
+
+        time_elapsed = 0;
+
+        log_flush();
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Fork n-th worker
+   return TRUE in the worker
+-------------------------------------------------------------------------- */
+static bool start_worker(int n)
+{
+    pid_t   pid;
+
+    pid = fork();
+
+    if ( pid < 0 )
+    {
+        ERR("fork failed for worker %d, errno = %d (%s)", n, errno, strerror(errno));
+        M_workers_pid[n-1] = 0;
+        return FALSE;
+    }
+    else if ( pid > 0 )     /* master */
+    {
+        M_workers_pid[n-1] = pid;
+        INF("Worker %d started, pid = %d", n, pid);
+        return FALSE;
+    }
+
+    /* worker */
+
+    M_worker = n;
+    G_pid = getpid();
+    M_pidfile = NULL;       /* belongs to master */
+    free(M_workers_pid);
+    M_workers_pid = NULL;
+
+    /* master's sockets are bound only -- worker listens on its own */
+
+    close(M_listening_fd);
+#ifdef HTTPS
+    close(M_listening_sec_fd);
+#endif
+
+    sprintf(M_log_prefix, "w%d", n);
+
+    log_finish();
+
+    if ( !log_start(M_log_prefix, G_test) )
+        exit(EXIT_FAILURE);
+
+    ALWAYS("Worker %d, pid = %d", n, G_pid);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Bind ports in master to make sure they're available
+   Sockets are not listening, so no connections land on them
+-------------------------------------------------------------------------- */
+static bool reserve_ports()
+{
+static struct sockaddr_in serv_addr;    /* static = initialised to zeros */
+    int     reuse=1;
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ( (M_listening_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+    {
+        ERR("socket failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
     }
-    else if ( 0==strcmp(ulabel, "IF-MODIFIED-SINCE") )
+
+    setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+    serv_addr.sin_port = htons(G_httpPort);
+
+    if ( bind(M_listening_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0 )
     {
-        conn[ci].if_mod_since = time_http2epoch(value);
+        ERR("bind to port %d failed, errno = %d (%s)", G_httpPort, errno, strerror(errno));
+        return FALSE;
     }
-    else if ( !conn[ci].secure && !G_test && 0==strcmp(ulabel, "UPGRADE-INSECURE-REQUESTS") && 0==strcmp(value, "1") )
+
+#ifdef HTTPS
+    if ( (M_listening_sec_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0 )
     {
-        DBG("Client wants to upgrade to HTTPS");
-        conn[ci].upgrade2https = TRUE;
+        ERR("socket failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
     }
-    else if ( 0==strcmp(ulabel, "EXPECT") )
+
+    setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+    serv_addr.sin_port = htons(G_httpsPort);
+
+    if ( bind(M_listening_sec_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0 )
     {
-        if ( 0==strcmp(value, "100-continue") )
-            conn[ci].expect100 = TRUE;
+        ERR("bind to port %d failed, errno = %d (%s)", G_httpsPort, errno, strerror(errno));
+        return FALSE;
     }
+#endif
 
-    return 200;
+    return TRUE;
 }
 
 
 /* --------------------------------------------------------------------------
-   Check the rules and block IP if matches
-   Return TRUE if blocked
+   Stop all workers and wait until they publish their counters
 -------------------------------------------------------------------------- */
-static bool check_block_ip(int ci, const char *rule, const char *value)
+static void stop_workers()
 {
-    if ( G_test ) return FALSE;     // don't block for tests
+    int     i;
 
-    if ( (rule[0]=='H' && conn[ci].post && 0==strcmp(value, APP_IP))        /* Host */
-            || (rule[0]=='U' && 0==strcmp(value, "Mozilla/5.0 Jorgee"))     /* User-Agent */
-            || (rule[0]=='R' && 0==strcmp(value, "wp-login.php"))           /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "administrator"))          /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "phpmyadmin"))             /* Resource */
-            || (rule[0]=='R' && strstr(value, "setup.php")) )               /* Resource */
+    for ( i=0; i<G_workers; ++i )
+        if ( M_workers_pid[i] > 0 )
+            kill(M_workers_pid[i], SIGTERM);
+
+    for ( i=0; i<G_workers; ++i )
+        if ( M_workers_pid[i] > 0 )
+            waitpid(M_workers_pid[i], NULL, 0);
+}
+
+
+/* --------------------------------------------------------------------------
+   Add worker's counters to the shared ones
+   counters_t consists of longs only
+-------------------------------------------------------------------------- */
+static void publish_counters()
+{
+    long    *today=(long*)&G_cnts_today;
+    long    *published=(long*)&M_cnts_published;
+    long    *shared=(long*)&M_shared_cnts[0];
+    int     cnt=sizeof(counters_t)/sizeof(long);
+    int     i;
+
+    for ( i=0; i<cnt; ++i )
     {
-        eng_block_ip(conn[ci].ip, TRUE);
-        conn[ci].keep_alive = FALSE;    /* disconnect */
-        return TRUE;
+        if ( today[i] != published[i] )
+        {
+            __sync_fetch_and_add(&shared[i], today[i]-published[i]);
+            published[i] = today[i];
+        }
     }
-
-    return FALSE;
 }
+#endif  /* _WIN32 */
 
 
+#ifdef THREADS
 /* --------------------------------------------------------------------------
-  return HTTP status description
+   Start threads, each one with its own shard of conn and listening sockets
+   Main thread stays here until shut down
 -------------------------------------------------------------------------- */
-static char *get_http_descr(int status_code)
+static void start_threads()
 {
-    int i;
+    int         i;
+    pthread_t   thread;
+    sigset_t    sigs, prev_sigs;
 
-    for ( i=0; M_http_status[i].status != -1; ++i )
+    ALWAYS("\nStarting %d threads...\n", G_threads);
+
+    M_shared_cnts = M_threads_cnts;
+
+    /* replaced static resources are only freed after every thread has moved on */
+
+    if ( NULL == (M_thread_epoch=(unsigned*)calloc(G_threads+1, sizeof(unsigned))) )
     {
-        if ( M_http_status[i].status == status_code )  /* found */
-            return (char*)&(M_http_status[i].description);
+        ERR("Couldn't allocate thread epochs");
+        return;
     }
 
-    return NULL;
+#ifdef DBMYSQL
+    mysql_library_init(0, NULL, NULL);  /* mysql_init() isn't thread-safe without that */
+#endif
+
+    /* signals are for the main thread */
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTSTP);
+    pthread_sigmask(SIG_BLOCK, &sigs, &prev_sigs);
+
+    for ( i=1; i<=G_threads; ++i )
+    {
+        if ( pthread_create(&thread, NULL, thread_main, (void*)(long)i) != 0 )
+        {
+            ERR("pthread_create failed for thread %d", i);
+            pthread_sigmask(SIG_SETMASK, &prev_sigs, NULL);
+            return;
+        }
+
+        pthread_detach(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &prev_sigs, NULL);
+
+    ALWAYS("Main thread is watching counters...\n");
+
+    master_loop();
 }
 
 
 /* --------------------------------------------------------------------------
-   Dump counters
+   Thread's entry point
 -------------------------------------------------------------------------- */
-static void dump_counters()
+static void *thread_main(void *arg)
 {
-    ALWAYS("");
-    ALWAYS("Counters:\n");
-    ALWAYS("       req: %ld", G_cnts_today.req);
-    ALWAYS("   req_dsk: %ld", G_cnts_today.req_dsk);
-    ALWAYS("   req_mob: %ld", G_cnts_today.req_mob);
-    ALWAYS("   req_bot: %ld", G_cnts_today.req_bot);
-    ALWAYS("    visits: %ld", G_cnts_today.visits);
-    ALWAYS("visits_dsk: %ld", G_cnts_today.visits_dsk);
-    ALWAYS("visits_mob: %ld", G_cnts_today.visits_mob);
-    ALWAYS("   blocked: %ld", G_cnts_today.blocked);
-    ALWAYS("");
+    M_worker = (int)(long)arg;
+
+    M_first_ci = (M_worker-1) * MAX_CONNECTIONS / G_threads;
+    M_last_ci = M_worker * MAX_CONNECTIONS / G_threads;
+
+    INF("Thread %d serves conn %d...%d", M_worker, M_first_ci, M_last_ci-1);
+
+    serve();
+
+    /* only returns on error -- let the main thread shut down */
+
+    __sync_val_compare_and_swap(&M_thread_failed, 0, M_worker);
+
+    return NULL;
 }
+#endif  /* THREADS */
 
 
 /* --------------------------------------------------------------------------
@@ -3125,17 +6857,38 @@ static void clean_up()
 {
     char    command[256];
 
+#ifndef _WIN32
+    if ( M_worker )
+        publish_counters();
+    else if ( M_shared_cnts )   /* master */
+    {
+        if ( M_workers_pid )
+            stop_workers();
+        memcpy(&G_cnts_today, &M_shared_cnts[0], sizeof(counters_t));
+    }
+#endif
+#ifdef THREADS
+    if ( M_worker && G_threads > 1 )    /* thread stopping on error -- main thread cleans up the rest */
+        return;
+#endif
+
     if ( G_log )
     {
         ALWAYS("");
         log_write_time(LOG_ALWAYS, "Cleaning up...\n");
         lib_log_memory();
-        dump_counters();
+        if ( !M_worker ) dump_counters();
+        dump_stat_hits();
     }
 
     app_done();
 
-    if ( access(M_pidfile, F_OK) != -1 )
+#ifdef GZIP
+    if ( M_deflate_ready )
+        deflateEnd(&M_deflate);
+#endif
+
+    if ( M_pidfile && access(M_pidfile, F_OK) != -1 )
     {
         if (G_log) DBG("Removing pid file...");
 #ifdef _WIN32   /* Windows */
@@ -3169,6 +6922,9 @@ static void clean_up()
 
 #ifdef _WIN32   /* Windows */
     WSACleanup();
+#else
+    if ( M_workers_pid )
+        lib_shm_delete(sizeof(counters_t)*3);
 #endif  /* _WIN32 */
 
     log_finish();
@@ -3344,6 +7100,22 @@ void eng_set_param(const char *label, const char *value)
         strcpy(G_dbPassword, value);
     else if ( PARAM("blockedIPList") )
         strcpy(G_blockedIPList, value);
+    else if ( PARAM("workers") )
+        G_workers = atoi(value);
+    else if ( PARAM("threads") )
+        G_threads = atoi(value);
+    else if ( PARAM("acceptBatch") )
+        G_acceptBatch = atoi(value);
+    else if ( PARAM("largeStatic") )
+        G_largeStatic = atol(value);
+    else if ( PARAM("largePost") )
+        G_largePost = atol(value);
+    else if ( PARAM("largePostDir") )
+        strcpy(G_largePostDir, value);
+    else if ( PARAM("compressMin") )
+        G_compressMin = atol(value);
+    else if ( PARAM("statVersioned") )
+        G_statVersioned = atoi(value);
     else if ( PARAM("test") )
         G_test = atoi(value);
 }
@@ -3376,8 +7148,15 @@ bool eng_uses_start(int ci)
 
     DBG("eng_uses_start");
 
+    /* generate sesid */
+
+    silgy_random(sesid, SESID_LEN);
+
+    USES_LOCK;
+
     if ( G_sessions == MAX_SESSIONS )
     {
+        USES_UNLOCK;
         WAR("User sessions exhausted");
         return FALSE;
     }
@@ -3395,19 +7174,25 @@ bool eng_uses_start(int ci)
         }
     }
 
-    /* generate sesid */
-
-    silgy_random(sesid, SESID_LEN);
-
-    INF("Starting new session, usi=%d, sesid [%s]", conn[ci].usi, sesid);
-
-    /* add record to uses */
+    /* add record to uses before it can be found */
 
-    strcpy(US.sesid, sesid);
     strcpy(US.ip, conn[ci].ip);
     strcpy(US.uagent, conn[ci].uagent);
     strcpy(US.referer, conn[ci].referer);
     strcpy(US.lang, conn[ci].lang);
+    US.busy = 1;    /* held by ci until reset_conn */
+    US.closing = FALSE;
+
+    /* taking sesid makes the slot busy */
+
+    strcpy(US.sesid, sesid);
+    uses_index_add(conn[ci].usi);
+
+    USES_UNLOCK;
+
+    timer_set(TIMER_USES+conn[ci].usi, G_now+USES_TIMEOUT+1);
+
+    INF("Starting new session, usi=%d, sesid [%s]", conn[ci].usi, sesid);
 
     lib_set_datetime_formats(US.lang);
 
@@ -3427,23 +7212,130 @@ bool eng_uses_start(int ci)
 
 /* --------------------------------------------------------------------------
    Close user session
+   If a request is using it, it's only taken out of the index
+   and the last eng_uses_release frees it
 -------------------------------------------------------------------------- */
 void eng_uses_close(int usi)
 {
-    eng_uses_reset(usi);
+    USES_LOCK;
+
+    if ( !uses[usi].sesid[0] || uses[usi].closing )     /* closed already */
+    {
+        USES_UNLOCK;
+        return;
+    }
+
+    uses_index_remove(usi);     /* no new request will find it */
+    uses[usi].closing = TRUE;
+
+    if ( uses[usi].busy )
+    {
+        USES_UNLOCK;
+        DBG("Session %d in use, closing deferred", usi);
+        return;
+    }
+
+    USES_UNLOCK;
+
+    uses_free(usi);
+}
+
+
+/* --------------------------------------------------------------------------
+   Free closed user session's slot
+   Nobody can hold it at this point
+-------------------------------------------------------------------------- */
+static void uses_free(int usi)
+{
     app_uses_reset(usi);
+    eng_uses_reset(usi);    /* last -- empty sesid makes the slot free */
 
+    USES_LOCK;
     G_sessions--;
+    USES_UNLOCK;
 
     DBG("%d session(s) remaining", G_sessions);
 }
 
 
+/* --------------------------------------------------------------------------
+   Find user session by sesid
+   Return usi or 0 if not found
+-------------------------------------------------------------------------- */
+int eng_uses_find(const char *sesid)
+{
+    int     usi;
+
+    if ( !sesid[0] ) return 0;
+
+    USES_LOCK;
+    usi = uses_index_find(sesid);
+    USES_UNLOCK;
+
+    return usi;
+}
+
+
+/* --------------------------------------------------------------------------
+   Find user session by sesid and hold it so it can't be freed
+   Every successful call has to be paired with eng_uses_release
+   Return usi or 0 if not found
+-------------------------------------------------------------------------- */
+int eng_uses_hold(const char *sesid)
+{
+    int     usi;
+
+    if ( !sesid[0] ) return 0;
+
+    USES_LOCK;
+    if ( (usi=uses_index_find(sesid)) )
+        ++uses[usi].busy;
+    USES_UNLOCK;
+
+    return usi;
+}
+
+
+/* --------------------------------------------------------------------------
+   Release user session held by eng_uses_start or eng_uses_hold
+   Free it if it has been closed in the meantime
+-------------------------------------------------------------------------- */
+void eng_uses_release(int usi)
+{
+    bool    last;
+
+    USES_LOCK;
+    last = (--uses[usi].busy == 0 && uses[usi].closing);
+    USES_UNLOCK;
+
+    if ( last )
+        uses_free(usi);
+}
+
+
+/* --------------------------------------------------------------------------
+   Set new sesid for user session
+-------------------------------------------------------------------------- */
+void eng_uses_set_sesid(int usi, const char *sesid)
+{
+    USES_LOCK;
+    uses_index_remove(usi);
+    strcpy(uses[usi].sesid, sesid);
+    if ( sesid[0] && !uses[usi].closing )
+        uses_index_add(usi);
+    USES_UNLOCK;
+}
+
+
 /* --------------------------------------------------------------------------
    Reset user session
 -------------------------------------------------------------------------- */
 void eng_uses_reset(int usi)
 {
+    USES_LOCK;
+    uses_index_remove(usi);
+    USES_UNLOCK;
+
     uses[usi].logged = FALSE;
     uses[usi].uid = 0;
     uses[usi].login[0] = EOS;
@@ -3454,12 +7346,12 @@ void eng_uses_reset(int usi)
     uses[usi].email_tmp[0] = EOS;
     uses[usi].name_tmp[0] = EOS;
     uses[usi].about_tmp[0] = EOS;
-    uses[usi].sesid[0] = EOS;
     uses[usi].ip[0] = EOS;
     uses[usi].uagent[0] = EOS;
     uses[usi].referer[0] = EOS;
     uses[usi].lang[0] = EOS;
     uses[usi].additional[0] = EOS;
+    uses[usi].sesid[0] = EOS;   /* last -- makes the slot free */
     uses[usi].rest_cnt = 0;
 }
 
@@ -3504,6 +7396,7 @@ void eng_async_req(int ci, const char *service, const char *data, char response,
                 if ( timeout < 0 ) timeout = 0;
                 if ( timeout == 0 || timeout > ASYNC_MAX_TIMEOUT ) timeout = ASYNC_MAX_TIMEOUT;
                 ares[j].timeout = timeout;
+                timer_set(TIMER_ASYNC+j, G_now+timeout+1);
                 break;
             }
         }
@@ -3785,7 +7678,8 @@ void silgy_add_to_static_res(const char *name, char *src)
 {
     int i;
 
-    i = first_free_stat();
+    if ( (i=first_free_stat()) == -1 )
+        return;
 
     strcpy(M_stat[i].name, name);
 
@@ -3802,9 +7696,17 @@ void silgy_add_to_static_res(const char *name, char *src)
     M_stat[i].type = get_res_type(M_stat[i].name);
     M_stat[i].modified = G_now;
 
+    stat_set_validators(i);
+#if defined(GZIP) || defined(BROTLI)
+    compress_stat(i);
+#endif
+    stat_set_headers(i);
     INF("%s (%ld bytes)", M_stat[i].name, M_stat[i].len);
 
-    strcpy(M_stat[++i].name, "-");
+    stat_index_add(i);
+
+    M_stat_cnt = i + 1;
+    strcpy(M_stat[M_stat_cnt].name, "-");
 }
 
 
@@ -3955,30 +7857,47 @@ void eng_out_check(int ci, const char *str)
 }
 
 
+#ifdef OUTCHECKREALLOC
 /* --------------------------------------------------------------------------
-   Write string to output buffer with buffer resizing if necessary
+   Resize output buffer, doubling it until len more bytes + EOS fit
 -------------------------------------------------------------------------- */
-void eng_out_check_realloc(int ci, const char *str)
+static bool out_grow(int ci, long len)
 {
-    if ( strlen(str) < conn[ci].out_data_allocated - (conn[ci].p_curr_c-conn[ci].out_data) )    /* the whole string will fit */
-    {
-        conn[ci].p_curr_c = stpcpy(conn[ci].p_curr_c, str);
-    }
-    else    /* resize output buffer and try again */
+    long    used=conn[ci].p_curr_c - conn[ci].out_data;
+    long    size=conn[ci].out_data_allocated;
+    char    *tmp;
+
+    while ( len >= size - used )
+        size *= 2;
+
+    if ( NULL == (tmp=(char*)realloc(conn[ci].out_data, size)) )
     {
-        long used = conn[ci].p_curr_c - conn[ci].out_data;
-        char *tmp = (char*)realloc(conn[ci].out_data, conn[ci].out_data_allocated*2);
-        if ( !tmp )
-        {
-            ERR("Couldn't reallocate output buffer for ci=%d, tried %ld bytes", ci, conn[ci].out_data_allocated*2);
-            return;
-        }
-        conn[ci].out_data = tmp;
-        conn[ci].out_data_allocated = conn[ci].out_data_allocated * 2;
-        conn[ci].p_curr_c = conn[ci].out_data + used;
-        INF("Reallocated output buffer for ci=%d, new size = %ld bytes", ci, conn[ci].out_data_allocated);
-        eng_out_check_realloc(ci, str);     /* call itself! */
+        ERR("Couldn't reallocate output buffer for ci=%d, tried %ld bytes", ci, size);
+        return FALSE;
     }
+
+    conn[ci].out_data = tmp;
+    conn[ci].out_data_allocated = size;
+    conn[ci].p_curr_c = conn[ci].out_data + used;
+
+    INF("Reallocated output buffer for ci=%d, new size = %ld bytes", ci, size);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Write string to output buffer with buffer resizing if necessary
+-------------------------------------------------------------------------- */
+void eng_out_check_realloc(int ci, const char *str)
+{
+    long    len=strlen(str);
+
+    if ( len >= conn[ci].out_data_allocated - (conn[ci].p_curr_c-conn[ci].out_data) && !out_grow(ci, len) )
+        return;
+
+    memcpy(conn[ci].p_curr_c, str, len+1);
+    conn[ci].p_curr_c += len;
 }
 
 
@@ -3987,24 +7906,57 @@ void eng_out_check_realloc(int ci, const char *str)
 -------------------------------------------------------------------------- */
 void eng_out_check_realloc_bin(int ci, const char *data, long len)
 {
-    if ( len < conn[ci].out_data_allocated - (conn[ci].p_curr_c-conn[ci].out_data) )    /* the whole data will fit */
-    {
-        memcpy(conn[ci].p_curr_c, data, len);
-        conn[ci].p_curr_c += len;
-    }
-    else    /* resize output buffer and try again */
+    if ( len >= conn[ci].out_data_allocated - (conn[ci].p_curr_c-conn[ci].out_data) && !out_grow(ci, len) )
+        return;
+
+    memcpy(conn[ci].p_curr_c, data, len);
+    conn[ci].p_curr_c += len;
+}
+#endif  /* OUTCHECKREALLOC */
+
+
+/* --------------------------------------------------------------------------
+   Write formatted string straight to output buffer
+   With OUTCHECKREALLOC buffer is resized if necessary,
+   with OUTCHECK output is cut at the end of buffer
+-------------------------------------------------------------------------- */
+void eng_out_fmt(int ci, const char *fmt, ...)
+{
+    va_list plist;
+    int     len;
+#ifdef OUTFAST
+    va_start(plist, fmt);
+    len = vsprintf(conn[ci].p_curr_c, fmt, plist);
+    va_end(plist);
+#else
+    long    available;
+#ifdef OUTCHECK
+    available = OUT_BUFSIZE - (conn[ci].p_curr_c - conn[ci].out_data);
+#else
+    available = conn[ci].out_data_allocated - (conn[ci].p_curr_c - conn[ci].out_data);
+#endif
+    va_start(plist, fmt);
+    len = vsnprintf(conn[ci].p_curr_c, available, fmt, plist);
+    va_end(plist);
+
+    if ( len >= available )
     {
-        long used = conn[ci].p_curr_c - conn[ci].out_data;
-        char *tmp = (char*)realloc(conn[ci].out_data, conn[ci].out_data_allocated*2);
-        if ( !tmp )
+#ifdef OUTCHECK
+        len = available - 1;    /* WARNING: no UTF-8 checking is done here! */
+#else
+        if ( !out_grow(ci, len) )
         {
-            ERR("Couldn't reallocate output buffer for ci=%d, tried %ld bytes", ci, conn[ci].out_data_allocated*2);
+            *conn[ci].p_curr_c = EOS;
             return;
         }
-        conn[ci].out_data = tmp;
-        conn[ci].out_data_allocated = conn[ci].out_data_allocated * 2;
-        conn[ci].p_curr_c = conn[ci].out_data + used;
-        INF("Reallocated output buffer for ci=%d, new size = %ld bytes", ci, conn[ci].out_data_allocated);
-        eng_out_check_realloc_bin(ci, data, len);       /* call itself! */
+
+        va_start(plist, fmt);   /* once more, now it fits */
+        len = vsprintf(conn[ci].p_curr_c, fmt, plist);
+        va_end(plist);
+#endif
     }
+#endif  /* OUTFAST */
+
+    if ( len > 0 )
+        conn[ci].p_curr_c += len;
 }
@@ -19,10 +19,10 @@ char        G_logLevel=0;           /* log level */
 char        G_appdir[256]=".";      /* application root dir */
 char        G_test=0;               /* test run */
 int         G_pid=0;                /* pid */
-time_t      G_now=0;                /* current time (GMT) */
-struct tm   *G_ptm={0};             /* human readable current time */
-char        G_dt[20]="";            /* datetime for database or log (YYYY-MM-DD hh:mm:ss) */
-char        G_tmp[TMP_BUFSIZE];     /* temporary string buffer */
+THREAD_LOCAL time_t G_now=0;       /* current time (GMT) */
+THREAD_LOCAL struct tm *G_ptm={0};  /* human readable current time */
+THREAD_LOCAL char G_dt[20]="";      /* datetime for database or log (YYYY-MM-DD hh:mm:ss) */
+THREAD_LOCAL char G_tmp[TMP_BUFSIZE];   /* temporary string buffer */
 char        *G_shm_segptr=NULL;     /* SHM pointer */
 
 
@@ -30,22 +30,40 @@ char        *G_shm_segptr=NULL;     /* SHM pointer */
 
 static char *M_conf=NULL;           /* config file content */
 
-static char M_df=0;                 /* date format */
-static char M_tsep=' ';             /* thousand separator */
-static char M_dsep='.';             /* decimal separator */
+static THREAD_LOCAL char M_df=0;   /* date format */
+static THREAD_LOCAL char M_tsep=' ';    /* thousand separator */
+static THREAD_LOCAL char M_dsep='.';    /* decimal separator */
 
 static int  M_shmid;                /* SHM id */
 
+#ifdef THREADS
+static pthread_mutex_t M_log_lock=PTHREAD_MUTEX_INITIALIZER;   /* G_log writes and swap */
+#define LOG_LOCK    pthread_mutex_lock(&M_log_lock)
+#define LOG_UNLOCK  pthread_mutex_unlock(&M_log_lock)
+#else
+#define LOG_LOCK
+#define LOG_UNLOCK
+#endif
+
 //static uintptr_t M_jsons[JSON_MAX_JSONS];
-static void *M_jsons[JSON_MAX_JSONS];   /* array of pointers */
-static int M_jsons_cnt=0;
+static THREAD_LOCAL void *M_jsons[JSON_MAX_JSONS];  /* array of pointers */
+static THREAD_LOCAL int M_jsons_cnt=0;
+
+typedef struct {                    /* silgy_minify() source with comments state */
+    const char *src;
+    long    i;
+    bool    opensq;                 /* single quote */
+    bool    opendq;                 /* double quote */
+    bool    openco;                 /* comment */
+    bool    opensc;                 /* star comment */
+    bool    done;
+} minify_src_t;
 
 static char *uri_decode(char *src, int srclen, char *dest, int maxlen);
 static char *uri_decode_html_esc(char *src, int srclen, char *dest, int maxlen);
 static char *uri_decode_sql_esc(char *src, int srclen, char *dest, int maxlen);
 static int xctod(int c);
-static void minify_1(char *dest, const char *src);
-static int minify_2(char *dest, const char *src);
+static char minify_next(minify_src_t *ms);
 static void get_byteorder32(void);
 static void get_byteorder64(void);
 
@@ -194,7 +212,7 @@ struct rusage usage;
 ---------------------------------------------------------------------------*/
 char *lib_filter_strict(const char *src)
 {
-static char dst[1024];
+static THREAD_LOCAL char dst[1024];
     int     i=0, j=0;
 
     while ( src[i] && j<1023 )
@@ -220,7 +238,7 @@ static char dst[1024];
 -------------------------------------------------------------------------- */
 char *lib_add_spaces(const char *src, int len)
 {
-static char ret[1024];
+static THREAD_LOCAL char ret[1024];
     int     src_len;
     int     spaces;
     int     i;
@@ -247,7 +265,7 @@ static char ret[1024];
 -------------------------------------------------------------------------- */
 char *lib_add_lspaces(const char *src, int len)
 {
-static char ret[1024];
+static THREAD_LOCAL char ret[1024];
     int     src_len;
     int     spaces;
     int     i;
@@ -602,10 +620,10 @@ struct tm   tm;
 -------------------------------------------------------------------------- */
 char *time_epoch2http(time_t epoch)
 {
-static char str[32];
+static THREAD_LOCAL char str[32];
 struct tm   *ptm;
 
-    ptm = gmtime(&epoch);
+    ptm = lib_gmtime(&epoch);
 #ifdef _WIN32   /* Windows */
     strftime(str, 32, "%a, %d %b %Y %H:%M:%S GMT", ptm);
 #else
@@ -616,6 +634,21 @@ struct tm   *ptm;
 }
 
 
+/* --------------------------------------------------------------------------
+   gmtime() that doesn't share its buffer between threads
+-------------------------------------------------------------------------- */
+struct tm *lib_gmtime(const time_t *epoch)
+{
+#ifdef THREADS
+static THREAD_LOCAL struct tm tm;
+
+    return gmtime_r(epoch, &tm);
+#else
+    return gmtime(epoch);
+#endif
+}
+
+
 /* --------------------------------------------------------------------------
    Set decimal & thousand separator
 ---------------------------------------------------------------------------*/
@@ -851,7 +884,7 @@ const char  sep=':';
 ---------------------------------------------------------------------------*/
 char *fmt_date(short year, short month, short day)
 {
-static char date[16];
+static THREAD_LOCAL char date[16];
 
     if ( M_df == 1 )
         sprintf(date, "%02d/%02d/%d", month, day, year);
@@ -872,7 +905,7 @@ static char date[16];
 bool get_qs_param(int ci, const char *fieldname, char *retbuf)
 {
 #ifndef ASYNC_SERVICE
-static char buf[MAX_URI_VAL_LEN*2+1];
+static THREAD_LOCAL char buf[MAX_URI_VAL_LEN*2+1];
 
     if ( get_qs_param_raw(ci, fieldname, buf, MAX_URI_VAL_LEN*2) )
     {
@@ -891,7 +924,7 @@ static char buf[MAX_URI_VAL_LEN*2+1];
 bool get_qs_param_html_esc(int ci, const char *fieldname, char *retbuf)
 {
 #ifndef ASYNC_SERVICE
-static char buf[MAX_URI_VAL_LEN*2+1];
+static THREAD_LOCAL char buf[MAX_URI_VAL_LEN*2+1];
 
     if ( get_qs_param_raw(ci, fieldname, buf, MAX_URI_VAL_LEN*2) )
     {
@@ -910,7 +943,7 @@ static char buf[MAX_URI_VAL_LEN*2+1];
 bool get_qs_param_sql_esc(int ci, const char *fieldname, char *retbuf)
 {
 #ifndef ASYNC_SERVICE
-static char buf[MAX_URI_VAL_LEN*2+1];
+static THREAD_LOCAL char buf[MAX_URI_VAL_LEN*2+1];
 
     if ( get_qs_param_raw(ci, fieldname, buf, MAX_URI_VAL_LEN*2) )
     {
@@ -1010,7 +1043,7 @@ bool get_qs_param_raw(int ci, const char *fieldname, char *retbuf, int maxlen)
 bool get_qs_param_long(int ci, const char *fieldname, char *retbuf)
 {
 #ifndef ASYNC_SERVICE
-static char buf[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char buf[MAX_LONG_URI_VAL_LEN+1];
 
     if ( get_qs_param_raw(ci, fieldname, buf, MAX_LONG_URI_VAL_LEN) )
     {
@@ -1537,7 +1570,7 @@ static int xctod(int c)
 -------------------------------------------------------------------------- */
 char *silgy_sql_esc(const char *str)
 {
-static char dst[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char dst[MAX_LONG_URI_VAL_LEN+1];
     int     i=0, j=0;
 
     while ( str[i] )
@@ -1575,7 +1608,7 @@ static char dst[MAX_LONG_URI_VAL_LEN+1];
 -------------------------------------------------------------------------- */
 char *silgy_html_esc(const char *str)
 {
-static char dst[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char dst[MAX_LONG_URI_VAL_LEN+1];
     int     i=0, j=0;
 
     while ( str[i] )
@@ -1651,7 +1684,7 @@ static char dst[MAX_LONG_URI_VAL_LEN+1];
 -------------------------------------------------------------------------- */
 char *silgy_html_unesc(const char *str)
 {
-static char dst[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char dst[MAX_LONG_URI_VAL_LEN+1];
     int     i=0, j=0;
 
     while ( str[i] )
@@ -1741,7 +1774,7 @@ static char dst[MAX_LONG_URI_VAL_LEN+1];
 ---------------------------------------------------------------------------*/
 char *uri_encode(const char *str)
 {
-static char uri_encode[1024];
+static THREAD_LOCAL char uri_encode[1024];
     int     i;
 
     for ( i=0; str[i] && i<1023; ++i )
@@ -1763,7 +1796,7 @@ static char uri_encode[1024];
 ---------------------------------------------------------------------------*/
 char *upper(const char *str)
 {
-static char upper[1024];
+static THREAD_LOCAL char upper[1024];
     int     i;
 
     for ( i=0; str[i] && i<1023; ++i )
@@ -1840,20 +1873,124 @@ char *nospaces(char *dst, const char *src)
 void silgy_random(char *dest, int len)
 {
 const char  *chars="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-static unsigned long req=0;
+static THREAD_LOCAL unsigned long req=0;
     int     i;
+#ifdef THREADS
+    /* rand() state is shared between threads -- they could end up with the same string */
+    unsigned int seed=(G_now-1520000000)+G_pid+req+(unsigned long)pthread_self();
+
+    ++req;
 
+    for ( i=0; i<len; ++i )
+        dest[i] = chars[rand_r(&seed) % 62];
+#else
     srand((G_now-1520000000)+G_pid+req);
 
     ++req;
 
     for ( i=0; i<len; ++i )
         dest[i] = chars[rand() % 62];
+#endif
 
     dest[i] = EOS;
 }
 
 
+/* --------------------------------------------------------------------------
+   64-bit content hash (xxHash64, seed 0)
+   Fast enough to run over the whole response
+-------------------------------------------------------------------------- */
+#define XXH_P1  11400714785074694791ULL
+#define XXH_P2  14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+#define XXH_ROTL(x, r)  (((x) << (r)) | ((x) >> (64-(r))))
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = XXH_ROTL(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t lib_hash64(const void *data, long len)
+{
+    const unsigned char *p=(const unsigned char*)data;
+    const unsigned char *end=p + len;
+    uint64_t    v1, v2, v3, v4, h;
+    uint64_t    k;
+    uint32_t    k32;
+
+    if ( len >= 32 )
+    {
+        v1 = XXH_P1 + XXH_P2;
+        v2 = XXH_P2;
+        v3 = 0;
+        v4 = 0 - XXH_P1;
+
+        do
+        {
+            memcpy(&k, p, 8); v1 = xxh_round(v1, k); p += 8;
+            memcpy(&k, p, 8); v2 = xxh_round(v2, k); p += 8;
+            memcpy(&k, p, 8); v3 = xxh_round(v3, k); p += 8;
+            memcpy(&k, p, 8); v4 = xxh_round(v4, k); p += 8;
+        }
+        while ( p <= end - 32 );
+
+        h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else
+    {
+        h = XXH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    while ( p + 8 <= end )
+    {
+        memcpy(&k, p, 8);
+        h ^= xxh_round(0, k);
+        h = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+
+    if ( p + 4 <= end )
+    {
+        memcpy(&k32, p, 4);
+        h ^= (uint64_t)k32 * XXH_P1;
+        h = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+
+    while ( p < end )
+    {
+        h ^= (*p) * XXH_P5;
+        h = XXH_ROTL(h, 11) * XXH_P1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
 /* --------------------------------------------------------------------------
   sleep for n miliseconds
   n must be less than 1 second (< 1000)!
@@ -1957,7 +2094,7 @@ static void json_to_string(char *dst, JSON *json)
 -------------------------------------------------------------------------- */
 char *lib_json_to_string(JSON *json)
 {
-static char dst[JSON_BUFSIZE];
+static THREAD_LOCAL char dst[JSON_BUFSIZE];
     char    *p=dst;
     int     i;
 
@@ -2003,7 +2140,7 @@ static char dst[JSON_BUFSIZE];
 -------------------------------------------------------------------------- */
 static char *get_json_elem(JSON *json, int i)
 {
-static char retbuf[1024];
+static THREAD_LOCAL char retbuf[1024];
 
 /*    if ( US.rest_fld[JSON_MAX_ELEMS*level+i].type == JSON_STRING )
     {
@@ -2302,7 +2439,7 @@ bool lib_json_get(JSON *json, const char *name, char *str_value, long *num_value
 -------------------------------------------------------------------------- */
 char *lib_json_get_str(JSON *json, const char *name)
 {
-static char dst[256];
+static THREAD_LOCAL char dst[256];
     int     i;
 
     for ( i=0; i<json->cnt; ++i )
@@ -2594,181 +2731,232 @@ bool sendemail(int ci, const char *to, const char *subject, const char *message)
 }
 
 
+#define MIN_WS      1       /* white space */
+#define MIN_WSTART  2       /* can start a word */
+#define MIN_WCHAR   4       /* can be in a word */
+#define MIN_SPEC    8       /* EOS, quote or slash -- needs minify_next() */
+
+static const unsigned char M_minify_cls[256]={
+    8,0,0,0,0,0,0,0,0,1,1,0,0,1,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    1,0,8,0,0,0,6,8,0,0,0,0,0,0,0,8,
+    4,4,4,4,4,4,4,4,4,4,0,0,0,0,0,0,
+    0,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+    6,6,6,6,6,6,6,6,6,6,6,0,0,0,0,4,
+    0,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+    6,6,6,6,6,6,6,6,6,6,6,0,6,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+/* most characters can't start or end a comment -- take them without a call */
+
+#define MINIFY_NEXT(ms) ((M_minify_cls[(unsigned char)ms.src[ms.i]] & MIN_SPEC) ? minify_next(&ms) : ms.src[ms.i++])
+
+
 /* --------------------------------------------------------------------------
-   Minify CSS/JS -- new version
+   Minify CSS/JS -- single pass version
    remove all white spaces and new lines unless in quotes
    also remove // style comments
    add a space after some keywords
+   Comments are dropped as characters are pulled from src (minify_next),
+   white spaces are dropped as they're written to dest -- no temp buffer
+   dest can't overlap src; keyword spaces can make it longer than src,
+   so dest needs room for src length + 1/3 + EOS
    return new length
 -------------------------------------------------------------------------- */
 int silgy_minify(char *dest, const char *src)
 {
-static char temp[4194304];
-
-    minify_1(temp, src);
-    return minify_2(dest, temp);
-}
-
-
-/* --------------------------------------------------------------------------
-   First pass -- only remove comments
--------------------------------------------------------------------------- */
-static void minify_1(char *dest, const char *src)
-{
-    int     len;
-    int     i;
+    minify_src_t ms={0};
+    char    prev=EOS;           /* previous character, already without comments */
+    char    cur;
+    char    next;
     int     j=0;
     bool    opensq=FALSE;       /* single quote */
     bool    opendq=FALSE;       /* double quote */
-    bool    openco=FALSE;       /* comment */
-    bool    opensc=FALSE;       /* star comment */
+    bool    openbr=FALSE;       /* curly braces */
+    bool    openwo=FALSE;       /* word */
+    bool    opencc=FALSE;       /* colon */
+    bool    skip_ws=FALSE;      /* skip white spaces */
+    char    word[16];           /* only short ones can be keywords */
+    int     wi=0;               /* word index */
 
-    len = strlen(src);
+    ms.src = src;
 
-    for ( i=0; i<len; ++i )
+    cur = MINIFY_NEXT(ms);
+    next = cur ? MINIFY_NEXT(ms) : EOS;
+
+    while ( cur )
     {
-        if ( !openco && !opensc && !opensq && src[i]=='"' && (i==0 || (i>0 && src[i-1]!='\\')) )
-        {
-            if ( !opendq )
-                opendq = TRUE;
-            else
-                opendq = FALSE;
-        }
-        else if ( !openco && !opensc && !opendq && src[i]=='\'' )
+        if ( !opensq && cur=='"' && prev!='\\' )
         {
-            if ( !opensq )
-                opensq = TRUE;
-            else
-                opensq = FALSE;
+            opendq = !opendq;
         }
-        else if ( !opensq && !opendq && !openco && !opensc && src[i]=='/' && src[i+1] == '/' )
+        else if ( !opendq && cur=='\'' )
         {
-            openco = TRUE;
+            opensq = !opensq;
         }
-        else if ( !opensq && !opendq && !openco && !opensc && src[i]=='/' && src[i+1] == '*' )
+        else if ( !opensq && !opendq )
         {
-            opensc = TRUE;
+            if ( !openbr && cur=='{' )
+            {
+                openbr = TRUE;
+                openwo = FALSE;
+                wi = 0;
+                skip_ws = TRUE;
+            }
+            else if ( openbr && cur=='}' )
+            {
+                openbr = FALSE;
+                openwo = FALSE;
+                wi = 0;
+                skip_ws = TRUE;
+            }
+            else if ( openbr && !opencc && cur==':' )
+            {
+                opencc = TRUE;
+                openwo = FALSE;
+                wi = 0;
+                skip_ws = TRUE;
+            }
+            else if ( opencc && cur==';' )
+            {
+                opencc = FALSE;
+                openwo = FALSE;
+                wi = 0;
+                skip_ws = TRUE;
+            }
+            else if ( !opencc && !openwo && (M_minify_cls[(unsigned char)cur] & MIN_WSTART) )   /* word is starting */
+            {
+                openwo = TRUE;
+            }
+            else if ( openwo && !(M_minify_cls[(unsigned char)cur] & MIN_WCHAR) )   /* end of word */
+            {
+                if ( wi < 9 )
+                {
+                    word[wi] = EOS;
+                    if ( 0==strcmp(word, "var")
+                            || (0==strcmp(word, "function") && cur!='(')
+                            || (0==strcmp(word, "else") && cur!='{')
+                            || 0==strcmp(word, "new")
+                            || (0==strcmp(word, "return") && cur!=';')
+                            || 0==strcmp(word, "||")
+                            || 0==strcmp(word, "&&") )
+                        dest[j++] = ' ';
+                }
+                openwo = FALSE;
+                wi = 0;
+                skip_ws = TRUE;
+            }
         }
-        else if ( openco && src[i]=='\n' )
+
+        if ( opensq || opendq
+                || next == '|' || next == '&'
+                || !(M_minify_cls[(unsigned char)cur] & MIN_WS)
+                || opencc )
+            dest[j++] = cur;
+
+        if ( openwo )
         {
-            openco = FALSE;
+            if ( wi < 9 ) word[wi] = cur;
+            ++wi;
         }
-        else if ( opensc && src[i]=='*' && src[i+1]=='/' )
+
+        if ( skip_ws )
         {
-            opensc = FALSE;
-            i += 2;
+            while ( M_minify_cls[(unsigned char)next] & MIN_WS )
+            {
+                cur = next;
+                next = MINIFY_NEXT(ms);
+            }
+            skip_ws = FALSE;
         }
 
-        if ( !openco && !opensc )       /* unless it's a comment ... */
-            dest[j++] = src[i];
+        prev = cur;
+        cur = next;
+        next = cur ? MINIFY_NEXT(ms) : EOS;
     }
 
     dest[j] = EOS;
+
+    return j;
 }
 
 
 /* --------------------------------------------------------------------------
-   return new length
+   Return the next src character outside comments or EOS at the end
 -------------------------------------------------------------------------- */
-static int minify_2(char *dest, const char *src)
+static char minify_next(minify_src_t *ms)
 {
-    int     len;
-    int     i;
-    int     j=0;
-    bool    opensq=FALSE;       /* single quote */
-    bool    opendq=FALSE;       /* double quote */
-    bool    openbr=FALSE;       /* curly braces */
-    bool    openwo=FALSE;       /* word */
-    bool    opencc=FALSE;       /* colon */
-    bool    skip_ws=FALSE;      /* skip white spaces */
-    char    word[256]="";
-    int     wi=0;               /* word index */
-
-    len = strlen(src);
+    const char *src=ms->src;
+    long    i;
+    char    c;
 
-    for ( i=0; i<len; ++i )
+    while ( !ms->done && (c=src[i=ms->i]) )
     {
-        if ( !opensq && src[i]=='"' && (i==0 || (i>0 && src[i-1]!='\\')) )
+        /* fast paths -- most characters don't change anything */
+
+        if ( ms->openco )
         {
-            if ( !opendq )
-                opendq = TRUE;
-            else
-                opendq = FALSE;
+            while ( src[i] && src[i] != '\n' ) ++i;
+            if ( !src[i] ) break;
         }
-        else if ( !opendq && src[i]=='\'' )
+        else if ( ms->opensc )
         {
-            if ( !opensq )
-                opensq = TRUE;
-            else
-                opensq = FALSE;
+            while ( src[i] && (src[i] != '*' || src[i+1] != '/') ) ++i;
+            if ( !src[i] ) break;
+        }
+        else if ( c != '"' && c != '\'' && c != '/' )
+        {
+            ms->i = i + 1;
+            return c;
         }
-        else if ( !opensq && !opendq && !openbr && src[i]=='{' )
+
+        if ( !ms->openco && !ms->opensc && !ms->opensq && src[i]=='"' && (i==0 || src[i-1]!='\\') )
         {
-            openbr = TRUE;
-            openwo = FALSE;
-            wi = 0;
-            skip_ws = TRUE;
+            ms->opendq = !ms->opendq;
         }
-        else if ( !opensq && !opendq && openbr && src[i]=='}' )
+        else if ( !ms->openco && !ms->opensc && !ms->opendq && src[i]=='\'' )
         {
-            openbr = FALSE;
-            openwo = FALSE;
-            wi = 0;
-            skip_ws = TRUE;
+            ms->opensq = !ms->opensq;
         }
-        else if ( !opensq && !opendq && openbr && !opencc && src[i]==':' )
+        else if ( !ms->opensq && !ms->opendq && !ms->openco && !ms->opensc && src[i]=='/' && src[i+1] == '/' )
         {
-            opencc = TRUE;
-            openwo = FALSE;
-            wi = 0;
-            skip_ws = TRUE;
+            ms->openco = TRUE;
         }
-        else if ( !opensq && !opendq && opencc && src[i]==';' )
+        else if ( !ms->opensq && !ms->opendq && !ms->openco && !ms->opensc && src[i]=='/' && src[i+1] == '*' )
         {
-            opencc = FALSE;
-            openwo = FALSE;
-            wi = 0;
-            skip_ws = TRUE;
+            ms->opensc = TRUE;
         }
-        else if ( !opensq && !opendq && !opencc && !openwo && (isalpha(src[i]) || src[i]=='|' || src[i]=='&') ) /* word is starting */
+        else if ( ms->openco && src[i]=='\n' )
         {
-            openwo = TRUE;
+            ms->openco = FALSE;
         }
-        else if ( !opensq && !opendq && openwo && !isalnum(src[i]) && src[i]!='_' && src[i]!='|' && src[i]!='&' )   /* end of word */
+        else if ( ms->opensc && src[i]=='*' && src[i+1]=='/' )
         {
-            word[wi] = EOS;
-            if ( 0==strcmp(word, "var")
-                    || (0==strcmp(word, "function") && src[i]!='(')
-                    || (0==strcmp(word, "else") && src[i]!='{')
-                    || 0==strcmp(word, "new")
-                    || (0==strcmp(word, "return") && src[i]!=';')
-                    || 0==strcmp(word, "||")
-                    || 0==strcmp(word, "&&") )
-                dest[j++] = ' ';
-            openwo = FALSE;
-            wi = 0;
-            skip_ws = TRUE;
+            ms->opensc = FALSE;
+            i += 2;     /* the one after comment goes as it is */
+            if ( !src[i] ) ms->done = TRUE;
         }
 
-        if ( opensq || opendq
-                || src[i+1] == '|' || src[i+1] == '&'
-                || (src[i] != ' ' && src[i] != '\t' && src[i] != '\n' && src[i] != '\r')
-                || opencc )
-            dest[j++] = src[i];
+        ms->i = i + 1;
 
-        if ( openwo )
-            word[wi++] = src[i];
-
-        if ( skip_ws )
+        if ( !ms->openco && !ms->opensc )   /* unless it's a comment ... */
         {
-            while ( src[i+1] && (src[i+1]==' ' || src[i+1]=='\t' || src[i+1]=='\n' || src[i+1]=='\r') ) ++i;
-            skip_ws = FALSE;
+            c = src[i];
+            return c;
         }
     }
 
-    dest[j] = EOS;
+    ms->done = TRUE;
 
-    return j;
+    return EOS;
 }
 
 
@@ -2819,11 +3007,11 @@ void date_inc(char *str, int days, int *dow)
 
     tnew = told + 3600*24*days;
 
-    G_ptm = gmtime(&tnew);
+    G_ptm = lib_gmtime(&tnew);
     sprintf(str, "%d-%02d-%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday);
     *dow = G_ptm->tm_wday;
 
-    G_ptm = gmtime(&G_now); /* set it back */
+    G_ptm = lib_gmtime(&G_now); /* set it back */
 
 }
 
@@ -3156,12 +3344,15 @@ void lib_shm_delete(long bytes)
 
 /* --------------------------------------------------------------------------
   start a log. uses global G_log as file handler
+  In THREADS mode the new file replaces G_log under lock,
+  so the caller can close the previous one straight away
 -------------------------------------------------------------------------- */
 bool log_start(const char *prefix, bool test)
 {
     char    fprefix[64]="";     /* formatted prefix */
     char    fname[512];         /* file name */
     char    ffname[512];        /* full file name */
+    FILE    *log;
 
     if ( prefix && prefix[0] )
         sprintf(fprefix, "%s_", prefix);
@@ -3173,7 +3364,7 @@ bool log_start(const char *prefix, bool test)
     else
         sprintf(ffname, "%s.log", fname);
 
-    if ( NULL == (G_log=fopen(ffname, "a")) )
+    if ( NULL == (log=fopen(ffname, "a")) )
     {
         /* try in current directory */
 
@@ -3184,22 +3375,29 @@ bool log_start(const char *prefix, bool test)
         else
             sprintf(ffname, "%s.log", fname);
 
-        if ( NULL == (G_log=fopen(ffname, "a")) )
+        if ( NULL == (log=fopen(ffname, "a")) )
         {
             printf("ERROR: Couldn't open log file. Make sure SILGYDIR is defined in your environment and there is a `logs' directory there.\n");
             return FALSE;
         }
     }
 
-    if ( fprintf(G_log, "----------------------------------------------------------------------------------------------\n") < 0 )
+    if ( fprintf(log, "----------------------------------------------------------------------------------------------\n") < 0 )
     {
         perror("fprintf");
+        fclose(log);
         return FALSE;
     }
 
+    LOG_LOCK;
+    G_log = log;
+    LOG_UNLOCK;
+
     ALWAYS(" %s  Starting %s's log. Server version: %s, app version: %s", G_dt, APP_WEBSITE, WEB_SERVER_VERSION, APP_VERSION);
 
+    LOG_LOCK;
     fprintf(G_log, "----------------------------------------------------------------------------------------------\n\n");
+    LOG_UNLOCK;
 
     return TRUE;
 }
@@ -3211,11 +3409,19 @@ bool log_start(const char *prefix, bool test)
 void log_write_time(int level, const char *message, ...)
 {
     va_list     plist;
-static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
+static THREAD_LOCAL char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 
     if ( level > G_logLevel ) return;
 
-    /* output timestamp */
+    /* compile message with arguments into buffer */
+
+    va_start(plist, message);
+    vsprintf(buffer, message, plist);
+    va_end(plist);
+
+    /* write to log file with timestamp */
+
+    LOG_LOCK;
 
     fprintf(G_log, "[%s] ", G_dt);
 
@@ -3224,14 +3430,6 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
     else if ( LOG_WAR == level )
         fprintf(G_log, "WARNING: ");
 
-    /* compile message with arguments into buffer */
-
-    va_start(plist, message);
-    vsprintf(buffer, message, plist);
-    va_end(plist);
-
-    /* write to log file */
-
     fprintf(G_log, "%s\n", buffer);
 
 #ifdef DUMP
@@ -3239,6 +3437,8 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 #else
     if ( G_logLevel >= LOG_DBG ) fflush(G_log);
 #endif
+
+    LOG_UNLOCK;
 }
 
 
@@ -3248,15 +3448,10 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 void log_write(int level, const char *message, ...)
 {
     va_list     plist;
-static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
+static THREAD_LOCAL char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 
     if ( level > G_logLevel ) return;
 
-    if ( LOG_ERR == level )
-        fprintf(G_log, "ERROR: ");
-    else if ( LOG_WAR == level )
-        fprintf(G_log, "WARNING: ");
-
     /* compile message with arguments into buffer */
 
     va_start(plist, message);
@@ -3265,6 +3460,13 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 
     /* write to log file */
 
+    LOG_LOCK;
+
+    if ( LOG_ERR == level )
+        fprintf(G_log, "ERROR: ");
+    else if ( LOG_WAR == level )
+        fprintf(G_log, "WARNING: ");
+
     fprintf(G_log, "%s\n", buffer);
 
 #ifdef DUMP
@@ -3272,6 +3474,8 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 #else
     if ( G_logLevel >= LOG_DBG ) fflush(G_log);
 #endif
+
+    LOG_UNLOCK;
 }
 
 
@@ -3281,7 +3485,7 @@ static char     buffer[MAX_LOG_STR_LEN+1+64];   /* don't use stack */
 -------------------------------------------------------------------------- */
 void log_long(const char *str, long len, const char *desc)
 {
-static char log_buffer[MAX_LOG_STR_LEN+1];
+static THREAD_LOCAL char log_buffer[MAX_LOG_STR_LEN+1];
 
     if ( len < MAX_LOG_STR_LEN-50 )
         DBG("%s:\n\n[%s]\n", desc, str);
@@ -3294,6 +3498,17 @@ static char log_buffer[MAX_LOG_STR_LEN+1];
 }
 
 
+/* --------------------------------------------------------------------------
+   Flush log. uses global G_log as file handler
+-------------------------------------------------------------------------- */
+void log_flush()
+{
+    LOG_LOCK;
+    fflush(G_log);
+    LOG_UNLOCK;
+}
+
+
 /* --------------------------------------------------------------------------
    Close log. uses global G_log as file handler
 -------------------------------------------------------------------------- */
@@ -3311,7 +3526,7 @@ void log_finish()
 -------------------------------------------------------------------------- */
 char *lib_convert(char *src, const char *cp_from, const char *cp_to)
 {
-static char dst[1024];
+static THREAD_LOCAL char dst[1024];
 
     iconv_t cd = iconv_open(cp_to, cp_from);
 
@@ -3683,7 +3898,7 @@ static void SHA1_Transform2(uint32_t state[5], const uint8_t buffer[64])
     CHAR64LONG16* block;
 
 #ifdef SHA1HANDSOFF
-    static uint8_t workspace[64];
+    static THREAD_LOCAL uint8_t workspace[64];
     block = (CHAR64LONG16*)workspace;
     memcpy(block, buffer, 64);
 #else
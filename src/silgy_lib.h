@@ -118,6 +118,7 @@ extern "C" {
     time_t time_http2epoch(const char *str);
     time_t time_db2epoch(const char *str);
     char *time_epoch2http(time_t epoch);
+    struct tm *lib_gmtime(const time_t *epoch);
     void lib_set_datetime_formats(const char *lang);
     void amt(char *stramt, long in_amt);
     void amtd(char *stramt, double in_amt);
@@ -173,6 +174,7 @@ extern "C" {
     void log_write_time(int level, const char *message, ...);
     void log_write(int level, const char *message, ...);
     void log_long(const char *str, long len, const char *desc);
+    void log_flush(void);
     void log_finish(void);
     char *lib_convert(char *src, const char *cp_from, const char *cp_to);
 
@@ -215,6 +217,8 @@ void libSHA1(unsigned char *ptr, unsigned int size, unsigned char *outbuf);
 
 void digest_to_hex(const uint8_t digest[SHA1_DIGEST_SIZE], char *output);
 
+uint64_t lib_hash64(const void *data, long len);
+
 
 #ifdef __cplusplus
 }
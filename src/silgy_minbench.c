@@ -0,0 +1,445 @@
+/* --------------------------------------------------------------------------
+   Compare the old two-pass minifier with the current silgy_minify
+   Runs both over all CSS and JS files in a directory and its subdirectories
+   (resmin by default) and prints throughput and output size
+   Jurek Muszynski
+-------------------------------------------------------------------------- */
+
+#include "silgy.h"
+
+
+#define DEF_ITERATIONS      20
+#define OLD_MINIFY_MAX      4194304     /* old version's temp buffer size */
+
+
+typedef struct {
+    long    len;
+    long    old_len;
+    long    new_len;
+    double  old_time;
+    double  new_time;
+} bench_res_t;
+
+
+static bench_res_t M_total={0};
+static int M_files=0;
+static int M_differ=0;
+static int M_iterations=DEF_ITERATIONS;
+
+
+static bool bench_dir(const char *path);
+static bool bench_file(const char *namewpath);
+static double elapsed(struct timespec *start);
+static double mbps(long len, double secs);
+static int old_minify(char *dest, const char *src);
+static void old_minify_1(char *dest, const char *src);
+static int old_minify_2(char *dest, const char *src);
+
+
+/* --------------------------------------------------------------------------
+   main
+-------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+    char    path[1024];
+
+    if ( argc > 1 )
+    {
+        strcpy(path, argv[1]);
+    }
+    else
+    {
+        lib_get_app_dir();      // set G_appdir
+        sprintf(path, "%s/resmin", G_appdir);
+    }
+
+    if ( argc > 2 && (M_iterations=atoi(argv[2])) < 1 )
+    {
+        printf("Usage: silgy_minbench [dir] [iterations]\n");
+        return EXIT_FAILURE;
+    }
+
+    if ( path[strlen(path)-1] != '/' )
+        strcat(path, "/");
+
+    printf("Minifying files in %s, %d iteration(s) each\n\n", path, M_iterations);
+    printf("%-40s %10s %10s %10s %10s %10s\n", "file", "size", "old size", "new size", "old MB/s", "new MB/s");
+
+    if ( !bench_dir(path) )
+        return EXIT_FAILURE;
+
+    if ( !M_files )
+    {
+        printf("No CSS or JS files found\n");
+        return EXIT_SUCCESS;
+    }
+
+    printf("\n%-40s %10ld %10ld %10ld %10.1f %10.1f\n", "total", M_total.len, M_total.old_len, M_total.new_len, mbps(M_total.len, M_total.old_time), mbps(M_total.len, M_total.new_time));
+
+    if ( M_total.new_time > 0 )
+        printf("\n%d file(s), new version is %.2fx as fast as the old one\n", M_files, M_total.old_time / M_total.new_time);
+
+    if ( M_differ )
+        printf("%d file(s) minified differently, marked with *\n", M_differ);
+
+    return EXIT_SUCCESS;
+}
+
+
+/* --------------------------------------------------------------------------
+   Bench all CSS and JS files in path and its subdirectories
+   path ends with '/'
+-------------------------------------------------------------------------- */
+static bool bench_dir(const char *path)
+{
+    char    namewpath[1024];
+    DIR     *dir;
+struct dirent *dirent;
+struct stat fstat;
+    char    type;
+    bool    ok=TRUE;
+
+    if ( (dir=opendir(path)) == NULL )
+    {
+        printf("Couldn't open directory %s\n", path);
+        return FALSE;
+    }
+
+    while ( ok && (dirent=readdir(dir)) )
+    {
+        if ( dirent->d_name[0] == '.' )     /* skip ".", ".." and hidden files */
+            continue;
+
+        if ( snprintf(namewpath, sizeof(namewpath), "%s%s", path, dirent->d_name) >= (int)sizeof(namewpath) )
+        {
+            printf("%s%s name is too long, skipping\n", path, dirent->d_name);
+            continue;
+        }
+
+        if ( stat(namewpath, &fstat) != 0 )
+            continue;
+
+        if ( S_ISDIR(fstat.st_mode) )
+        {
+            strcat(namewpath, "/");
+            ok = bench_dir(namewpath);
+        }
+        else if ( S_ISREG(fstat.st_mode) )
+        {
+            type = get_res_type(dirent->d_name);
+
+            if ( type == RES_CSS || type == RES_JS )
+                ok = bench_file(namewpath);
+        }
+    }
+
+    closedir(dir);
+
+    return ok;
+}
+
+
+/* --------------------------------------------------------------------------
+   Minify one file M_iterations times with each version
+-------------------------------------------------------------------------- */
+static bool bench_file(const char *namewpath)
+{
+    FILE    *fsrc;
+struct stat fstat;
+    char    *data;
+    char    *data_old;
+    char    *data_new;
+    bench_res_t res={0};
+    struct timespec start;
+    bool    differ;
+    int     i;
+
+    if ( stat(namewpath, &fstat) != 0 )
+    {
+        printf("stat failed for %s, errno = %d (%s)\n", namewpath, errno, strerror(errno));
+        return FALSE;
+    }
+
+    res.len = fstat.st_size;
+
+    if ( res.len >= OLD_MINIFY_MAX )
+    {
+        printf("%s is too big for the old version, skipping\n", namewpath);
+        return TRUE;
+    }
+
+    if ( NULL == (fsrc=fopen(namewpath, "rb")) )
+    {
+        printf("Couldn't open %s\n", namewpath);
+        return FALSE;
+    }
+
+    data = (char*)malloc(res.len+1);
+    data_old = (char*)malloc(res.len+res.len/3+2);
+    data_new = (char*)malloc(res.len+res.len/3+2);
+
+    if ( !data || !data_old || !data_new )
+    {
+        printf("Couldn't allocate memory for %s\n", namewpath);
+        free(data);
+        free(data_old);
+        free(data_new);
+        fclose(fsrc);
+        return FALSE;
+    }
+
+    if ( res.len && fread(data, res.len, 1, fsrc) != 1 )
+    {
+        printf("Couldn't read %s\n", namewpath);
+        free(data);
+        free(data_old);
+        free(data_new);
+        fclose(fsrc);
+        return FALSE;
+    }
+
+    fclose(fsrc);
+
+    data[res.len] = EOS;
+
+    /* interleave the versions so that neither gets a warmer cache */
+
+    for ( i=0; i<M_iterations; ++i )
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res.old_len = old_minify(data_old, data);
+        res.old_time += elapsed(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        res.new_len = silgy_minify(data_new, data);
+        res.new_time += elapsed(&start);
+    }
+
+    differ = (res.old_len != res.new_len || memcmp(data_old, data_new, res.new_len) != 0);
+
+    if ( differ )
+        ++M_differ;
+
+    printf("%-40s %10ld %10ld %10ld %10.1f %10.1f%s\n", namewpath, res.len, res.old_len, res.new_len, mbps(res.len, res.old_time), mbps(res.len, res.new_time), differ?" *":"");
+
+    M_total.len += res.len;
+    M_total.old_len += res.old_len;
+    M_total.new_len += res.new_len;
+    M_total.old_time += res.old_time;
+    M_total.new_time += res.new_time;
+
+    ++M_files;
+
+    free(data);
+    free(data_old);
+    free(data_new);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Return seconds since start
+-------------------------------------------------------------------------- */
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+/* --------------------------------------------------------------------------
+   Return throughput in MB/s for all iterations
+-------------------------------------------------------------------------- */
+static double mbps(long len, double secs)
+{
+    if ( secs <= 0 )
+        return 0;
+
+    return (double)len * M_iterations / 1048576 / secs;
+}
+
+
+/* --------------------------------------------------------------------------
+   Old version of silgy_minify -- two passes through a static temp buffer
+   Kept here for comparison
+-------------------------------------------------------------------------- */
+static int old_minify(char *dest, const char *src)
+{
+static char *temp=NULL;     /* was a static array, allocated once here */
+
+    if ( !temp && NULL == (temp=(char*)malloc(OLD_MINIFY_MAX)) )
+    {
+        printf("Couldn't allocate %d bytes for the old version\n", OLD_MINIFY_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    old_minify_1(temp, src);
+    return old_minify_2(dest, temp);
+}
+
+
+/* --------------------------------------------------------------------------
+   First pass -- only remove comments
+-------------------------------------------------------------------------- */
+static void old_minify_1(char *dest, const char *src)
+{
+    long    len;            /* was int, long keeps -Warray-bounds quiet */
+    long    i;
+    long    j=0;
+    bool    opensq=FALSE;       /* single quote */
+    bool    opendq=FALSE;       /* double quote */
+    bool    openco=FALSE;       /* comment */
+    bool    opensc=FALSE;       /* star comment */
+
+    len = strlen(src);
+
+    for ( i=0; i<len; ++i )
+    {
+        if ( !openco && !opensc && !opensq && src[i]=='"' && (i==0 || (i>0 && src[i-1]!='\\')) )
+        {
+            if ( !opendq )
+                opendq = TRUE;
+            else
+                opendq = FALSE;
+        }
+        else if ( !openco && !opensc && !opendq && src[i]=='\'' )
+        {
+            if ( !opensq )
+                opensq = TRUE;
+            else
+                opensq = FALSE;
+        }
+        else if ( !opensq && !opendq && !openco && !opensc && src[i]=='/' && src[i+1] == '/' )
+        {
+            openco = TRUE;
+        }
+        else if ( !opensq && !opendq && !openco && !opensc && src[i]=='/' && src[i+1] == '*' )
+        {
+            opensc = TRUE;
+        }
+        else if ( openco && src[i]=='\n' )
+        {
+            openco = FALSE;
+        }
+        else if ( opensc && src[i]=='*' && src[i+1]=='/' )
+        {
+            opensc = FALSE;
+            i += 2;
+        }
+
+        if ( !openco && !opensc )       /* unless it's a comment ... */
+            dest[j++] = src[i];
+    }
+
+    dest[j] = EOS;
+}
+
+
+/* --------------------------------------------------------------------------
+   Second pass -- remove white spaces
+   return new length
+-------------------------------------------------------------------------- */
+static int old_minify_2(char *dest, const char *src)
+{
+    int     len;
+    int     i;
+    int     j=0;
+    bool    opensq=FALSE;       /* single quote */
+    bool    opendq=FALSE;       /* double quote */
+    bool    openbr=FALSE;       /* curly braces */
+    bool    openwo=FALSE;       /* word */
+    bool    opencc=FALSE;       /* colon */
+    bool    skip_ws=FALSE;      /* skip white spaces */
+    char    word[256]="";
+    int     wi=0;               /* word index */
+
+    len = strlen(src);
+
+    for ( i=0; i<len; ++i )
+    {
+        if ( !opensq && src[i]=='"' && (i==0 || (i>0 && src[i-1]!='\\')) )
+        {
+            if ( !opendq )
+                opendq = TRUE;
+            else
+                opendq = FALSE;
+        }
+        else if ( !opendq && src[i]=='\'' )
+        {
+            if ( !opensq )
+                opensq = TRUE;
+            else
+                opensq = FALSE;
+        }
+        else if ( !opensq && !opendq && !openbr && src[i]=='{' )
+        {
+            openbr = TRUE;
+            openwo = FALSE;
+            wi = 0;
+            skip_ws = TRUE;
+        }
+        else if ( !opensq && !opendq && openbr && src[i]=='}' )
+        {
+            openbr = FALSE;
+            openwo = FALSE;
+            wi = 0;
+            skip_ws = TRUE;
+        }
+        else if ( !opensq && !opendq && openbr && !opencc && src[i]==':' )
+        {
+            opencc = TRUE;
+            openwo = FALSE;
+            wi = 0;
+            skip_ws = TRUE;
+        }
+        else if ( !opensq && !opendq && opencc && src[i]==';' )
+        {
+            opencc = FALSE;
+            openwo = FALSE;
+            wi = 0;
+            skip_ws = TRUE;
+        }
+        else if ( !opensq && !opendq && !opencc && !openwo && (isalpha(src[i]) || src[i]=='|' || src[i]=='&') ) /* word is starting */
+        {
+            openwo = TRUE;
+        }
+        else if ( !opensq && !opendq && openwo && !isalnum(src[i]) && src[i]!='_' && src[i]!='|' && src[i]!='&' )   /* end of word */
+        {
+            word[wi] = EOS;
+            if ( 0==strcmp(word, "var")
+                    || (0==strcmp(word, "function") && src[i]!='(')
+                    || (0==strcmp(word, "else") && src[i]!='{')
+                    || 0==strcmp(word, "new")
+                    || (0==strcmp(word, "return") && src[i]!=';')
+                    || 0==strcmp(word, "||")
+                    || 0==strcmp(word, "&&") )
+                dest[j++] = ' ';
+            openwo = FALSE;
+            wi = 0;
+            skip_ws = TRUE;
+        }
+
+        if ( opensq || opendq
+                || src[i+1] == '|' || src[i+1] == '&'
+                || (src[i] != ' ' && src[i] != '\t' && src[i] != '\n' && src[i] != '\r')
+                || opencc )
+            dest[j++] = src[i];
+
+        if ( openwo && wi < 255 )     /* the only change -- don't overflow on long words */
+            word[wi++] = src[i];
+
+        if ( skip_ws )
+        {
+            while ( src[i+1] && (src[i+1]==' ' || src[i+1]=='\t' || src[i+1]=='\n' || src[i+1]=='\r') ) ++i;
+            skip_ws = FALSE;
+        }
+    }
+
+    dest[j] = EOS;
+
+    return j;
+}
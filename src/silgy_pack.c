@@ -0,0 +1,317 @@
+/* --------------------------------------------------------------------------
+   Pack static resources into one bundle for Silgy app to map on startup
+   res is stored as is, resmin minified, text ones also compressed
+   Jurek Muszynski
+-------------------------------------------------------------------------- */
+
+#include "silgy.h"
+
+
+static stat_bundle_entry_t M_entry[MAX_STATICS];
+static int M_cnt=0;
+
+
+static bool pack_dir(FILE *fd, const char *path, bool minify);
+static bool pack_file(FILE *fd, const char *name, const char *namewpath, bool minify);
+static long write_data(FILE *fd, const char *data, long len);
+static int entry_cmp(const void *a, const void *b);
+
+
+/* --------------------------------------------------------------------------
+   main
+-------------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+    char    bundle[512];
+    char    bundle_tmp[520];
+    FILE    *fd;
+    stat_bundle_hdr_t hdr;
+
+    lib_get_app_dir();      // set G_appdir
+
+    if ( argc > 1 )
+        strcpy(bundle, argv[1]);
+    else
+        sprintf(bundle, "%s/bin/%s", G_appdir, STAT_BUNDLE_FILE);
+
+    /* write to temp and rename, so running app keeps its mapping intact */
+
+    sprintf(bundle_tmp, "%s.tmp", bundle);
+
+    if ( NULL == (fd=fopen(bundle_tmp, "wb")) )
+    {
+        printf("Couldn't open %s, errno = %d (%s)\n", bundle_tmp, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* leave space for the index */
+
+    fseek(fd, sizeof(stat_bundle_hdr_t) + MAX_STATICS * sizeof(stat_bundle_entry_t), SEEK_SET);
+
+    if ( !pack_dir(fd, "", FALSE) || !pack_dir(fd, "", TRUE) )
+    {
+        fclose(fd);
+        remove(bundle_tmp);
+        return EXIT_FAILURE;
+    }
+
+    /* index */
+
+    qsort(M_entry, M_cnt, sizeof(stat_bundle_entry_t), entry_cmp);
+
+    memset(&hdr, 0, sizeof(stat_bundle_hdr_t));
+    memcpy(hdr.magic, STAT_BUNDLE_MAGIC, 8);
+    hdr.cnt = M_cnt;
+#ifdef GZIP
+    hdr.gzip = TRUE;
+#endif
+#ifdef BROTLI
+    hdr.brotli = TRUE;
+#endif
+
+    rewind(fd);
+    fwrite(&hdr, sizeof(stat_bundle_hdr_t), 1, fd);
+    fwrite(M_entry, sizeof(stat_bundle_entry_t), MAX_STATICS, fd);
+
+    if ( fclose(fd) != 0 || rename(bundle_tmp, bundle) != 0 )
+    {
+        printf("Couldn't write %s, errno = %d (%s)\n", bundle, errno, strerror(errno));
+        remove(bundle_tmp);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d static resources packed into %s\n", M_cnt, bundle);
+
+    return EXIT_SUCCESS;
+}
+
+
+/* --------------------------------------------------------------------------
+   Pack all files from res or resmin and their subdirectories
+   path is relative to res or resmin, "" or ending with '/'
+   Missing directory is not an error
+-------------------------------------------------------------------------- */
+static bool pack_dir(FILE *fd, const char *path, bool minify)
+{
+    char    resdir[1024];
+    char    name[256];
+    char    namewpath[1024];
+    DIR     *dir;
+struct dirent *dirent;
+struct stat fstat;
+    bool    ok;
+
+    sprintf(resdir, "%s/%s/%s", G_appdir, minify?"resmin":"res", path);
+
+    if ( (dir=opendir(resdir)) == NULL )
+    {
+        printf("Couldn't open directory %s\n", resdir);
+        return TRUE;
+    }
+
+    while ( (dirent=readdir(dir)) )
+    {
+        if ( dirent->d_name[0] == '.' )     /* skip ".", ".." and hidden files */
+            continue;
+
+        if ( snprintf(name, sizeof(name)-1, "%s%s", path, dirent->d_name) >= (int)sizeof(name)-1    /* leave room for '/' */
+                || snprintf(namewpath, sizeof(namewpath), "%s%s", resdir, dirent->d_name) >= (int)sizeof(namewpath) )
+        {
+            printf("%s%s name is too long, skipping\n", path, dirent->d_name);
+            continue;
+        }
+
+        if ( M_cnt == MAX_STATICS )
+        {
+            printf("Too many static resources, MAX_STATICS = %d\n", MAX_STATICS);
+            closedir(dir);
+            return FALSE;
+        }
+
+        if ( stat(namewpath, &fstat) == 0 && S_ISDIR(fstat.st_mode) )
+        {
+            strcat(name, "/");
+            ok = pack_dir(fd, name, minify);
+        }
+        else
+            ok = pack_file(fd, name, namewpath, minify);
+
+        if ( !ok )
+        {
+            closedir(dir);
+            return FALSE;
+        }
+    }
+
+    closedir(dir);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Append file's data and variants, fill in its index entry
+-------------------------------------------------------------------------- */
+static bool pack_file(FILE *fd, const char *name, const char *namewpath, bool minify)
+{
+    stat_bundle_entry_t *e=&M_entry[M_cnt];
+    FILE    *fsrc;
+struct stat fstat;
+    char    *data;
+    char    *data_min;
+    long    len;
+    char    type;
+#ifdef GZIP
+    z_stream zs;
+    char    *data_gz;
+    long    gz_len;
+#endif
+#ifdef BROTLI
+    char    *data_br;
+    size_t  br_len;
+#endif
+
+    if ( stat(namewpath, &fstat) != 0 )
+    {
+        printf("stat failed for %s, errno = %d (%s)\n", namewpath, errno, strerror(errno));
+        return FALSE;
+    }
+
+    if ( !S_ISREG(fstat.st_mode) )
+        return TRUE;
+
+    if ( NULL == (fsrc=fopen(namewpath, "rb")) )
+    {
+        printf("Couldn't open %s\n", namewpath);
+        return FALSE;
+    }
+
+    len = fstat.st_size;
+
+    if ( NULL == (data=(char*)malloc(len+1)) )
+    {
+        printf("Couldn't allocate %ld bytes for %s\n", len+1, name);
+        fclose(fsrc);
+        return FALSE;
+    }
+
+    if ( len && fread(data, len, 1, fsrc) != 1 )
+    {
+        printf("Couldn't read %s\n", namewpath);
+        free(data);
+        fclose(fsrc);
+        return FALSE;
+    }
+
+    fclose(fsrc);
+
+    data[len] = EOS;
+
+    if ( minify )
+    {
+        if ( NULL == (data_min=(char*)malloc(len+len/3+2)) )
+        {
+            printf("Couldn't allocate %ld bytes for %s\n", len+len/3+2, name);
+            free(data);
+            return FALSE;
+        }
+
+        len = silgy_minify(data_min, data);
+        free(data);
+        data = data_min;
+    }
+
+    memset(e, 0, sizeof(stat_bundle_entry_t));
+
+    strcpy(e->name, name);
+    e->minified = minify;
+    e->modified = fstat.st_mtime;
+    e->src_len = fstat.st_size;
+    sprintf(e->etag, "%016llx", (unsigned long long)lib_hash64(data, len));
+    e->off = write_data(fd, data, len);
+    e->len = len;
+
+    /* compressed variants -- same rules as in the app */
+
+    type = get_res_type(name);
+
+    if ( len >= STAT_COMPRESS_MIN && (type == RES_TEXT || type == RES_HTML || type == RES_CSS || type == RES_JS) )
+    {
+#ifdef GZIP
+        memset(&zs, 0, sizeof(z_stream));
+
+        if ( deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY) == Z_OK )  /* 15+16 = gzip wrapper */
+        {
+            gz_len = deflateBound(&zs, len);
+
+            if ( NULL != (data_gz=(char*)malloc(gz_len)) )
+            {
+                zs.next_in = (Bytef*)data;
+                zs.avail_in = len;
+                zs.next_out = (Bytef*)data_gz;
+                zs.avail_out = gz_len;
+
+                if ( deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < len )
+                {
+                    e->len_gz = zs.total_out;
+                    e->off_gz = write_data(fd, data_gz, e->len_gz);
+                }
+
+                free(data_gz);
+            }
+
+            deflateEnd(&zs);
+        }
+#endif  /* GZIP */
+#ifdef BROTLI
+        br_len = BrotliEncoderMaxCompressedSize(len);
+
+        if ( br_len && NULL != (data_br=(char*)malloc(br_len)) )
+        {
+            if ( BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, (const uint8_t*)data, &br_len, (uint8_t*)data_br) && br_len < len )
+            {
+                e->len_br = br_len;
+                e->off_br = write_data(fd, data_br, e->len_br);
+            }
+
+            free(data_br);
+        }
+#endif  /* BROTLI */
+    }
+
+    free(data);
+
+    printf("%s %s%10ld Bytes%s%s\n", lib_add_spaces(name, 28), minify?"resmin":"res   ", len, e->off_gz?", gzip":"", e->off_br?", br":"");
+
+    ++M_cnt;
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Append data to the bundle, return its offset
+-------------------------------------------------------------------------- */
+static long write_data(FILE *fd, const char *data, long len)
+{
+    long off=ftell(fd);
+
+    fwrite(data, len, 1, fd);
+
+    return off;
+}
+
+
+/* --------------------------------------------------------------------------
+   Compare index entries by minified & name (qsort)
+-------------------------------------------------------------------------- */
+static int entry_cmp(const void *a, const void *b)
+{
+    const stat_bundle_entry_t *ea=(const stat_bundle_entry_t*)a;
+    const stat_bundle_entry_t *eb=(const stat_bundle_entry_t*)b;
+
+    if ( ea->minified != eb->minified )
+        return ea->minified - eb->minified;
+
+    return strcmp(ea->name, eb->name);
+}
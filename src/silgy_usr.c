@@ -82,7 +82,7 @@ static bool start_new_luses(int ci, long uid, const char *login, const char *ema
     strcpy(conn[ci].cookie_out_a_exp, G_last_modified);     /* to be removed by browser */
 
     US.logged = TRUE;
-    strcpy(US.sesid, sesid);
+    eng_uses_set_sesid(conn[ci].usi, sesid);
     strcpy(US.login, login);
     strcpy(US.email, email);
     strcpy(US.name, name);
@@ -116,9 +116,9 @@ unsigned long   sql_records;
 
     /* try in hot sessions first */
 
-    for ( i=1; i<=MAX_SESSIONS; ++i )
+    if ( (i=eng_uses_hold(conn[ci].cookie_in_l)) )
     {
-        if ( uses[i].sesid[0] && uses[i].logged && 0==strcmp(conn[ci].cookie_in_l, uses[i].sesid)
+        if ( uses[i].logged
 /*              && 0==strcmp(conn[ci].ip, uses[i].ip) */
                 && 0==strcmp(conn[ci].uagent, uses[i].uagent) )
         {
@@ -126,6 +126,8 @@ unsigned long   sql_records;
             conn[ci].usi = i;
             return OK;
         }
+
+        eng_uses_release(i);
     }
 
     /* not found in memory -- try database */
@@ -212,24 +214,6 @@ unsigned long   sql_records;
 }
 
 
-/* --------------------------------------------------------------------------
-  close timeouted logged in user sessions
--------------------------------------------------------------------------- */
-void libusr_close_luses_timeout()
-{
-    int     i;
-    time_t  last_allowed;
-
-    last_allowed = G_now - LUSES_TIMEOUT;
-
-    for (i=1; i<=G_sessions; ++i)
-    {
-        if ( uses[i].logged && uses[i].last_activity < last_allowed )
-            libusr_close_l_uses(-1, i);
-    }
-}
-
-
 /* --------------------------------------------------------------------------
    Close  / downgrade logged in user session
    If ci != -1 it was on user demand
@@ -643,10 +627,10 @@ unsigned long   sql_records;
     {
         DBG("keep is ON!");
         sometimeahead = G_now + 3600*24*30; /* 30 days */
-        G_ptm = gmtime(&sometimeahead);
+        G_ptm = lib_gmtime(&sometimeahead);
         strftime(conn[ci].cookie_out_l_exp, 32, "%a, %d %b %Y %T GMT", G_ptm);
 //      DBG("conn[ci].cookie_out_l_exp: [%s]", conn[ci].cookie_out_l_exp);
-        G_ptm = gmtime(&G_now); /* make sure G_ptm is always up to date */
+        G_ptm = lib_gmtime(&G_now); /* make sure G_ptm is always up to date */
     }
 
     /* finish logging user in */
@@ -799,10 +783,10 @@ int libusr_do_create_acc(int ci)
 -------------------------------------------------------------------------- */
 int libusr_do_contact(int ci)
 {
-static char message[MAX_LONG_URI_VAL_LEN+1];
-static char sanmessage[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char message[MAX_LONG_URI_VAL_LEN+1];
+static THREAD_LOCAL char sanmessage[MAX_LONG_URI_VAL_LEN+1];
     QSVAL   email;
-static char sql_query[MAX_LONG_URI_VAL_LEN*2];
+static THREAD_LOCAL char sql_query[MAX_LONG_URI_VAL_LEN*2];
 
     DBG("libusr_do_contact");
 
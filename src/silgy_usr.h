@@ -95,7 +95,6 @@ int libusr_do_passwd_reset(int ci);
 int libusr_valid_linkkey(int ci, char *linkkey, long *uid);
 void libusr_log_out(int ci);
 int libusr_l_usession_ok(int ci);
-void libusr_close_luses_timeout(void);
 void libusr_close_l_uses(int ci, int usi);
 int libusr_sets(int ci, const char *us_key, const char *us_val);
 int libusr_gets(int ci, const char *us_key, char *us_val);